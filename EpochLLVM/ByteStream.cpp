@@ -0,0 +1,127 @@
+#include "stdafx.h"
+
+#include "ByteStream.h"
+
+
+ByteStreamWriter::ByteStreamWriter(size_t capacity)
+{
+	Data.reserve(capacity);
+}
+
+
+void ByteStreamWriter::EmitByte(uint8_t value)
+{
+	Data.push_back(static_cast<char>(value));
+}
+
+void ByteStreamWriter::EmitInteger16(uint16_t value)
+{
+	char bytes[2] = { static_cast<char>(value), static_cast<char>(value >> 8) };
+	Data.insert(Data.end(), bytes, bytes + sizeof(bytes));
+}
+
+void ByteStreamWriter::EmitInteger(uint32_t value)
+{
+	char bytes[4] = { static_cast<char>(value), static_cast<char>(value >> 8), static_cast<char>(value >> 16), static_cast<char>(value >> 24) };
+	Data.insert(Data.end(), bytes, bytes + sizeof(bytes));
+}
+
+void ByteStreamWriter::EmitInteger64(uint64_t value)
+{
+	EmitInteger(static_cast<uint32_t>(value));
+	EmitInteger(static_cast<uint32_t>(value >> 32));
+}
+
+
+void ByteStreamWriter::EmitBytes(const void* data, size_t size)
+{
+	const char* bytes = static_cast<const char*>(data);
+	Data.insert(Data.end(), bytes, bytes + size);
+}
+
+//
+// Emit the string without a terminator, then zeros up to width bytes
+//
+// Strings longer than width are emitted whole, so a width of zero
+// emits exactly the characters of the string.
+//
+void ByteStreamWriter::EmitString(const std::string& str, size_t width)
+{
+	size_t start = Data.size();
+	Data.insert(Data.end(), str.begin(), str.end());
+	EmitPadding(start + width);
+}
+
+
+//
+// Emit zeros until the stream is targetoffset bytes long
+//
+void ByteStreamWriter::EmitPadding(size_t targetoffset)
+{
+	if (Data.size() < targetoffset)
+		Data.resize(targetoffset, 0);
+}
+
+//
+// Emit zeros until the stream length is a multiple of alignment
+//
+void ByteStreamWriter::EmitAlignment(size_t alignment)
+{
+	if (alignment > 1)
+		EmitPadding((Data.size() + alignment - 1) / alignment * alignment);
+}
+
+
+//
+// Leave size zero bytes to be filled in later, returning their offset
+//
+size_t ByteStreamWriter::Reserve(size_t size)
+{
+	size_t offset = Data.size();
+	Data.resize(offset + size, 0);
+	return offset;
+}
+
+bool ByteStreamWriter::PatchInteger16(size_t offset, uint16_t value)
+{
+	if (offset + 2 > Data.size())
+		return false;
+
+	Data[offset] = static_cast<char>(value);
+	Data[offset + 1] = static_cast<char>(value >> 8);
+	return true;
+}
+
+bool ByteStreamWriter::PatchInteger(size_t offset, uint32_t value)
+{
+	if (offset + 4 > Data.size())
+		return false;
+
+	Data[offset] = static_cast<char>(value);
+	Data[offset + 1] = static_cast<char>(value >> 8);
+	Data[offset + 2] = static_cast<char>(value >> 16);
+	Data[offset + 3] = static_cast<char>(value >> 24);
+	return true;
+}
+
+
+//
+// Write the whole stream at the file's current position
+//
+bool ByteStreamWriter::WriteFile(HANDLE file, size_t* outWritten) const
+{
+	*outWritten = 0;
+
+	while (*outWritten < Data.size())
+	{
+		DWORD chunk = static_cast<DWORD>(std::min<size_t>(Data.size() - *outWritten, 0x40000000));
+		DWORD written = 0;
+		if (!::WriteFile(file, Data.data() + *outWritten, chunk, &written, nullptr) || written == 0)
+			return false;
+
+		*outWritten += written;
+	}
+
+	return true;
+}
+
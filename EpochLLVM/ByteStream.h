@@ -0,0 +1,55 @@
+#pragma once
+
+
+//
+// Growable little-endian byte stream for the linker and PDB writers
+//
+// The Epoch-side ByteStreamEmit* helpers write one byte per call into a
+// buffer whose size has to be guessed up front. This takes whole fields,
+// strings and blocks in one call each, and grows as needed. A field whose
+// value is only known after later data has been written can be reserved
+// and patched afterwards. The finished bytes go straight to a file handle
+// instead of being copied back into an Epoch buffer first.
+//
+
+
+class ByteStreamWriter
+{
+public:
+	explicit ByteStreamWriter(size_t capacity);
+
+	ByteStreamWriter(const ByteStreamWriter&) = delete;
+	ByteStreamWriter& operator=(const ByteStreamWriter&) = delete;
+
+public:
+	void EmitByte(uint8_t value);
+	void EmitInteger16(uint16_t value);
+	void EmitInteger(uint32_t value);
+	void EmitInteger64(uint64_t value);
+
+	void EmitBytes(const void* data, size_t size);
+	void EmitString(const std::string& str, size_t width);
+
+	void EmitPadding(size_t targetoffset);
+	void EmitAlignment(size_t alignment);
+
+	size_t Reserve(size_t size);
+	bool PatchInteger16(size_t offset, uint16_t value);
+	bool PatchInteger(size_t offset, uint32_t value);
+
+	bool WriteFile(HANDLE file, size_t* outWritten) const;
+
+	size_t GetSize() const
+	{
+		return Data.size();
+	}
+
+	void Clear()
+	{
+		Data.clear();
+	}
+
+private:
+	std::vector<char> Data;
+};
+
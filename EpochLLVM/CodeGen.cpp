@@ -1,17 +1,19 @@
 #include "stdafx.h"
 
 #include "CodeGen.h"
+#include "ProfileFormat.h"
 
 
 using namespace llvm;
 
 
+#pragma comment(lib, "psapi.lib")
+
 
 
 namespace CodeGenInternal
 {
 
-	typedef size_t(__stdcall *ThunkCallbackT)(const wchar_t* thunkname);
 	typedef size_t(__stdcall *StringCallbackT)(size_t stringhandle);
 
 	//
@@ -26,17 +28,30 @@ namespace CodeGenInternal
 	class TrivialMemoryManager : public RTDyldMemoryManager
 	{
 	public:
-		TrivialMemoryManager(ThunkCallbackT funcptr, StringCallbackT strptr, uint64_t* outAddr, size_t* outSize, uint64_t* outPData, size_t* outPDataSize, uint64_t* outXData, size_t* outXDataSize)
-			: ThunkCallback(funcptr),
+		TrivialMemoryManager(const std::map<std::string, uint64_t>* thunkaddresses, StringCallbackT strptr, uint64_t* outAddr, size_t* outSize, uint64_t* outPData, size_t* outPDataSize, uint64_t* outXData, size_t* outXDataSize, uint64_t* outGlobals, size_t* outGlobalsSize, uint64_t* outStrings, size_t* outStringsSize)
+			: ThunkAddresses(thunkaddresses),
 			StringCallback(strptr),
 			OutAddr(outAddr),
 			OutSize(outSize),
 			OutPDataOffset(outPData),
 			OutPDataSize(outPDataSize),
 			OutXDataOffset(outXData),
-			OutXDataSize(outXDataSize)
+			OutXDataSize(outXDataSize),
+			OutGlobalsOffset(outGlobals),
+			OutGlobalsSize(outGlobalsSize),
+			OutStringsOffset(outStrings),
+			OutStringsSize(outStringsSize)
 		{ }
 
+		~TrivialMemoryManager() override
+		{
+			for (auto& block : FunctionMemory)
+				sys::Memory::releaseMappedMemory(block);
+
+			for (auto& block : DataMemory)
+				sys::Memory::releaseMappedMemory(block);
+		}
+
 		uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, StringRef SectionName) override;
 		uint8_t* allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, StringRef SectionName, bool IsReadOnly) override;
 
@@ -56,7 +71,7 @@ namespace CodeGenInternal
 		unsigned GCDataAddress;
 
 	private:		// Internal state
-		ThunkCallbackT ThunkCallback;
+		const std::map<std::string, uint64_t>* ThunkAddresses;
 		StringCallbackT StringCallback;
 
 		uint64_t* OutAddr;
@@ -66,6 +81,10 @@ namespace CodeGenInternal
 		size_t* OutPDataSize;
 		uint64_t* OutXDataOffset;
 		size_t* OutXDataSize;
+		uint64_t* OutGlobalsOffset;
+		size_t* OutGlobalsSize;
+		uint64_t* OutStringsOffset;
+		size_t* OutStringsSize;
 
 		SmallVector<sys::MemoryBlock, 16> FunctionMemory;
 		SmallVector<sys::MemoryBlock, 16> DataMemory;
@@ -98,6 +117,16 @@ namespace CodeGenInternal
 			*OutXDataOffset = (uint64_t)MB.base();
 			*OutXDataSize = Size;
 		}
+		else if (SectionName == ".global")
+		{
+			*OutGlobalsOffset = (uint64_t)MB.base();
+			*OutGlobalsSize = Size;
+		}
+		else if (SectionName == ".strings")
+		{
+			*OutStringsOffset = (uint64_t)MB.base();
+			*OutStringsSize = Size;
+		}
 
 		DataMemory.push_back(MB);
 		return (uint8_t*)MB.base();
@@ -109,14 +138,14 @@ namespace CodeGenInternal
 	// We support two kinds of symbol resolution: static strings, and thunk functions.
 	// Static strings are magically identified by a prefix token. They are mapped by a
 	// lookup table in the Epoch compiler itself, and we simply ask the compiler for a
-	// concrete address for each string. Thunk functions are the same basic setup, but
-	// without a name prefix token. Therefore, any symbol that isn't a string is going
-	// to be resolved as a thunk.
+	// concrete address for each string. Thunk functions resolve to the import address
+	// table slot that the linker reported for them via SetThunkImportAddress.
 	//
 	uint64_t TrivialMemoryManager::getSymbolAddress(const std::string& symbolName)
 	{
-		if(symbolName == "print")
-			return 0x401000 + 88;
+		auto thunk = ThunkAddresses->find(symbolName);
+		if (thunk != ThunkAddresses->end())
+			return thunk->second;
 
 		if (symbolName.substr(0, 21) == "@epoch_static_string:")
 		{
@@ -133,10 +162,60 @@ namespace CodeGenInternal
 	}
 
 
+	//
+	// Target machines for in-process code generation
+	//
+	// Machines are built once and then kept for the life of the process,
+	// along with the subtargets each one caches, so a compile server pays
+	// for them on its first request only. A context takes a machine while
+	// it generates code and gives it back afterwards; contexts working at
+	// the same time each get their own.
+	//
+	std::mutex TargetMachinePoolMutex;
+	std::vector<std::unique_ptr<TargetMachine>> TargetMachinePool;
+
+	std::unique_ptr<TargetMachine> AcquireTargetMachine()
+	{
+		{
+			std::lock_guard<std::mutex> lock(TargetMachinePoolMutex);
+			if (!TargetMachinePool.empty())
+			{
+				std::unique_ptr<TargetMachine> machine = std::move(TargetMachinePool.back());
+				TargetMachinePool.pop_back();
+				return machine;
+			}
+		}
+
+		std::string errstr;
+		Triple triple("x86_64-pc-windows-msvc");
+		const Target* target = TargetRegistry::lookupTarget(triple.getTriple(), errstr);
+		if (!target)
+		{
+			std::cout << "Cannot find target " << triple.getTriple() << ": " << errstr << std::endl;
+			return nullptr;
+		}
+
+		TargetOptions opts;
+		opts.UnsafeFPMath = true;
+		opts.AllowFPOpFusion = FPOpFusion::Fast;
+		opts.EnableFastISel = false;
+		opts.GuaranteedTailCallOpt = true;
+
+		// Configured as a JIT target, as MCJIT used to build it, so the code model and relocations are unchanged
+		return std::unique_ptr<TargetMachine>(target->createTargetMachine(triple.getTriple(), "", "", opts, None, None, CodeGenOpt::Default, true));
+	}
+
+	void ReleaseTargetMachine(std::unique_ptr<TargetMachine> machine)
+	{
+		std::lock_guard<std::mutex> lock(TargetMachinePoolMutex);
+		TargetMachinePool.push_back(std::move(machine));
+	}
+
+
 	//
 	// Batch relocate all .pdata RUNTIME_FUNCTION structures to the correct offsets
 	//
-	void ProcessPDataRelocations(const object::SectionRef& section, char* buffer, size_t bufferSize, unsigned xdataoffset, unsigned textoffset)
+	void ProcessPDataRelocations(const object::SectionRef& section, char* buffer, size_t bufferSize, unsigned xdataoffset, unsigned textoffset, const std::map<uint32_t, uint32_t>& xdataremap)
 	{
 		size_t numrecords = bufferSize / sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
 		IMAGE_RUNTIME_FUNCTION_ENTRY* data = reinterpret_cast<IMAGE_RUNTIME_FUNCTION_ENTRY*>(buffer);
@@ -157,12 +236,123 @@ namespace CodeGenInternal
 				break;
 
 			case offsetof(IMAGE_RUNTIME_FUNCTION_ENTRY, UnwindInfoAddress):
+				{
+					auto remapped = xdataremap.find(data[recordIndex].UnwindInfoAddress);
+					if (remapped != xdataremap.end())
+						data[recordIndex].UnwindInfoAddress = remapped->second;
+				}
 				data[recordIndex].UnwindInfoAddress += xdataoffset;
 				break;
 			}
 		}
 	}
 
+	//
+	// Fold byte-identical UNWIND_INFO records in .xdata together
+	//
+	// The section is compacted in place, and the returned map gives the new
+	// offset of every record, keyed by its original offset, for rewriting the
+	// .pdata entries that refer to it. If any record carries a handler or a
+	// chained entry, its true length is not known from the record alone, so
+	// nothing is folded and the map is empty.
+	//
+	std::map<uint32_t, uint32_t> DeduplicateUnwindInfo(const object::SectionRef& pdatasection, char* xdata, size_t* xdataSize)
+	{
+		std::map<uint32_t, uint32_t> remap;
+
+		StringRef pdata;
+		pdatasection.getContents(pdata);
+
+		std::set<uint32_t> recordoffsets;
+		for (const auto& reloc : pdatasection.relocations())
+		{
+			if (reloc.getOffset() % sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY) != offsetof(IMAGE_RUNTIME_FUNCTION_ENTRY, UnwindInfoAddress))
+				continue;
+
+			uint32_t offset = 0;
+			memcpy(&offset, pdata.data() + reloc.getOffset(), sizeof(offset));
+			recordoffsets.insert(offset);
+		}
+
+		std::map<std::string, uint32_t> uniquerecords;
+		std::vector<char> compacted;
+		for (uint32_t offset : recordoffsets)
+		{
+			const uint8_t* record = reinterpret_cast<const uint8_t*>(xdata + offset);
+			if (offset + 4 > *xdataSize || (record[0] >> 3) != 0)
+				return std::map<uint32_t, uint32_t>();
+
+			// Header, then unwind codes padded to an even count
+			size_t length = 4 + ((record[2] + 1) & ~1) * 2;
+			std::string contents(xdata + offset, length);
+
+			auto existing = uniquerecords.find(contents);
+			if (existing != uniquerecords.end())
+			{
+				remap[offset] = existing->second;
+				continue;
+			}
+
+			uint32_t newoffset = static_cast<uint32_t>(compacted.size());
+			compacted.insert(compacted.end(), contents.begin(), contents.end());
+			uniquerecords[contents] = newoffset;
+			remap[offset] = newoffset;
+		}
+
+		std::copy(compacted.begin(), compacted.end(), xdata);
+		*xdataSize = compacted.size();
+		return remap;
+	}
+
+	uint64_t CountInstructions(const Function& func)
+	{
+		uint64_t count = 0;
+		for (const auto& block : func)
+			count += block.size();
+
+		return count;
+	}
+
+	unsigned CountFunctionDefinitions(const Module& module)
+	{
+		unsigned count = 0;
+		for (const auto& func : module)
+		{
+			if (!func.isDeclaration())
+				++count;
+		}
+
+		return count;
+	}
+
+
+	//
+	// Private bytes committed by the compiler process, for checking against /maxmem:
+	//
+	uint64_t GetPrivateMemoryUsage()
+	{
+		PROCESS_MEMORY_COUNTERS_EX counters;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters)))
+			return 0;
+
+		return counters.PrivateUsage;
+	}
+
+	// Rough ceiling on transient code generation memory per IR instruction, including the cloned IR
+	const uint64_t CodeGenBytesPerInstruction = 1024;
+
+	// Batches never shrink below this, however little of the budget is left
+	const uint64_t MinimumBatchInstructions = 4096;
+
+	// Each .debug$S section opens with CV_SIGNATURE_C13
+	const size_t CodeViewSignatureSize = 4;
+
+	// Lines of LinkedProgram.epoch set aside for each function, in the order the front end creates them
+	const unsigned DebugLinesPerFunction = 1000;
+
+	// CodeView line records hold a 24-bit line number
+	const unsigned MaxCodeViewLine = 0xFFFFFF;
+
 
 #include <pshpack1.h>
 	struct Relocation
@@ -184,7 +374,10 @@ namespace CodeGenInternal
 		}
 	}
 
-	void ProcessArbitraryRelocations(const object::SectionRef& section, std::vector<char>* buffer)
+	//
+	// Record the relocations of a debug section, shifted to its position in the combined section
+	//
+	void ProcessArbitraryRelocations(const object::SectionRef& section, std::vector<char>* buffer, uint32_t addressbase, unsigned symbolbase)
 	{
 		for (const auto& reloc : section.relocations())
 		{
@@ -199,383 +392,3842 @@ namespace CodeGenInternal
 
 			Relocation relocStruct;
 			relocStruct.type = static_cast<uint16_t>(reloc.getType());
-			relocStruct.address = static_cast<uint32_t>(reloc.getOffset());
-			relocStruct.symbolindex = static_cast<uint32_t>(idx);
+			relocStruct.address = addressbase + static_cast<uint32_t>(reloc.getOffset());
+			relocStruct.symbolindex = static_cast<uint32_t>(symbolbase + idx);
 
 			AppendToBuffer(buffer, relocStruct);
 		}
 	}
 
-}
 
-using namespace CodeGenInternal;
+	//
+	// CodeView type records of one generated object, with their global hashes
+	//
+	struct ObjectDebugTypes
+	{
+		codeview::CVTypeArray Records;
+		std::vector<codeview::GloballyHashedType> Hashes;
+		bool Precomputed = false;
+	};
 
+	//
+	// Find a section of a generated object by name
+	//
+	bool GetSectionContents(const object::ObjectFile* image, StringRef name, ArrayRef<uint8_t>* outContents)
+	{
+		for (const auto& section : image->sections())
+		{
+			StringRef sectionname;
+			section.getName(sectionname);
+			if (sectionname != name)
+				continue;
 
-CodeGenContext::CodeGenContext()
-	: LLVMModule(llvm::make_unique<Module>("EpochModule", GlobalContext)),
-	  Builder(GlobalContext),
-	  DebugBuilder(*LLVMModule)
-{
-	LLVMModule->setTargetTriple("x86_64-pc-windows-msvc");
-	LLVMModule->addModuleFlag(Module::ModFlagBehavior::Warning, "CodeView", 1);
+			StringRef contents;
+			section.getContents(contents);
+			*outContents = ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(contents.data()), contents.size());
+			return true;
+		}
 
-	// TODO - stash CUs for each file of the input program; will require debug info internally in EpochCompiler
-	// TODO - change params to handle optimized code when optimizations are back in
-	DebugFile = DebugBuilder.createFile("LinkedProgram.epoch", "C:\\Code\\epoch-language");
-	DebugCompileUnit = DebugBuilder.createCompileUnit(dwarf::SourceLanguage::DW_LANG_C_plus_plus_11, DebugFile, "Epoch Compiler", false, "", 0);
-}
+		return false;
+	}
 
+	//
+	// Read the CodeView type records of one object along with their global hashes
+	//
+	// Code generation normally stores the hashes in .debug$H (see
+	// InitializeLLVMOnce), so they only need computing here if that
+	// section is missing or does not describe every record.
+	//
+	void ReadObjectDebugTypes(const object::ObjectFile* image, ObjectDebugTypes* out)
+	{
+		ArrayRef<uint8_t> typedata;
+		if (!GetSectionContents(image, ".debug$T", &typedata) || typedata.size() <= CodeViewSignatureSize)
+			return;
 
+		BinaryStreamReader reader(typedata.drop_front(CodeViewSignatureSize), support::little);
+		if (auto err = reader.readArray(out->Records, reader.getLength()))
+		{
+			consumeError(std::move(err));
+			out->Records = codeview::CVTypeArray();
+			return;
+		}
 
-CodeGenContext::~CodeGenContext()
-{
-}
+		size_t recordcount = std::distance(out->Records.begin(), out->Records.end());
 
+		ArrayRef<uint8_t> hashdata;
+		if (GetSectionContents(image, ".debug$H", &hashdata) && hashdata.size() >= sizeof(object::debug_h_header))
+		{
+			const auto* header = reinterpret_cast<const object::debug_h_header*>(hashdata.data());
+			hashdata = hashdata.drop_front(sizeof(object::debug_h_header));
 
+			bool usable = header->Magic == COFF::DEBUG_HASHES_SECTION_MAGIC
+				&& header->Version == 0
+				&& header->HashAlgorithm == uint16_t(codeview::GlobalTypeHashAlg::SHA1)
+				&& hashdata.size() == recordcount * sizeof(codeview::GloballyHashedType);
 
-void CodeGenContext::DebugDump()
-{
-	LLVMModule->dump();
-}
+			if (usable)
+			{
+				out->Hashes.resize(recordcount);
+				memcpy(out->Hashes.data(), hashdata.data(), hashdata.size());
+				out->Precomputed = true;
+				return;
+			}
+		}
 
+		out->Hashes = codeview::GloballyHashedType::hashTypes(out->Records);
+	}
 
+	//
+	// Point one type index in a .debug$S section at the merged type records
+	//
+	// Indices of builtin types are left alone; anything the object's own
+	// records could not account for becomes NotTranslated, as in lld.
+	//
+	void RemapTypeIndex(char* position, const std::vector<codeview::TypeIndex>& typemap)
+	{
+		uint32_t rawindex = 0;
+		memcpy(&rawindex, position, sizeof(rawindex));
 
-FunctionType* CodeGenContext::TypeCreateFunction()
-{
-	auto* ret = FunctionType::get(Type::getInt32Ty(GlobalContext), FunctionParamTypeStack, false);
-	FunctionParamTypeStack.clear();
+		codeview::TypeIndex index(rawindex);
+		if (index.isSimple())
+			return;
 
-	return ret;
-}
+		if (index.toArrayIndex() < typemap.size())
+			index = typemap[index.toArrayIndex()];
+		else
+			index = codeview::TypeIndex(codeview::SimpleTypeKind::NotTranslated);
 
-void CodeGenContext::TypeQueueFunctionParameter(Type* ty)
-{
-	FunctionParamTypeStack.push_back(ty);
-}
+		rawindex = index.getIndex();
+		memcpy(position, &rawindex, sizeof(rawindex));
+	}
 
-llvm::DIType* CodeGenContext::TypeGetDebugType(Type* t)
-{
-	// TODO - build better type data
-	if (t->isPointerTy())
-		return DebugBuilder.createPointerType(TypeGetDebugType(t->getPointerElementType()), 64);
+	//
+	// Point the type indices in a .debug$S section at the merged type records
+	//
+	// Symbol records are found through LLVM's table of where each kind
+	// keeps its indices. The inlinee line subsection names each inlined
+	// function by its id record too, so its entries are remapped as well.
+	//
+	void RemapSymbolTypeIndices(char* data, size_t size, const std::vector<codeview::TypeIndex>& typemap)
+	{
+		size_t offset = CodeViewSignatureSize;
+		while (offset + 8 <= size)
+		{
+			uint32_t kind = 0;
+			uint32_t length = 0;
+			memcpy(&kind, data + offset, sizeof(kind));
+			memcpy(&length, data + offset + 4, sizeof(length));
 
-	if (t->isStructTy())
-		return DebugBuilder.createBasicType("Placeholder", 32, llvm::dwarf::DW_ATE_signed);
+			size_t begin = offset + 8;
+			size_t end = std::min(size, begin + length);
 
-	std::string str;
-	llvm::raw_string_ostream stream(str);
-	t->print(stream, true);
+			if (kind == uint32_t(codeview::DebugSubsectionKind::Symbols))
+			{
+				size_t record = begin;
+				while (record + sizeof(codeview::RecordPrefix) <= end)
+				{
+					uint16_t recordlength = 0;
+					memcpy(&recordlength, data + record, sizeof(recordlength));
+
+					size_t recordsize = recordlength + sizeof(uint16_t);
+					if (record + recordsize > end)
+						break;
+
+					SmallVector<codeview::TiReference, 4> refs;
+					ArrayRef<uint8_t> recorddata(reinterpret_cast<const uint8_t*>(data + record), recordsize);
+					if (codeview::discoverTypeIndicesInSymbol(recorddata, refs))
+					{
+						for (const auto& ref : refs)
+						{
+							size_t position = record + sizeof(codeview::RecordPrefix) + ref.Offset;
+							for (uint32_t i = 0; i < ref.Count && position + sizeof(uint32_t) <= record + recordsize; ++i, position += sizeof(uint32_t))
+								RemapTypeIndex(data + position, typemap);
+						}
+					}
+
+					record += recordsize;
+				}
+			}
+			else if (kind == uint32_t(codeview::DebugSubsectionKind::InlineeLines) && begin + sizeof(uint32_t) <= end)
+			{
+				// Each entry is the inlinee's id, file and line, then with the extra
+				// files signature a count and that many more file ids
+				uint32_t signature = 0;
+				memcpy(&signature, data + begin, sizeof(signature));
 
-	auto encoding = llvm::dwarf::DW_ATE_signed;
-	if (t->getPrimitiveSizeInBits() == 1)
-		encoding = llvm::dwarf::DW_ATE_boolean;
-	else if (t->getPrimitiveSizeInBits() == 8)
-		encoding = llvm::dwarf::DW_ATE_signed_char;
+				size_t entry = begin + sizeof(uint32_t);
+				while (entry + 3 * sizeof(uint32_t) <= end)
+				{
+					RemapTypeIndex(data + entry, typemap);
+					entry += 3 * sizeof(uint32_t);
+
+					if (signature == uint32_t(codeview::InlineeLinesSignature::ExtraFiles))
+					{
+						uint32_t extrafiles = 0;
+						if (entry + sizeof(uint32_t) > end)
+							break;
+
+						memcpy(&extrafiles, data + entry, sizeof(extrafiles));
+						entry += sizeof(uint32_t) + extrafiles * sizeof(uint32_t);
+					}
+				}
+			}
 
-	return DebugBuilder.createBasicType(stream.str(), t->getPrimitiveSizeInBits(), encoding);
-}
+			offset = begin + static_cast<size_t>(alignTo(length, 4));
+		}
+	}
 
-Type* CodeGenContext::TypeGetString()
-{
-	return Type::getInt8PtrTy(GlobalContext);
-}
+	//
+	// Lay out a merged type table as the records and hash stream of a TPI or IPI stream
+	//
+	void FlattenTypeTable(codeview::GlobalTypeTableBuilder& table, DebugTypeStream* out)
+	{
+		// Must match the bucket count PDB.epoch writes in the stream header
+		const uint32_t HashBuckets = 0x3FFFF;
 
+		// Debuggers seek by type index through these; MSVC places one about every 8 KB of records
+		const size_t IndexOffsetInterval = 8192;
 
-Function* CodeGenContext::FunctionCreate(FunctionType* fty, const char* name)
-{
-	auto* ret = Function::Create(fty, GlobalValue::LinkageTypes::ExternalLinkage, name, LLVMModule.get());
+		std::vector<uint32_t> indexoffsets;
+		size_t lastindexedoffset = 0;
 
-	DIScope* fcontext = DebugCompileUnit;
-	unsigned line = 0;
-	unsigned scopeline = 0;
+		table.ForEachRecord([&](codeview::TypeIndex index, const codeview::CVType& type)
+		{
+			size_t recordoffset = out->Records.size();
+			if (indexoffsets.empty() || recordoffset - lastindexedoffset >= IndexOffsetInterval)
+			{
+				indexoffsets.push_back(index.getIndex());
+				indexoffsets.push_back(static_cast<uint32_t>(recordoffset));
+				lastindexedoffset = recordoffset;
+			}
 
-	std::vector<Metadata*> argtypes;
-	argtypes.push_back(TypeGetDebugType(ret->getReturnType()));
+			uint32_t hashvalue = 0;
+			auto hash = pdb::hashTypeRecord(type);
+			if (hash)
+				hashvalue = *hash % HashBuckets;
+			else
+				consumeError(hash.takeError());
 
-	for (auto& arg : ret->args())
-		argtypes.push_back(TypeGetDebugType(arg.getType()));
+			AppendToBuffer(&out->Hashes, hashvalue);
+			out->Records.insert(out->Records.end(), type.data().begin(), type.data().end());
+			++out->Count;
+		});
 
-	DISubroutineType* debugtype = DebugBuilder.createSubroutineType(DebugBuilder.getOrCreateTypeArray(argtypes));
+		out->HashValueSize = out->Hashes.size();
 
-	DISubprogram* subprogram = DebugBuilder.createFunction(fcontext, ret->getName(), StringRef(), DebugFile, line, debugtype, false, true, scopeline, DINode::FlagPrototyped, false);
+		// Always at least one entry, so that the hash stream is never empty
+		if (indexoffsets.empty())
+		{
+			indexoffsets.push_back(uint32_t(codeview::TypeIndex::FirstNonSimpleIndex));
+			indexoffsets.push_back(0);
+		}
 
+		for (uint32_t value : indexoffsets)
+			AppendToBuffer(&out->Hashes, value);
+	}
 
-	unsigned i = 1;
-	for (auto& arg : ret->args())
-	{
-		auto * var = DebugBuilder.createParameterVariable(subprogram, arg.getName(), i, DebugFile, line, (DIType*)(argtypes[i]), false, DINode::DIFlags::FlagZero);
-		auto expr = DebugBuilder.createExpression();
 
-		DebugBuilder.insertDeclare(&arg, var, expr, DebugLoc::get(1, 0, subprogram), Builder.GetInsertBlock());
+	//
+	// Attribute the code, unwind and debug bytes of one generated object to its functions
+	//
+	// Code runs from each function symbol to the next one in its section, so
+	// alignment padding counts against the function before it. Unwind bytes
+	// are the function's .pdata entries plus the .xdata records they use.
+	// Debug bytes are the .debug$S subsections with a relocation pointing into
+	// the function; subsections for the object as a whole (file checksums,
+	// string tables and the like) are counted under "(shared)".
+	//
+	void AttributeObjectSizes(const object::ObjectFile& image, std::map<std::string, SizeAttribution>* sizes)
+	{
+		std::map<uint64_t, std::map<uint64_t, std::string>> functionstarts;		// Section index -> offset -> function
+		uint64_t xdatasize = 0;
 
-		++i;
-	}
+		for (const auto& sym : image.symbols())
+		{
+			auto type = sym.getType();
+			auto name = sym.getName();
+			auto section = sym.getSection();
+			if (!type || !name || !section || type.get() != object::SymbolRef::ST_Function || section.get() == image.section_end())
+				continue;
 
+			functionstarts[section.get()->getIndex()][sym.getValue()] = name.get().str();
+		}
 
-	ret->setSubprogram(subprogram);
+		for (const auto& section : image.sections())
+		{
+			StringRef sectionname;
+			section.getName(sectionname);
 
-	return ret;
-}
+			if (sectionname == ".xdata")
+				xdatasize = section.getSize();
+		}
 
-GlobalVariable* CodeGenContext::FunctionCreateThunk(FunctionType* fty, const char* name)
-{
-	return new GlobalVariable(*LLVMModule, fty->getPointerTo(), true, GlobalValue::ExternalWeakLinkage, NULL, name, NULL, GlobalVariable::NotThreadLocal, 0, true);
-}
+		auto findfunction = [&](uint64_t sectionindex, uint64_t offset) -> const std::string*
+		{
+			auto starts = functionstarts.find(sectionindex);
+			if (starts == functionstarts.end())
+				return nullptr;
 
+			auto next = starts->second.upper_bound(offset);
+			if (next == starts->second.begin())
+				return nullptr;
 
-BasicBlock* CodeGenContext::BasicBlockCreate(Function* func)
-{
-	return BasicBlock::Create(GlobalContext, "", func);
-}
+			return &std::prev(next)->second;
+		};
 
-void CodeGenContext::BasicBlockSetInsertPoint(BasicBlock* block)
-{
-	Builder.SetInsertPoint(block);
-}
+		// Section index and offset targeted by a 32-bit relocation, including the addend stored in place
+		auto resolve = [&](const object::RelocationRef& reloc, StringRef contents, uint64_t* outsection, uint64_t* outoffset)
+		{
+			auto sym = reloc.getSymbol();
+			if (sym == image.symbol_end() || reloc.getOffset() + sizeof(uint32_t) > contents.size())
+				return false;
 
+			auto section = sym->getSection();
+			if (!section || section.get() == image.section_end())
+				return false;
 
-Value* CodeGenContext::CodeCreateCall(Function* target)
-{
-	Value* callnode = Builder.CreateCall(target);
+			uint32_t addend = 0;
+			memcpy(&addend, contents.data() + reloc.getOffset(), sizeof(addend));
 
-	unsigned line = 1;
-	unsigned column = 1;
-	DebugLoc loc = DILocation::get(GlobalContext, line, column, Builder.GetInsertBlock()->getParent()->getSubprogram());
-	if (!Builder.GetInsertBlock()->getInstList().empty())
-		Builder.GetInsertBlock()->getInstList().back().setDebugLoc(loc);
+			*outsection = section.get()->getIndex();
+			*outoffset = sym->getValue() + addend;
+			return true;
+		};
 
-	return callnode;
-}
+		for (const auto& section : image.sections())
+		{
+			StringRef sectionname;
+			section.getName(sectionname);
 
-Value* CodeGenContext::CodeCreateCallThunk(GlobalVariable* target)
-{
-	Value* derefTarget = Builder.CreateLoad(target);
-	FunctionType* fty = cast<FunctionType>(derefTarget->getType()->getPointerElementType());
+			if (section.isText())
+			{
+				auto starts = functionstarts.find(section.getIndex());
+				if (starts == functionstarts.end())
+					continue;
 
-	std::vector<Value*> relevantargs;
-	for (size_t i = 0; i < fty->getNumParams(); ++i)
-	{
-		relevantargs.push_back(ValueStack.back());
-		ValueStack.pop_back();
-	}
-	std::reverse(relevantargs.begin(), relevantargs.end());
+				for (auto iter = starts->second.begin(); iter != starts->second.end(); ++iter)
+				{
+					auto next = std::next(iter);
+					uint64_t end = (next == starts->second.end()) ? section.getSize() : next->first;
+					(*sizes)[iter->second].Code += end - iter->first;
+				}
+			}
+			else if (sectionname == ".pdata")
+			{
+				StringRef contents;
+				section.getContents(contents);
 
-	return Builder.CreateCall(derefTarget, relevantargs);
-}
+				std::map<uint64_t, const std::string*> owners;		// Entry index -> function
+				std::map<uint64_t, uint64_t> records;				// Entry index -> .xdata offset
+				std::set<uint64_t> recordstarts;
 
-void CodeGenContext::CodeCreateRetVoid()
-{
-	Builder.CreateRet(ConstantInt::get(Type::getInt32Ty(GlobalContext), 0));
-}
+				for (const auto& reloc : section.relocations())
+				{
+					uint64_t entry = reloc.getOffset() / sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
+					uint64_t field = reloc.getOffset() % sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
+
+					uint64_t targetsection = 0;
+					uint64_t targetoffset = 0;
+					if (!resolve(reloc, contents, &targetsection, &targetoffset))
+						continue;
+
+					if (field == offsetof(IMAGE_RUNTIME_FUNCTION_ENTRY, BeginAddress))
+					{
+						owners[entry] = findfunction(targetsection, targetoffset);
+					}
+					else if (field == offsetof(IMAGE_RUNTIME_FUNCTION_ENTRY, UnwindInfoAddress))
+					{
+						records[entry] = targetoffset;
+						recordstarts.insert(targetoffset);
+					}
+				}
 
-void CodeGenContext::CodePushValue(Value* value)
-{
+				for (const auto& owner : owners)
+				{
+					if (!owner.second)
+						continue;
+
+					SizeAttribution& size = (*sizes)[*owner.second];
+					size.Unwind += sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
+
+					// Each .xdata record runs until the next one starts
+					auto record = records.find(owner.first);
+					if (record != records.end())
+					{
+						auto next = recordstarts.upper_bound(record->second);
+						uint64_t end = (next == recordstarts.end()) ? xdatasize : *next;
+						size.Unwind += end - std::min(end, record->second);
+					}
+				}
+			}
+			else if (sectionname == ".debug$S")
+			{
+				StringRef contents;
+				section.getContents(contents);
+
+				std::map<uint64_t, const std::string*> targets;		// Relocation offset -> function it points into
+				for (const auto& reloc : section.relocations())
+				{
+					uint64_t targetsection = 0;
+					uint64_t targetoffset = 0;
+					if (!resolve(reloc, contents, &targetsection, &targetoffset))
+						continue;
+
+					const std::string* function = findfunction(targetsection, targetoffset);
+					if (function)
+						targets.emplace(reloc.getOffset(), function);
+				}
+
+				// Subsections are a uint32 kind and uint32 length, then the payload padded to 4 bytes
+				uint64_t offset = CodeViewSignatureSize;
+				while (offset + 2 * sizeof(uint32_t) <= contents.size())
+				{
+					uint32_t length = 0;
+					memcpy(&length, contents.data() + offset + sizeof(uint32_t), sizeof(length));
+
+					uint64_t end = std::min<uint64_t>(offset + 2 * sizeof(uint32_t) + alignTo(length, 4), contents.size());
+
+					auto target = targets.lower_bound(offset);
+					bool owned = (target != targets.end() && target->first < end);
+					(*sizes)[owned ? *target->second : "(shared)"].Debug += end - offset;
+
+					offset = end;
+				}
+			}
+		}
+	}
+
+
+	//
+	// Count the self-recursive calls in a function that sit in tail position
+	//
+	// A call is in tail position if the only thing following it in its block is a
+	// return of either the call's own value or a constant. The latter is the shape
+	// produced by CodeCreateRetVoid, and is still eligible for elimination as long
+	// as every return in the function yields the same constant.
+	//
+	unsigned CountSelfTailCalls(Function& func)
+	{
+		unsigned count = 0;
+		for (auto& block : func)
+		{
+			auto* ret = dyn_cast_or_null<ReturnInst>(block.getTerminator());
+			if (!ret || &block.front() == ret)
+				continue;
+
+			auto* call = dyn_cast<CallInst>(ret->getPrevNode());
+			if (!call || call->getCalledFunction() != &func)
+				continue;
+
+			Value* retval = ret->getReturnValue();
+			if (!retval || retval == call || isa<Constant>(retval))
+				++count;
+		}
+
+		return count;
+	}
+
+	//
+	// Check whether a call may be handed the address of its caller's stack frame
+	//
+	// A tail call reuses the caller's frame, so a ref argument pointing at one of
+	// the caller's locals would dangle as soon as the callee starts. Arguments
+	// derived from an alloca are rejected outright. Other pointers (for example
+	// one loaded back out of a local slot before mem2reg has run) could still
+	// carry a local's address, so they are rejected if any local in the caller
+	// has had its address captured.
+	//
+	bool CallMayReferenceCallerFrame(CallInst* call)
+	{
+		Function* caller = call->getFunction();
+		const DataLayout& layout = caller->getParent()->getDataLayout();
+
+		bool indirect = false;
+		for (Value* arg : call->arg_operands())
+		{
+			if (!arg->getType()->isPointerTy())
+			{
+				if (arg->getType()->isAggregateType())
+					indirect = true;
+
+				continue;
+			}
+
+			SmallVector<Value*, 4> objects;
+			GetUnderlyingObjects(arg, objects, layout);
+			for (Value* object : objects)
+			{
+				if (isa<AllocaInst>(object))
+					return true;
+
+				if (!isa<Argument>(object) && !isa<Constant>(object))
+					indirect = true;
+			}
+		}
+
+		if (!indirect)
+			return false;
+
+		for (auto& block : *caller)
+		{
+			for (auto& inst : block)
+			{
+				if (isa<AllocaInst>(inst) && PointerMayBeCaptured(&inst, false, true))
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+	//
+	// Flag every call that is directly returned as a tail call
+	//
+	// Calls emitted via CodeCreateTailCall are already marked; this catches the
+	// remaining cases where the front end simply returned the result of a call.
+	// Every returned call is checked against the finished caller, and loses its
+	// tail marking if it might be passed a pointer into the caller's frame.
+	//
+	void MarkTailPositionCalls(Module& module)
+	{
+		for (auto& func : module)
+		{
+			for (auto& block : func)
+			{
+				auto* ret = dyn_cast_or_null<ReturnInst>(block.getTerminator());
+				if (!ret || &block.front() == ret)
+					continue;
+
+				auto* call = dyn_cast<CallInst>(ret->getPrevNode());
+				if (!call)
+					continue;
+
+				Value* retval = ret->getReturnValue();
+				if (retval && retval != call)
+					continue;
+
+				if (CallMayReferenceCallerFrame(call))
+					call->setTailCallKind(CallInst::TCK_None);
+				else if (!call->isTailCall())
+					call->setTailCall();
+			}
+		}
+	}
+
+
+	//
+	// Make musttail calls left between functions of different conventions plain tail calls
+	//
+	void RelaxMismatchedMustTailCalls(Module& module)
+	{
+		for (auto& func : module)
+		{
+			for (auto& block : func)
+			{
+				for (auto& inst : block)
+				{
+					auto* call = dyn_cast<CallInst>(&inst);
+					if (call && call->isMustTailCall() && call->getCallingConv() != func.getCallingConv())
+						call->setTailCallKind(CallInst::TCK_Tail);
+				}
+			}
+		}
+	}
+
+	//
+	// Give fastcc to every function that is only ever called directly
+	//
+	// Under GuaranteedTailCallOpt a fastcc function pops its own stack area,
+	// so anything whose address escapes to the runtime, the scheduler or a
+	// host callback has to keep the C convention its callers use. Direct
+	// calls are switched along with their target, and musttail calls left
+	// between functions of different conventions become plain tail calls.
+	//
+	void AssignCallingConventions(Module& module)
+	{
+		for (auto& func : module)
+		{
+			if (func.isDeclaration() || func.getName() == "@init" || func.hasAddressTaken())
+				continue;
+
+			func.setCallingConv(CallingConv::Fast);
+			for (User* user : func.users())
+			{
+				if (auto* call = dyn_cast<CallInst>(user))
+					call->setCallingConv(CallingConv::Fast);
+			}
+		}
+
+		RelaxMismatchedMustTailCalls(module);
+	}
+
+	//
+	// Move functions whose address escaped during optimization back to the C convention
+	//
+	// CoroSplit creates each coroutine's resume and destroy functions as
+	// fastcc and stores their addresses in the frame, where the scheduler
+	// calls them through C function pointers. Under GuaranteedTailCallOpt a
+	// Win64 fastcc function pops its argument area, shadow space included,
+	// when it returns, which corrupts the stack of a C caller. The indirect
+	// calls that CoroEarly lowers llvm.coro.resume and llvm.coro.destroy to
+	// are fastcc as well, so every call is made to agree with its target
+	// again, and indirect calls, which can only reach escaping functions,
+	// use C.
+	//
+	void RestoreEscapingCallingConventions(Module& module)
+	{
+		for (auto& func : module)
+		{
+			if (!func.isDeclaration() && func.getCallingConv() == CallingConv::Fast && func.hasAddressTaken())
+				func.setCallingConv(CallingConv::C);
+		}
+
+		for (auto& func : module)
+		{
+			for (auto& block : func)
+			{
+				for (auto& inst : block)
+				{
+					auto* call = dyn_cast<CallInst>(&inst);
+					if (!call || call->isInlineAsm())
+						continue;
+
+					auto* target = dyn_cast<Function>(call->getCalledValue()->stripPointerCasts());
+					call->setCallingConv(target ? target->getCallingConv() : CallingConv::C);
+				}
+			}
+		}
+
+		RelaxMismatchedMustTailCalls(module);
+	}
+
+
+	//
+	// Describe how a type is laid out in memory, independent of its name
+	//
+	// All pointers in an address space share one representation whatever they
+	// point to, so for example ListRef<Foo> and ListRef<Bar> end up with the
+	// same key when both Foo and Bar are held by reference.
+	//
+	std::string GetRepresentationKey(Type* ty)
+	{
+		if (ty->isPointerTy())
+			return "p" + std::to_string(ty->getPointerAddressSpace());
+
+		if (auto* st = dyn_cast<StructType>(ty))
+		{
+			if (st->isOpaque())
+				return "opaque " + st->getName().str();
+
+			std::string key = st->isPacked() ? "<{" : "{";
+			for (Type* element : st->elements())
+				key += GetRepresentationKey(element) + ",";
+
+			return key + "}";
+		}
+
+		if (auto* at = dyn_cast<ArrayType>(ty))
+			return "[" + std::to_string(at->getNumElements()) + " x " + GetRepresentationKey(at->getElementType()) + "]";
+
+		std::string key;
+		raw_string_ostream stream(key);
+		ty->print(stream);
+		return stream.str();
+	}
+
+	//
+	// Check that a function of one type can stand in for the other by casting pointers
+	//
+	// Aggregates must match exactly; bitcasts between distinct structure
+	// types are not allowed even when their layouts agree.
+	//
+	bool CanForwardCall(FunctionType* from, FunctionType* to)
+	{
+		if (from->isVarArg() || to->isVarArg() || from->getNumParams() != to->getNumParams())
+			return false;
+
+		auto compatible = [](Type* a, Type* b)
+		{
+			return a == b || (a->isPointerTy() && b->isPointerTy() && a->getPointerAddressSpace() == b->getPointerAddressSpace());
+		};
+
+		if (!compatible(from->getReturnType(), to->getReturnType()))
+			return false;
+
+		for (unsigned i = 0; i < from->getNumParams(); ++i)
+		{
+			if (!compatible(from->getParamType(i), to->getParamType(i)))
+				return false;
+		}
+
+		return true;
+	}
+
+
+	//
+	// Replace the calls made through an import thunk with calls to target
+	//
+	// Thunks are only ever loaded and then called, so every load is swapped for
+	// the target itself and the thunk is removed. Returns false, leaving the
+	// thunk alone, if it is used in any other way.
+	//
+	bool RedirectThunkCalls(GlobalVariable* thunk, Constant* target)
+	{
+		std::vector<LoadInst*> loads;
+		for (User* user : thunk->users())
+		{
+			auto* load = dyn_cast<LoadInst>(user);
+			if (!load)
+				return false;
+
+			loads.push_back(load);
+		}
+
+		for (LoadInst* load : loads)
+		{
+			load->replaceAllUsesWith(target);
+			load->eraseFromParent();
+		}
+
+		thunk->eraseFromParent();
+		return true;
+	}
+
+
+	//
+	// Attempt to run a global initializer function at compile time
+	//
+	// On success, the values it stores are baked into the initializers of the
+	// affected globals and true is returned. Initializers that call into the
+	// runtime, touch memory we cannot model, or otherwise depend on the state
+	// of the running program are rejected by the evaluator and must be left for
+	// startup code to execute.
+	//
+	bool EvaluateGlobalInitializer(Function* initializer, const DataLayout& datalayout, const TargetLibraryInfo* tli)
+	{
+		Evaluator eval(datalayout, tli);
+
+		Constant* retval = nullptr;
+		SmallVector<Constant*, 1> noargs;
+		if (!eval.EvaluateFunction(initializer, retval, noargs))
+			return false;
+
+		for (const auto& mutation : eval.getMutatedMemory())
+		{
+			if (!isa<GlobalVariable>(mutation.first))
+				return false;
+		}
+
+		for (const auto& mutation : eval.getMutatedMemory())
+			cast<GlobalVariable>(mutation.first)->setInitializer(mutation.second);
+
+		return true;
+	}
+
+	//
+	// Collect the mutable globals referenced by an initializer and its callees
+	//
+	// With includeloads false, globals which are only ever loaded from are
+	// skipped, leaving those the code may write or hand out the address of.
+	//
+	void CollectInitializerGlobals(Function* initializer, const DataLayout& datalayout, bool includeloads, std::set<GlobalVariable*>* globals)
+	{
+		std::set<Function*> visited;
+		std::vector<Function*> worklist(1, initializer);
+		while (!worklist.empty())
+		{
+			Function* func = worklist.back();
+			worklist.pop_back();
+			if (func->isDeclaration() || !visited.insert(func).second)
+				continue;
+
+			for (auto& block : *func)
+			{
+				for (auto& inst : block)
+				{
+					if (auto* call = dyn_cast<CallInst>(&inst))
+					{
+						if (Function* callee = call->getCalledFunction())
+							worklist.push_back(callee);
+					}
+
+					if (!includeloads && isa<LoadInst>(&inst))
+						continue;
+
+					for (Value* operand : inst.operands())
+					{
+						if (!operand->getType()->isPointerTy())
+							continue;
+
+						auto* global = dyn_cast<GlobalVariable>(GetUnderlyingObject(operand, datalayout));
+						if (global && !global->isConstant())
+							globals->insert(global);
+					}
+				}
+			}
+		}
+	}
+
+
+	//
+	// Route every optimization remark raised on the context to a callback
+	//
+	// Passes only build remarks when a handler asks for them, so this is
+	// installed only when a remarks file has been requested. Diagnostics
+	// that are not remarks fall through to LLVM's default reporting.
+	//
+	class RemarkCollector : public DiagnosticHandler
+	{
+	public:
+		typedef std::function<void(const DiagnosticInfoOptimizationBase&)> CallbackT;
+
+		explicit RemarkCollector(CallbackT callback)
+			: Callback(callback)
+		{ }
+
+		bool handleDiagnostics(const DiagnosticInfo& di) override
+		{
+			auto* remark = dyn_cast<DiagnosticInfoOptimizationBase>(&di);
+			if (!remark)
+				return false;
+
+			Callback(*remark);
+			return true;
+		}
+
+		bool isAnalysisRemarkEnabled(StringRef) const override		{ return true; }
+		bool isMissedOptRemarkEnabled(StringRef) const override		{ return true; }
+		bool isPassedOptRemarkEnabled(StringRef) const override		{ return true; }
+
+	private:
+		CallbackT Callback;
+	};
+
+	const char* GetRemarkTag(const DiagnosticInfo& di)
+	{
+		switch (di.getKind())
+		{
+		case DK_OptimizationRemark:
+		case DK_MachineOptimizationRemark:
+			return "Passed";
+
+		case DK_OptimizationRemarkMissed:
+		case DK_MachineOptimizationRemarkMissed:
+			return "Missed";
+		}
+
+		return "Analysis";
+	}
+
+
+	// Clusters stop growing at roughly a page of code, measured in IR instructions
+	const uint64_t FunctionClusterSizeLimit = 1024;
+
+	struct FunctionCluster
+	{
+		std::vector<Function*> Members;
+		uint64_t Size = 0;
+		uint64_t Weight = 0;
+	};
+
+	//
+	// Reorder the module's functions so hot callers and callees sit together in .text
+	//
+	// This is the C3 heuristic. Static call graph edges are weighted by call
+	// site count, scaled by the caller's profile entry count when one has been
+	// attached. Functions are visited from hottest to coldest, and each one's
+	// cluster is appended to the cluster of its heaviest caller unless that
+	// would grow the result past a page. Clusters are then laid out in order
+	// of decreasing density (weight per instruction).
+	//
+	// Functions nothing calls directly are marked cold unless their address
+	// is taken, since callbacks and dispatch targets are reached only through
+	// pointers the static call graph cannot see. Cold functions form a
+	// region at the end of .text.
+	//
+	// @init always stays first, since the image entry point is the start of
+	// the section. Code generation follows module order, so .pdata and debug
+	// info are emitted in the new order as well.
+	//
+	void OrderFunctionsByCallGraph(Module& module)
+	{
+		Function* entry = module.getFunction("@init");
+
+		std::vector<Function*> functions;
+		std::map<Function*, uint64_t> hotness;
+		std::map<Function*, std::map<Function*, uint64_t>> callerweights;
+
+		for (auto& func : module)
+		{
+			if (!func.isDeclaration())
+				functions.push_back(&func);
+		}
+
+		for (Function* caller : functions)
+		{
+			uint64_t scale = 1;
+			if (auto count = caller->getEntryCount())
+				scale = std::max<uint64_t>(*count, 1);
+
+			for (auto& block : *caller)
+			{
+				for (auto& inst : block)
+				{
+					auto* call = dyn_cast<CallInst>(&inst);
+					if (!call)
+						continue;
+
+					Function* callee = call->getCalledFunction();
+					if (!callee || callee->isDeclaration() || callee == caller)
+						continue;
+
+					callerweights[callee][caller] += scale;
+					hotness[callee] += scale;
+				}
+			}
+		}
+
+		std::vector<FunctionCluster> clusters;
+		std::map<Function*, size_t> clusterof;
+		for (Function* func : functions)
+		{
+			FunctionCluster cluster;
+			cluster.Members.push_back(func);
+			for (auto& block : *func)
+				cluster.Size += block.size();
+			cluster.Weight = hotness[func];
+
+			clusterof[func] = clusters.size();
+			clusters.push_back(cluster);
+		}
+
+		std::vector<Function*> byhotness = functions;
+		std::stable_sort(byhotness.begin(), byhotness.end(), [&hotness](Function* a, Function* b) { return hotness[a] > hotness[b]; });
+
+		for (Function* func : byhotness)
+		{
+			if (!hotness[func])
+				break;
+
+			if (func->hasFnAttribute(Attribute::Cold))
+				continue;
+
+			Function* heaviestcaller = nullptr;
+			uint64_t heaviestweight = 0;
+			for (const auto& pair : callerweights[func])
+			{
+				if (pair.second > heaviestweight)
+				{
+					heaviestcaller = pair.first;
+					heaviestweight = pair.second;
+				}
+			}
+
+			size_t into = clusterof[heaviestcaller];
+			size_t from = clusterof[func];
+			if (into == from || clusters[into].Size + clusters[from].Size > FunctionClusterSizeLimit)
+				continue;
+
+			for (Function* member : clusters[from].Members)
+			{
+				clusters[into].Members.push_back(member);
+				clusterof[member] = into;
+			}
+
+			clusters[into].Size += clusters[from].Size;
+			clusters[into].Weight += clusters[from].Weight;
+			clusters[from].Members.clear();
+		}
+
+		std::vector<FunctionCluster*> layout;
+		for (auto& cluster : clusters)
+		{
+			if (!cluster.Members.empty())
+				layout.push_back(&cluster);
+		}
+
+		auto iscold = [](const FunctionCluster* cluster)
+		{
+			return std::all_of(cluster->Members.begin(), cluster->Members.end(), [](Function* func) { return func->hasFnAttribute(Attribute::Cold); });
+		};
+
+		std::stable_sort(layout.begin(), layout.end(), [entry, &iscold](const FunctionCluster* a, const FunctionCluster* b)
+		{
+			bool aentry = std::find(a->Members.begin(), a->Members.end(), entry) != a->Members.end();
+			bool bentry = std::find(b->Members.begin(), b->Members.end(), entry) != b->Members.end();
+			if (aentry != bentry)
+				return aentry;
+
+			bool acold = iscold(a);
+			bool bcold = iscold(b);
+			if (acold != bcold)
+				return bcold;
+
+			// Compare weight/size densities without dividing
+			return a->Weight * std::max<uint64_t>(b->Size, 1) > b->Weight * std::max<uint64_t>(a->Size, 1);
+		});
+
+		unsigned coldcount = 0;
+		auto& functionlist = module.getFunctionList();
+		for (const FunctionCluster* cluster : layout)
+		{
+			for (Function* func : cluster->Members)
+			{
+				if (func != entry && !hotness[func] && !func->hasAddressTaken())
+					func->addFnAttr(Attribute::Cold);
+
+				if (func->hasFnAttribute(Attribute::Cold))
+					++coldcount;
+
+				functionlist.splice(functionlist.end(), functionlist, func->getIterator());
+			}
+		}
+
+		std::cout << "Function layout: " << layout.size() << " clusters, " << coldcount << " cold functions" << std::endl;
+	}
+
+
+	//
+	// Give every instruction a line of its own function's range in LinkedProgram.epoch
+	//
+	// There is no source to point at, so lines count out the shape of the
+	// code instead: each basic block starts a new line after the
+	// function's own, and so does each call after the first in a block.
+	// Every call site has a line to itself. That is enough for the sample
+	// profile loader, which keys body samples by line offset from the
+	// function and call site samples by the line of the call, and the
+	// numbering is the same every time the same program is built.
+	// Functions brought in from other compile units keep their locations.
+	//
+	// A function that needs more lines than its range holds does not spill
+	// into the next function's range; everything past the end shares the
+	// range's last line, and the function is reported, since its samples
+	// there can no longer be told apart.
+	//
+	void AssignDebugLines(Module& module, DICompileUnit* unit)
+	{
+		LLVMContext& context = module.getContext();
+		std::vector<std::string> overflowed;
+
+		for (auto& func : module)
+		{
+			DISubprogram* subprogram = func.getSubprogram();
+			if (!subprogram || subprogram->getUnit() != unit)
+				continue;
+
+			unsigned line = subprogram->getLine();
+			unsigned lastline = std::min(line + DebugLinesPerFunction - 1, MaxCodeViewLine);
+			bool fits = true;
+
+			auto nextline = [&]()
+			{
+				if (line < lastline)
+					++line;
+				else
+					fits = false;
+			};
+
+			for (auto& block : func)
+			{
+				nextline();
+				bool linehascall = false;
+				for (auto& inst : block)
+				{
+					// Variable declarations stay at the function's own line
+					if (isa<DbgInfoIntrinsic>(inst))
+						continue;
+
+					if (isa<CallInst>(inst) || isa<InvokeInst>(inst))
+					{
+						if (linehascall)
+							nextline();
+
+						linehascall = true;
+					}
+
+					inst.setDebugLoc(DILocation::get(context, line, 1, subprogram));
+				}
+			}
+
+			if (!fits)
+				overflowed.push_back(func.getName().str());
+		}
+
+		if (overflowed.empty())
+			return;
+
+		std::cout << "Debug lines: " << overflowed.size() << " functions need more than " << DebugLinesPerFunction << " lines; the rest of each shares its last line" << std::endl;
+
+		const size_t listlimit = 10;
+		for (size_t i = 0; i < overflowed.size() && i < listlimit; ++i)
+			std::cout << "Debug lines: " << overflowed[i] << std::endl;
+
+		if (overflowed.size() > listlimit)
+			std::cout << "Debug lines: ... and " << (overflowed.size() - listlimit) << " more" << std::endl;
+	}
+
+}
+
+using namespace CodeGenInternal;
+
+
+CodeGenContext::CodeGenContext()
+	: LLVMModule(llvm::make_unique<Module>("EpochModule", GlobalContext)),
+	  Builder(GlobalContext),
+	  DebugBuilder(*LLVMModule)
+{
+	LLVMModule->setTargetTriple("x86_64-pc-windows-msvc");
+	LLVMModule->setDataLayout("e-m:w-i64:64-f80:128-n8:16:32:64-S128");		// Must agree with the layout of the pooled target machines
+	LLVMModule->addModuleFlag(Module::ModFlagBehavior::Warning, "CodeView", 1);
+
+	// TODO - stash CUs for each file of the input program; will require debug info internally in EpochCompiler
+	// TODO - change params to handle optimized code when optimizations are back in
+	DebugFile = DebugBuilder.createFile("LinkedProgram.epoch", "C:\\Code\\epoch-language");
+	DebugCompileUnit = DebugBuilder.createCompileUnit(dwarf::SourceLanguage::DW_LANG_C_plus_plus_11, DebugFile, "Epoch Compiler", false, "", 0);
+}
+
+
+
+CodeGenContext::~CodeGenContext()
+{
+}
+
+
+//
+// Build a target machine ahead of the first compile, as a compile server does when it starts
+//
+bool CodeGenContext::PrepareTargetMachine()
+{
+	std::unique_ptr<TargetMachine> machine = AcquireTargetMachine();
+	if (!machine)
+		return false;
+
+	ReleaseTargetMachine(std::move(machine));
+	return true;
+}
+
+//
+// Free the pooled target machines at shutdown, once no context is generating code
+//
+void CodeGenContext::ReleaseTargetMachines()
+{
+	std::lock_guard<std::mutex> lock(TargetMachinePoolMutex);
+	TargetMachinePool.clear();
+}
+
+
+
+void CodeGenContext::DebugDump()
+{
+	LLVMModule->dump();
+}
+
+
+
+FunctionType* CodeGenContext::TypeCreateFunction()
+{
+	auto* ret = FunctionType::get(Type::getInt32Ty(GlobalContext), FunctionParamTypeStack, false);
+	FunctionParamTypeStack.clear();
+
+	return ret;
+}
+
+void CodeGenContext::TypeQueueFunctionParameter(Type* ty)
+{
+	FunctionParamTypeStack.push_back(ty);
+}
+
+llvm::DIType* CodeGenContext::TypeGetDebugType(Type* t)
+{
+	// TODO - build better type data
+	if (t->isPointerTy())
+		return DebugBuilder.createPointerType(TypeGetDebugType(t->getPointerElementType()), 64);
+
+	if (t->isStructTy())
+	{
+		auto cached = StructureDebugTypes.find(t);
+		if (cached != StructureDebugTypes.end())
+			return cached->second;
+
+		auto layout = StructureLayouts.find(cast<StructType>(t));
+		if (layout != StructureLayouts.end())
+			return TypeGetStructureDebugType(cast<StructType>(t), layout->second);
+
+		return DebugBuilder.createBasicType("Placeholder", 32, llvm::dwarf::DW_ATE_signed);
+	}
+
+	std::string str;
+	llvm::raw_string_ostream stream(str);
+	t->print(stream, true);
+
+	auto encoding = llvm::dwarf::DW_ATE_signed;
+	if (t->getPrimitiveSizeInBits() == 1)
+		encoding = llvm::dwarf::DW_ATE_boolean;
+	else if (t->getPrimitiveSizeInBits() == 8)
+		encoding = llvm::dwarf::DW_ATE_signed_char;
+
+	return DebugBuilder.createBasicType(stream.str(), t->getPrimitiveSizeInBits(), encoding);
+}
+
+Type* CodeGenContext::TypeGetString()
+{
+	return Type::getInt8PtrTy(GlobalContext);
+}
+
+
+void CodeGenContext::TypeQueueStructureMember(Type* ty, const char* name, bool cold)
+{
+	StructureMemberStack.push_back(StructureMember{ ty, name, cold });
+}
+
+//
+// Create a structure type from the queued members
+//
+// Members are not laid out in declaration order. Hot members are sorted by
+// decreasing alignment (then size), which eliminates all interior padding for
+// the power-of-two alignments we deal with. Members flagged as cold are moved
+// into a separate side structure, and the hot structure gets a pointer to it
+// in their place. All member accesses must go through CodeCreateMemberAddress
+// which maps declaration indices onto the physical layout.
+//
+StructType* CodeGenContext::TypeCreateStructure(const char* name)
+{
+	const DataLayout& datalayout = LLVMModule->getDataLayout();
+
+	StructureLayout layout;
+	layout.Members.swap(StructureMemberStack);
+	layout.PhysicalIndex.resize(layout.Members.size());
+
+	std::vector<Type*> declaredtypes;
+	for (const auto& member : layout.Members)
+		declaredtypes.push_back(member.MemberType);
+
+	layout.DeclaredSize = datalayout.getTypeAllocSize(StructType::get(GlobalContext, declaredtypes));
+
+	std::vector<unsigned> hot;
+	std::vector<unsigned> cold;
+	for (unsigned i = 0; i < layout.Members.size(); ++i)
+	{
+		if (layout.Members[i].Cold)
+			cold.push_back(i);
+		else
+			hot.push_back(i);
+	}
+
+	auto bypadding = [&](unsigned lhs, unsigned rhs)
+	{
+		Type* lt = layout.Members[lhs].MemberType;
+		Type* rt = layout.Members[rhs].MemberType;
+
+		unsigned lalign = datalayout.getABITypeAlignment(lt);
+		unsigned ralign = datalayout.getABITypeAlignment(rt);
+		if (lalign != ralign)
+			return lalign > ralign;
+
+		return datalayout.getTypeAllocSize(lt) > datalayout.getTypeAllocSize(rt);
+	};
+
+	std::stable_sort(hot.begin(), hot.end(), bypadding);
+	std::stable_sort(cold.begin(), cold.end(), bypadding);
+
+	std::vector<Type*> coldtypes;
+	for (unsigned i = 0; i < cold.size(); ++i)
+	{
+		layout.PhysicalIndex[cold[i]] = i;
+		coldtypes.push_back(layout.Members[cold[i]].MemberType);
+	}
+
+	if (!coldtypes.empty())
+		layout.ColdType = StructType::create(GlobalContext, coldtypes, std::string(name) + ".cold");
+
+	// The cold pointer is placed like any other 8-byte aligned member so it does not introduce padding
+	std::vector<Type*> hottypes;
+	for (unsigned i = 0; i < hot.size(); ++i)
+	{
+		if (layout.ColdType && layout.ColdPointerIndex == ~0u && datalayout.getABITypeAlignment(layout.Members[hot[i]].MemberType) < 8)
+		{
+			layout.ColdPointerIndex = static_cast<unsigned>(hottypes.size());
+			hottypes.push_back(layout.ColdType->getPointerTo());
+		}
+
+		layout.PhysicalIndex[hot[i]] = static_cast<unsigned>(hottypes.size());
+		hottypes.push_back(layout.Members[hot[i]].MemberType);
+	}
+
+	if (layout.ColdType && layout.ColdPointerIndex == ~0u)
+	{
+		layout.ColdPointerIndex = static_cast<unsigned>(hottypes.size());
+		hottypes.push_back(layout.ColdType->getPointerTo());
+	}
+
+	StructType* ret = StructType::create(GlobalContext, hottypes, name);
+	StructureLayouts[ret] = std::move(layout);
+	return ret;
+}
+
+//
+// Structures that were not laid out by TypeCreateStructure have no cold side
+//
+Type* CodeGenContext::TypeGetStructureColdType(StructType* st)
+{
+	auto layout = StructureLayouts.find(st);
+	if (layout == StructureLayouts.end())
+		return nullptr;
+
+	return layout->second.ColdType;
+}
+
+//
+// Build debug info which describes the physical layout of a structure
+//
+// Hot members are listed at their real offsets, and the cold side structure
+// shows up as a pointer member named "cold" holding the remaining members, so
+// a debugger sees exactly what is in memory.
+//
+DIType* CodeGenContext::TypeGetStructureDebugType(StructType* st, const StructureLayout& layout)
+{
+	const DataLayout& datalayout = LLVMModule->getDataLayout();
+
+	auto builddebugtype = [&](StructType* physical, bool coldside) -> DIType*
+	{
+		DICompositeType* forward = DebugBuilder.createReplaceableCompositeType(dwarf::DW_TAG_structure_type, physical->getName(), DebugCompileUnit, DebugFile, 0);
+		StructureDebugTypes[physical] = forward;
+
+		const StructLayout* physicallayout = datalayout.getStructLayout(physical);
+		std::vector<Metadata*> elements;
+
+		auto addmember = [&](const std::string& membername, unsigned index)
+		{
+			Type* mt = physical->getElementType(index);
+			elements.push_back(DebugBuilder.createMemberType(forward, membername, DebugFile, 0, datalayout.getTypeSizeInBits(mt), datalayout.getABITypeAlignment(mt) * 8, physicallayout->getElementOffsetInBits(index), DINode::FlagZero, TypeGetDebugType(mt)));
+		};
+
+		for (unsigned i = 0; i < layout.Members.size(); ++i)
+		{
+			if (layout.Members[i].Cold == coldside)
+				addmember(layout.Members[i].Name, layout.PhysicalIndex[i]);
+		}
+
+		if (!coldside && layout.ColdType)
+			addmember("cold", layout.ColdPointerIndex);
+
+		// Report members in address order
+		std::sort(elements.begin(), elements.end(), [](Metadata* lhs, Metadata* rhs)
+		{
+			return cast<DIDerivedType>(lhs)->getOffsetInBits() < cast<DIDerivedType>(rhs)->getOffsetInBits();
+		});
+
+		DICompositeType* real = DebugBuilder.createStructType(DebugCompileUnit, physical->getName(), DebugFile, 0, physicallayout->getSizeInBits(), physicallayout->getAlignment() * 8, DINode::FlagZero, nullptr, DebugBuilder.getOrCreateArray(elements));
+		DebugBuilder.replaceTemporary(TempDIType(forward), real);
+
+		StructureDebugTypes[physical] = real;
+		return real;
+	};
+
+	if (layout.ColdType)
+		builddebugtype(layout.ColdType, true);
+
+	return builddebugtype(st, false);
+}
+
+//
+// Compute the address of a structure member, given its declaration index
+//
+Value* CodeGenContext::CodeCreateMemberAddress(Value* structptr, unsigned member)
+{
+	StructType* st = cast<StructType>(structptr->getType()->getPointerElementType());
+	auto layoutiter = StructureLayouts.find(st);
+	if (layoutiter == StructureLayouts.end())
+	{
+		std::cout << "Member access on " << st->getName().str() << " which has no known layout" << std::endl;
+		return nullptr;
+	}
+
+	const StructureLayout& layout = layoutiter->second;
+	if (member >= layout.Members.size())
+	{
+		std::cout << "Member #" << member << " out of range for " << st->getName().str() << std::endl;
+		return nullptr;
+	}
+
+	if (!layout.Members[member].Cold)
+		return Builder.CreateStructGEP(st, structptr, layout.PhysicalIndex[member]);
+
+	Value* coldptr = Builder.CreateLoad(Builder.CreateStructGEP(st, structptr, layout.ColdPointerIndex));
+	return Builder.CreateStructGEP(layout.ColdType, coldptr, layout.PhysicalIndex[member]);
+}
+
+void CodeGenContext::CodeAttachColdStorage(Value* structptr, Value* coldptr)
+{
+	StructType* st = cast<StructType>(structptr->getType()->getPointerElementType());
+	auto layoutiter = StructureLayouts.find(st);
+	if (layoutiter == StructureLayouts.end() || !layoutiter->second.ColdType)
+	{
+		std::cout << "Cold storage attached to " << st->getName().str() << " which has no cold members" << std::endl;
+		return;
+	}
+
+	const StructureLayout& layout = layoutiter->second;
+	Builder.CreateStore(coldptr, Builder.CreateStructGEP(st, structptr, layout.ColdPointerIndex));
+}
+
+//
+// Describe the chosen layout of every structure in human-readable form
+//
+void* CodeGenContext::GetStructureLayoutReport(unsigned* outSize)
+{
+	const DataLayout& datalayout = LLVMModule->getDataLayout();
+
+	std::ostringstream report;
+	for (const auto& pair : StructureLayouts)
+	{
+		const StructureLayout& layout = pair.second;
+		const StructLayout* hotlayout = datalayout.getStructLayout(pair.first);
+
+		report << pair.first->getName().str() << ": " << layout.DeclaredSize << " bytes declared, " << hotlayout->getSizeInBytes() << " bytes laid out";
+		if (layout.ColdType)
+			report << " + " << datalayout.getTypeAllocSize(layout.ColdType) << " bytes cold";
+		report << "\n";
+
+		for (unsigned i = 0; i < layout.Members.size(); ++i)
+		{
+			const StructureMember& member = layout.Members[i];
+			if (member.Cold)
+				report << "\tcold+" << datalayout.getStructLayout(layout.ColdType)->getElementOffset(layout.PhysicalIndex[i]);
+			else
+				report << "\t+" << hotlayout->getElementOffset(layout.PhysicalIndex[i]);
+
+			report << "\t" << member.Name << " (" << datalayout.getTypeAllocSize(member.MemberType) << " bytes)\n";
+		}
+	}
+
+	std::string text = report.str();
+	StructureLayoutReport.assign(text.begin(), text.end());
+
+	if (outSize)
+		*outSize = (unsigned)(StructureLayoutReport.size());
+
+	return (void*)(StructureLayoutReport.data());
+}
+
+
+//
+// Create a global variable in the image's .global section
+//
+// The variable starts out zeroed. Its value is computed by an optional
+// initializer function created with GlobalCreateInitializer.
+//
+GlobalVariable* CodeGenContext::GlobalCreate(Type* ty, const char* name)
+{
+	auto* var = new GlobalVariable(*LLVMModule, ty, false, GlobalValue::LinkageTypes::InternalLinkage, Constant::getNullValue(ty), name);
+	var->setSection(".global");
+	return var;
+}
+
+Function* CodeGenContext::GlobalCreateInitializer(GlobalVariable* var)
+{
+	auto* fty = FunctionType::get(Type::getInt32Ty(GlobalContext), false);
+	auto* ret = Function::Create(fty, GlobalValue::LinkageTypes::InternalLinkage, "@globalinit:" + var->getName(), LLVMModule.get());
+
+	GlobalInitializers.push_back(ret);
+	return ret;
+}
+
+void CodeGenContext::CodeCreateGlobalStore(GlobalVariable* var)
+{
+	Builder.CreateStore(ValueStack.back(), var);
+	ValueStack.pop_back();
+}
+
+//
+// Fold global initializers into static data where possible
+//
+// Initializers are evaluated in creation order. Those that cannot be run at
+// compile time are called, in the same order, at the top of @init before the
+// program's entry point runs.
+//
+// Globals touched by a deferred initializer still hold their zero value at
+// compile time, so any later initializer that reads one must be deferred as
+// well, and in turn taints whatever it writes.
+//
+void CodeGenContext::EvaluateGlobalInitializers(Module& module)
+{
+	const DataLayout& datalayout = module.getDataLayout();
+
+	TargetLibraryInfoImpl tlii(Triple(module.getTargetTriple()));
+	TargetLibraryInfo tli(tlii);
+
+	std::set<GlobalVariable*> deferred;
+	std::vector<Function*> startup;
+	for (Function* initializer : GlobalInitializers)
+	{
+		bool readsdeferred = false;
+		if (!deferred.empty())
+		{
+			std::set<GlobalVariable*> referenced;
+			CollectInitializerGlobals(initializer, datalayout, true, &referenced);
+			for (GlobalVariable* global : referenced)
+			{
+				if (deferred.count(global))
+				{
+					readsdeferred = true;
+					break;
+				}
+			}
+		}
+
+		if (!readsdeferred && EvaluateGlobalInitializer(initializer, datalayout, &tli))
+		{
+			initializer->eraseFromParent();
+		}
+		else
+		{
+			CollectInitializerGlobals(initializer, datalayout, false, &deferred);
+			startup.push_back(initializer);
+		}
+	}
+
+	GlobalInitializers.swap(startup);
+
+	Function* init = module.getFunction("@init");
+	if (!init || GlobalInitializers.empty())
+		return;
+
+	IRBuilder<> initbuilder(&*init->getEntryBlock().getFirstInsertionPt());
+	for (Function* initializer : GlobalInitializers)
+		initbuilder.CreateCall(initializer);
+}
+
+
+void CodeGenContext::TypeQueueSumTypeAlternative(Type* ty)
+{
+	SumTypeAlternativeStack.push_back(ty);
+}
+
+//
+// Create a tagged union type from the queued alternatives
+//
+// Sum types are laid out as an i32 discriminant followed by an opaque payload
+// large enough to hold the biggest alternative. The discriminant of a value is
+// the index of its alternative in the order the alternatives were queued.
+//
+StructType* CodeGenContext::TypeCreateSumType(const char* name)
+{
+	const DataLayout& layout = LLVMModule->getDataLayout();
+
+	uint64_t payloadsize = 0;
+	for (Type* alternative : SumTypeAlternativeStack)
+	{
+		if (alternative->isSized())
+			payloadsize = std::max(payloadsize, layout.getTypeAllocSize(alternative));
+	}
+
+	Type* payload = ArrayType::get(Type::getInt64Ty(GlobalContext), (payloadsize + 7) / 8);
+	StructType* ret = StructType::create(GlobalContext, { Type::getInt32Ty(GlobalContext), payload }, name);
+
+	SumTypeAlternatives[ret] = SumTypeAlternativeStack;
+	SumTypeAlternativeStack.clear();
+
+	return ret;
+}
+
+
+Function* CodeGenContext::FunctionCreate(FunctionType* fty, const char* name)
+{
+	auto* ret = Function::Create(fty, GlobalValue::LinkageTypes::ExternalLinkage, name, LLVMModule.get());
+	if (ret->getName() != name)
+		EpochFunctionNames[ret->getName().str()] = name;
+
+	// Past the last range CodeView can number, functions start sharing ranges from the top of the file again
+	if (NextDebugLine > MaxCodeViewLine - DebugLinesPerFunction + 1)
+	{
+		std::cout << "Debug lines: more than " << (MaxCodeViewLine / DebugLinesPerFunction) << " functions; line ranges in LinkedProgram.epoch start to overlap" << std::endl;
+		NextDebugLine = 1;
+	}
+
+	DIScope* fcontext = DebugCompileUnit;
+	unsigned line = NextDebugLine;
+	unsigned scopeline = line;
+	NextDebugLine += DebugLinesPerFunction;
+
+	std::vector<Metadata*> argtypes;
+	argtypes.push_back(TypeGetDebugType(ret->getReturnType()));
+
+	for (auto& arg : ret->args())
+		argtypes.push_back(TypeGetDebugType(arg.getType()));
+
+	DISubroutineType* debugtype = DebugBuilder.createSubroutineType(DebugBuilder.getOrCreateTypeArray(argtypes));
+
+	DISubprogram* subprogram = DebugBuilder.createFunction(fcontext, ret->getName(), StringRef(), DebugFile, line, debugtype, false, true, scopeline, DINode::FlagPrototyped, false);
+
+
+	unsigned i = 1;
+	for (auto& arg : ret->args())
+	{
+		auto * var = DebugBuilder.createParameterVariable(subprogram, arg.getName(), i, DebugFile, line, (DIType*)(argtypes[i]), false, DINode::DIFlags::FlagZero);
+		auto expr = DebugBuilder.createExpression();
+
+		DebugBuilder.insertDeclare(&arg, var, expr, DebugLoc::get(line, 0, subprogram), Builder.GetInsertBlock());
+
+		++i;
+	}
+
+
+	ret->setSubprogram(subprogram);
+
+	// Functions start out with the C convention; AssignCallingConventions
+	// moves the ones whose address never escapes to fastcc once the module
+	// is complete, so that their calls in tail position become jumps.
+	return ret;
+}
+
+void CodeGenContext::TypeQueueTemplateArgument(Type* ty)
+{
+	TemplateArgumentStack.push_back(ty);
+}
+
+//
+// Create one instantiation of a generic function, or reuse an equivalent one
+//
+// Instances are cached for the whole build by template name and by the
+// representation of the queued type arguments. The front end must only
+// share a template name between instantiations whose bodies depend on their
+// type arguments through layout alone; anything else (such as an overload
+// chosen per argument type) belongs in the template name.
+//
+// Asking for an instance with an existing key reuses the body generated for
+// it, and sets outNeedsBody to false. If the requested signature differs
+// from the cached one only in pointer types, the caller gets a forwarder
+// under the requested name, which the inliner removes again. Only a new key
+// or an incompatible signature needs code generated.
+//
+Function* CodeGenContext::FunctionCreateInstance(FunctionType* fty, const char* templatename, const char* name, bool* outNeedsBody)
+{
+	std::string key = templatename;
+	key += "<";
+	for (Type* argument : TemplateArgumentStack)
+		key += GetRepresentationKey(argument) + ";";
+	key += ">";
+
+	TemplateArgumentStack.clear();
+
+	TemplateInstanceCounts& counts = InstanceCounts[templatename];
+	++counts.Requested;
+
+	if (outNeedsBody)
+		*outNeedsBody = false;
+
+	auto named = InstancesByName.find(name);
+	if (named != InstancesByName.end() && named->second->getFunctionType() == fty)
+		return named->second;
+
+	Function* ret = nullptr;
+	auto cached = InstanceBodies.find(key);
+	if (cached != InstanceBodies.end() && cached->second->getFunctionType() == fty)
+	{
+		ret = cached->second;
+	}
+	else if (cached != InstanceBodies.end() && CanForwardCall(fty, cached->second->getFunctionType()))
+	{
+		Function* body = cached->second;
+
+		ret = Function::Create(fty, GlobalValue::LinkageTypes::InternalLinkage, name, LLVMModule.get());
+		ret->addFnAttr(Attribute::AlwaysInline);
+		if (ret->getName() != name)
+			EpochFunctionNames[ret->getName().str()] = name;
+
+		IRBuilder<> forward(BasicBlock::Create(GlobalContext, "", ret));
+
+		std::vector<Value*> args;
+		for (auto& arg : ret->args())
+			args.push_back(forward.CreateBitCast(&arg, body->getFunctionType()->getParamType(arg.getArgNo())));
+
+		CallInst* call = forward.CreateCall(body, args);
+		if (fty->getReturnType()->isVoidTy())
+			forward.CreateRetVoid();
+		else
+			forward.CreateRet(forward.CreateBitCast(call, fty->getReturnType()));
+
+		++ForwardedInstanceCount;
+	}
+	else
+	{
+		ret = FunctionCreate(fty, name);
+		++counts.Generated;
+
+		if (cached == InstanceBodies.end())
+			InstanceBodies[key] = ret;
+
+		if (outNeedsBody)
+			*outNeedsBody = true;
+	}
+
+	InstancesByName[name] = ret;
+	InstanceTemplates[ret->getName().str()] = templatename;
+	return ret;
+}
+
+//
+// Report how many generic instantiations the cache kept from being generated
+//
+void CodeGenContext::ReportInstanceCache() const
+{
+	unsigned requested = 0;
+	unsigned generated = 0;
+	for (const auto& pair : InstanceCounts)
+	{
+		requested += pair.second.Requested;
+		generated += pair.second.Generated;
+	}
+
+	if (!requested)
+		return;
+
+	std::cout << "Generic instantiations: " << requested << " requested, " << generated << " generated, " << (requested - generated) << " avoided by sharing a template and layout" << std::endl;
+
+	for (const auto& pair : InstanceCounts)
+	{
+		if (pair.second.Generated < pair.second.Requested)
+			std::cout << "\t" << pair.first << ": " << pair.second.Requested << " instances share " << pair.second.Generated << " bodies" << std::endl;
+	}
+}
+
+GlobalVariable* CodeGenContext::FunctionCreateThunk(FunctionType* fty, const char* name)
+{
+	return new GlobalVariable(*LLVMModule, fty->getPointerTo(), true, GlobalValue::ExternalWeakLinkage, NULL, name, NULL, GlobalVariable::NotThreadLocal, 0, true);
+}
+
+//
+// Record which DLL export a thunk calls, for linking through an import library
+//
+void CodeGenContext::FunctionBindThunkImport(GlobalVariable* thunk, const char* library, const char* function)
+{
+	ThunkImports.push_back({ thunk, library, function });
+}
+
+//
+// Enumerate bound imports, so the built-in linker can give each an import address table slot
+//
+unsigned CodeGenContext::GetThunkImportCount() const
+{
+	return static_cast<unsigned>(ThunkImports.size());
+}
+
+const char* CodeGenContext::GetThunkImportLibrary(unsigned index, unsigned* outLength) const
+{
+	if (outLength)
+		*outLength = static_cast<unsigned>(ThunkImports[index].Library.length());
+
+	return ThunkImports[index].Library.c_str();
+}
+
+const char* CodeGenContext::GetThunkImportFunction(unsigned index, unsigned* outLength) const
+{
+	if (outLength)
+		*outLength = static_cast<unsigned>(ThunkImports[index].Function.length());
+
+	return ThunkImports[index].Function.c_str();
+}
+
+void CodeGenContext::SetThunkImportAddress(unsigned index, uint64_t address)
+{
+	ThunkImportAddresses[ThunkImports[index].Thunk->getName().str()] = address;
+}
+
+
+BasicBlock* CodeGenContext::BasicBlockCreate(Function* func)
+{
+	return BasicBlock::Create(GlobalContext, "", func);
+}
+
+void CodeGenContext::BasicBlockSetInsertPoint(BasicBlock* block)
+{
+	Builder.SetInsertPoint(block);
+}
+
+
+Value* CodeGenContext::CodeCreateCall(Function* target)
+{
+	CallInst* callnode = Builder.CreateCall(target, PopCallArguments(target->getFunctionType()));
+	callnode->setCallingConv(target->getCallingConv());
+
+	// FinalizeDebugInfo gives the call its own line; until then it sits at the start of the function
+	if (DISubprogram* subprogram = Builder.GetInsertBlock()->getParent()->getSubprogram())
+		callnode->setDebugLoc(DILocation::get(GlobalContext, subprogram->getLine(), 1, subprogram));
+
+	return callnode;
+}
+
+//
+// Emit a call in tail position, followed immediately by the return of its value.
+//
+// Self calls are only marked as tail calls; the tail recursion elimination pass
+// turns them into loops later. Calls to other functions with an identical type
+// are marked musttail so that the fastcc convention turns them into jumps;
+// AssignCallingConventions relaxes the ones that end up between conventions.
+// Calls that may be passed the address of a local stay ordinary calls, and
+// MarkTailPositionCalls checks the rest again once the caller is complete.
+//
+Value* CodeGenContext::CodeCreateTailCall(Function* target)
+{
+	Function* caller = Builder.GetInsertBlock()->getParent();
+
+	CallInst* callnode = cast<CallInst>(CodeCreateCall(target));
+
+	if (CallMayReferenceCallerFrame(callnode))
+		callnode->setTailCallKind(CallInst::TCK_None);
+	else if (target != caller && target->getFunctionType() == caller->getFunctionType() && target->getCallingConv() == caller->getCallingConv())
+		callnode->setTailCallKind(CallInst::TCK_MustTail);
+	else
+		callnode->setTailCallKind(CallInst::TCK_Tail);
+
+	Builder.CreateRet(callnode);
+	return callnode;
+}
+
+Value* CodeGenContext::CodeCreateCallThunk(GlobalVariable* target)
+{
+	Value* derefTarget = Builder.CreateLoad(target);
+	FunctionType* fty = cast<FunctionType>(derefTarget->getType()->getPointerElementType());
+
+	return Builder.CreateCall(derefTarget, PopCallArguments(fty));
+}
+
+
+//
+// Wrap the value on top of the stack into a sum type value with the given tag
+//
+Value* CodeGenContext::CodeCreateSumTypeValue(StructType* sumtype, unsigned tag)
+{
+	Type* alternative = SumTypeAlternatives[sumtype][tag];
+
+	Value* payload = ValueStack.back();
+	ValueStack.pop_back();
+
+	Value* storage = CreateEntryBlockAlloca(sumtype);
+	Builder.CreateStore(Constant::getNullValue(sumtype), storage);
+	Builder.CreateStore(ConstantInt::get(Type::getInt32Ty(GlobalContext), tag), Builder.CreateStructGEP(sumtype, storage, 0));
+	Builder.CreateStore(payload, Builder.CreateBitCast(Builder.CreateStructGEP(sumtype, storage, 1), alternative->getPointerTo()));
+
+	// The tag travels with the value itself, for CodeCreateDispatch to find
+	LoadInst* ret = Builder.CreateLoad(storage);
+	ret->setMetadata("epoch.sumtag", MDNode::get(GlobalContext, ConstantAsMetadata::get(Builder.getInt32(tag))));
+	return ret;
+}
+
+void CodeGenContext::CodeQueueDispatchTarget(Function* target)
+{
+	DispatchTargetStack.push_back(target);
+}
+
+//
+// Call the overload matching the runtime tag of a sum type value
+//
+// The queued dispatch targets are indexed by tag, and each takes the unwrapped
+// payload as its first parameter. The sum type value is expected beneath the
+// remaining arguments on the value stack, which are shared by every target.
+//
+// Tags are dense, so the switch lowers to a single jump table. When the tag is
+// known at compile time because the value was just built with a constant tag,
+// the overload is called directly and no dispatch is emitted at all; a known
+// tag with no queued target fails code generation.
+//
+Value* CodeGenContext::CodeCreateDispatch(StructType* sumtype)
+{
+	std::vector<Function*> targets;
+	targets.swap(DispatchTargetStack);
+
+	if (targets.empty())
+	{
+		std::cout << "Dispatch on " << sumtype->getName().str() << " has no queued targets" << std::endl;
+		return nullptr;
+	}
+
+	FunctionType* fty = targets.front()->getFunctionType();
+
+	std::vector<Value*> sharedargs;
+	for (size_t i = 1; i < fty->getNumParams(); ++i)
+	{
+		sharedargs.push_back(ValueStack.back());
+		ValueStack.pop_back();
+	}
+	std::reverse(sharedargs.begin(), sharedargs.end());
+
+	Value* sumvalue = ValueStack.back();
+	ValueStack.pop_back();
+
+	unsigned statictag = ~0u;
+	if (auto* load = dyn_cast<LoadInst>(sumvalue))
+	{
+		if (MDNode* tagnode = load->getMetadata("epoch.sumtag"))
+			statictag = static_cast<unsigned>(mdconst::extract<ConstantInt>(tagnode->getOperand(0))->getZExtValue());
+	}
+
+	if (statictag != ~0u && statictag >= targets.size())
+	{
+		std::cout << "Dispatch on " << sumtype->getName().str() << " has no target for tag " << statictag << " (" << targets.size() << " queued)" << std::endl;
+		return nullptr;
+	}
+
+	Value* storage = CreateEntryBlockAlloca(sumtype);
+	Builder.CreateStore(sumvalue, storage);
+	Value* payloadptr = Builder.CreateStructGEP(sumtype, storage, 1);
+
+	// The calls are inlinable, and the verifier requires those to have a location in a function with debug info
+	DebugLoc previouslocation = Builder.getCurrentDebugLocation();
+	if (DISubprogram* subprogram = Builder.GetInsertBlock()->getParent()->getSubprogram())
+		Builder.SetCurrentDebugLocation(DILocation::get(GlobalContext, subprogram->getLine(), 1, subprogram));
+
+	auto callalternative = [&](unsigned tag) -> Value*
+	{
+		Function* target = targets[tag];
+		Type* alternative = target->getFunctionType()->getParamType(0);
+
+		std::vector<Value*> args;
+		args.push_back(Builder.CreateLoad(Builder.CreateBitCast(payloadptr, alternative->getPointerTo())));
+		args.insert(args.end(), sharedargs.begin(), sharedargs.end());
+
+		CallInst* call = Builder.CreateCall(target, args);
+		call->setCallingConv(target->getCallingConv());
+		return call;
+	};
+
+	if (statictag != ~0u)
+	{
+		Value* call = callalternative(statictag);
+		Builder.SetCurrentDebugLocation(previouslocation);
+		return call;
+	}
+
+	Function* func = Builder.GetInsertBlock()->getParent();
+	BasicBlock* unreachable = BasicBlock::Create(GlobalContext, "dispatch.invalid", func);
+	BasicBlock* merge = BasicBlock::Create(GlobalContext, "dispatch.done", func);
+
+	Value* tag = Builder.CreateLoad(Builder.CreateStructGEP(sumtype, storage, 0));
+	SwitchInst* dispatch = Builder.CreateSwitch(tag, unreachable, static_cast<unsigned>(targets.size()));
+
+	Builder.SetInsertPoint(merge);
+	PHINode* result = Builder.CreatePHI(fty->getReturnType(), static_cast<unsigned>(targets.size()));
+
+	for (unsigned i = 0; i < targets.size(); ++i)
+	{
+		BasicBlock* caseblock = BasicBlock::Create(GlobalContext, "dispatch.case", func, unreachable);
+		dispatch->addCase(ConstantInt::get(Type::getInt32Ty(GlobalContext), i), caseblock);
+
+		Builder.SetInsertPoint(caseblock);
+		result->addIncoming(callalternative(i), caseblock);
+		Builder.CreateBr(merge);
+	}
+
+	Builder.SetInsertPoint(unreachable);
+	Builder.CreateUnreachable();
+
+	Builder.SetInsertPoint(merge);
+	Builder.SetCurrentDebugLocation(previouslocation);
+	return result;
+}
+
+//
+// Allocas must live in the entry block for mem2reg to promote them
+//
+Value* CodeGenContext::CreateEntryBlockAlloca(Type* ty)
+{
+	BasicBlock& entry = Builder.GetInsertBlock()->getParent()->getEntryBlock();
+
+	IRBuilder<> entrybuilder(&entry, entry.begin());
+	return entrybuilder.CreateAlloca(ty);
+}
+
+std::vector<Value*> CodeGenContext::PopCallArguments(FunctionType* fty)
+{
+	std::vector<Value*> relevantargs;
+	for (size_t i = 0; i < fty->getNumParams(); ++i)
+	{
+		relevantargs.push_back(ValueStack.back());
+		ValueStack.pop_back();
+	}
+	std::reverse(relevantargs.begin(), relevantargs.end());
+
+	return relevantargs;
+}
+
+void CodeGenContext::CodeCreateRetVoid()
+{
+	Builder.CreateRet(ConstantInt::get(Type::getInt32Ty(GlobalContext), 0));
+}
+
+void CodeGenContext::CodePushValue(Value* value)
+{
 	ValueStack.push_back(value);
 }
 
 
-Value* CodeGenContext::GetStringPoolEntry(unsigned index)
-{
-	Value* cached = StringCache[index];
-	if (cached)
-		return cached;
+//
+// Coroutines
+//
+// A coroutine is an ordinary function, returning a handle, that is turned
+// into a coroutine by FunctionMakeCoroutine before its body is generated.
+// Calling it runs the body up to the first suspension point and returns the
+// handle, through which the caller (normally the scheduler runtime) resumes,
+// polls and destroys it. Frames live on the process heap unless CoroElide
+// can prove they do not outlive the caller. The coroutine passes in
+// OptimizeModule split each one into its ramp, resume and destroy parts;
+// the resume and destroy functions keep the C convention, since the
+// scheduler calls them through the pointers at the start of the frame.
+//
+Type* CodeGenContext::TypeGetCoroutineHandle()
+{
+	return Type::getInt8PtrTy(GlobalContext);
+}
+
+//
+// Like TypeCreateFunction, but returning a coroutine handle, as FunctionMakeCoroutine requires
+//
+FunctionType* CodeGenContext::TypeCreateCoroutineFunction()
+{
+	auto* ret = FunctionType::get(TypeGetCoroutineHandle(), FunctionParamTypeStack, false);
+	FunctionParamTypeStack.clear();
+
+	return ret;
+}
+
+//
+// Emit the coroutine prologue at the current insert point, which must be in the function's entry block
+//
+// The body continues right after the prologue. Every exit from the body
+// must go through CodeCreateSuspend or CodeCreateCoroutineReturn.
+//
+bool CodeGenContext::FunctionMakeCoroutine(Function* func)
+{
+	if (func->getReturnType() != TypeGetCoroutineHandle())
+	{
+		std::cout << "Coroutine " << func->getName().str() << " must return a coroutine handle" << std::endl;
+		return false;
+	}
+
+	Module* module = func->getParent();
+	Type* i8ptr = TypeGetCoroutineHandle();
+	Constant* null = ConstantPointerNull::get(cast<PointerType>(i8ptr));
+
+	// Left for CoroSplit to find, as a front end's coroutines would be
+	func->addFnAttr("coroutine.presplit", "0");
+
+	CoroutineFrame frame;
+	frame.Id = Builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_id), { Builder.getInt32(0), null, null, null });
+	Value* needsalloc = Builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_alloc), { frame.Id });
+
+	BasicBlock* entry = Builder.GetInsertBlock();
+	BasicBlock* allocblock = BasicBlock::Create(GlobalContext, "coro.alloc", func);
+	BasicBlock* beginblock = BasicBlock::Create(GlobalContext, "coro.begin", func);
+	Builder.CreateCondBr(needsalloc, allocblock, beginblock);
+
+	Builder.SetInsertPoint(allocblock);
+	Value* size = Builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_size, { Type::getInt64Ty(GlobalContext) }));
+	Value* memory = CreateCoroutineHeapCall("HeapAlloc", { Builder.getInt32(0), size });
+	Builder.CreateBr(beginblock);
+
+	Builder.SetInsertPoint(beginblock);
+	PHINode* framememory = Builder.CreatePHI(i8ptr, 2);
+	framememory->addIncoming(null, entry);
+	framememory->addIncoming(memory, allocblock);
+	frame.Handle = Builder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_begin), { frame.Id, framememory });
+
+	// Destruction frees the frame, if it was allocated, then leaves through the shared exit
+	frame.Cleanup = BasicBlock::Create(GlobalContext, "coro.cleanup", func);
+	BasicBlock* freeblock = BasicBlock::Create(GlobalContext, "coro.free", func);
+	frame.Suspend = BasicBlock::Create(GlobalContext, "coro.suspend", func);
+
+	IRBuilder<> exitbuilder(frame.Cleanup);
+	Value* allocated = exitbuilder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_free), { frame.Id, frame.Handle });
+	exitbuilder.CreateCondBr(exitbuilder.CreateIsNotNull(allocated), freeblock, frame.Suspend);
+
+	Builder.SetInsertPoint(freeblock);
+	CreateCoroutineHeapCall("HeapFree", { Builder.getInt32(0), allocated });
+	Builder.CreateBr(frame.Suspend);
+	Builder.SetInsertPoint(beginblock);
+
+	exitbuilder.SetInsertPoint(frame.Suspend);
+	exitbuilder.CreateCall(Intrinsic::getDeclaration(module, Intrinsic::coro_end), { frame.Handle, exitbuilder.getFalse() });
+	exitbuilder.CreateRet(frame.Handle);
+
+	Coroutines[func] = frame;
+	return true;
+}
+
+//
+// Suspend the current coroutine; execution continues at the insert point once it is resumed
+//
+void CodeGenContext::CodeCreateSuspend()
+{
+	Function* func = Builder.GetInsertBlock()->getParent();
+	const CoroutineFrame& frame = Coroutines.at(func);
+
+	Value* result = Builder.CreateCall(Intrinsic::getDeclaration(func->getParent(), Intrinsic::coro_suspend), { ConstantTokenNone::get(GlobalContext), Builder.getFalse() });
+
+	BasicBlock* resume = BasicBlock::Create(GlobalContext, "coro.resume", func);
+	SwitchInst* dispatch = Builder.CreateSwitch(result, frame.Suspend, 2);
+	dispatch->addCase(Builder.getInt8(0), resume);
+	dispatch->addCase(Builder.getInt8(1), frame.Cleanup);
+
+	Builder.SetInsertPoint(resume);
+}
+
+//
+// Finish the body of the current coroutine
+//
+// The coroutine stops at a final suspension point, where it reports done
+// and must then be destroyed by its owner. Resuming it again traps.
+//
+void CodeGenContext::CodeCreateCoroutineReturn()
+{
+	Function* func = Builder.GetInsertBlock()->getParent();
+	const CoroutineFrame& frame = Coroutines.at(func);
+
+	Value* result = Builder.CreateCall(Intrinsic::getDeclaration(func->getParent(), Intrinsic::coro_suspend), { ConstantTokenNone::get(GlobalContext), Builder.getTrue() });
+
+	BasicBlock* resumed = BasicBlock::Create(GlobalContext, "coro.final.resumed", func);
+	SwitchInst* dispatch = Builder.CreateSwitch(result, frame.Suspend, 2);
+	dispatch->addCase(Builder.getInt8(0), resumed);
+	dispatch->addCase(Builder.getInt8(1), frame.Cleanup);
+
+	Builder.SetInsertPoint(resumed);
+	Builder.CreateCall(Intrinsic::getDeclaration(func->getParent(), Intrinsic::trap));
+	Builder.CreateUnreachable();
+}
+
+//
+// The handle of the coroutine being generated, e.g. to hand to the scheduler before suspending
+//
+Value* CodeGenContext::CodeGetCoroutineHandle()
+{
+	return Coroutines.at(Builder.GetInsertBlock()->getParent()).Handle;
+}
+
+void CodeGenContext::CodeCreateCoroutineResume()
+{
+	Value* handle = ValueStack.back();
+	ValueStack.pop_back();
+
+	Builder.CreateCall(Intrinsic::getDeclaration(LLVMModule.get(), Intrinsic::coro_resume), { handle });
+}
+
+void CodeGenContext::CodeCreateCoroutineDestroy()
+{
+	Value* handle = ValueStack.back();
+	ValueStack.pop_back();
+
+	Builder.CreateCall(Intrinsic::getDeclaration(LLVMModule.get(), Intrinsic::coro_destroy), { handle });
+}
+
+Value* CodeGenContext::CodeCreateCoroutineDone()
+{
+	Value* handle = ValueStack.back();
+	ValueStack.pop_back();
+
+	return Builder.CreateCall(Intrinsic::getDeclaration(LLVMModule.get(), Intrinsic::coro_done), { handle });
+}
+
+//
+// Call HeapAlloc or HeapFree on the process heap, for coroutine frames
+//
+// The Kernel32 imports are bound the first time any coroutine needs them.
+//
+Value* CodeGenContext::CreateCoroutineHeapCall(const char* function, std::vector<Value*> args)
+{
+	Type* ptr = Type::getInt8PtrTy(GlobalContext);
+	Type* i32 = Type::getInt32Ty(GlobalContext);
+	Type* i64 = Type::getInt64Ty(GlobalContext);
+
+	// HANDLE GetProcessHeap()
+	// LPVOID HeapAlloc(HANDLE, DWORD, SIZE_T)
+	// BOOL HeapFree(HANDLE, DWORD, LPVOID)
+	auto getimport = [&](FunctionType* fty, const std::string& name)
+	{
+		GlobalVariable*& thunk = CoroutineImports[name];
+		if (!thunk)
+		{
+			thunk = new GlobalVariable(*LLVMModule, fty->getPointerTo(), true, GlobalValue::ExternalWeakLinkage, nullptr, "@coroutine:" + name);
+			ThunkImports.push_back({ thunk, "Kernel32.dll", name });
+		}
+
+		return Builder.CreateLoad(thunk);
+	};
+
+	FunctionType* fty = (strcmp(function, "HeapAlloc") == 0) ? FunctionType::get(ptr, { ptr, i32, i64 }, false) : FunctionType::get(i32, { ptr, i32, ptr }, false);
+
+	Value* heap = Builder.CreateCall(getimport(FunctionType::get(ptr, false), "GetProcessHeap"));
+	args.insert(args.begin(), heap);
+
+	return Builder.CreateCall(getimport(fty, function), args);
+}
+
+
+//
+// Parallel loops
+//
+// The body of a parallel loop is generated straight into its own task
+// function, which runs one slice [begin, end) of the iteration space. The
+// loop itself becomes a single call to EpochParallel_For, which splits the
+// range across the work-stealing workers in EpochParallel.dll and returns
+// once every iteration has run.
+//
+// Values from the enclosing function are not visible inside the body. The
+// front end queues the ones it needs with CodeQueueParallelCapture before
+// starting the loop; they are copied into an environment block that every
+// slice reads them back from.
+//
+void CodeGenContext::CodeQueueParallelCapture(Value* value)
+{
+	ParallelCaptureQueue.push_back(value);
+}
+
+//
+// Start a parallel loop over [begin, end), taken from the value stack
+//
+// Returns the loop index, of the same type as begin, for use in the body.
+// Code generated until the matching CodeEndParallelFor goes into the body,
+// which must fall through to the end of the loop rather than return.
+//
+Value* CodeGenContext::CodeBeginParallelFor()
+{
+	Value* end = ValueStack.back();
+	ValueStack.pop_back();
+	Value* begin = ValueStack.back();
+	ValueStack.pop_back();
+
+	Type* i64 = Type::getInt64Ty(GlobalContext);
+	Function* parent = Builder.GetInsertBlock()->getParent();
+
+	ParallelLoop loop;
+	loop.ParentBlock = Builder.GetInsertBlock();
+	loop.Begin = Builder.CreateSExtOrTrunc(begin, i64);
+	loop.End = Builder.CreateSExtOrTrunc(end, i64);
+	loop.Captures.swap(ParallelCaptureQueue);
+
+	std::vector<Type*> capturetypes;
+	for (Value* capture : loop.Captures)
+		capturetypes.push_back(capture->getType());
+
+	loop.Environment = StructType::get(GlobalContext, capturetypes);
+
+	// Called from the runtime, so this keeps the C calling convention
+	FunctionType* taskty = FunctionType::get(Type::getVoidTy(GlobalContext), { Type::getInt8PtrTy(GlobalContext), i64, i64 }, false);
+	loop.Task = Function::Create(taskty, GlobalValue::InternalLinkage, "@parallel:" + parent->getName().str() + "." + std::to_string(ParallelTaskCount++), LLVMModule.get());
+
+	// The body is code from the enclosing function, so it needs a scope of its own for the locations calls in it get
+	DISubprogram* parentsubprogram = parent->getSubprogram();
+	unsigned line = parentsubprogram ? std::max(1u, parentsubprogram->getLine()) : 1;
+
+	Metadata* tasktypes[] = { nullptr, TypeGetDebugType(Type::getInt8PtrTy(GlobalContext)), TypeGetDebugType(i64), TypeGetDebugType(i64) };
+	DISubroutineType* debugtype = DebugBuilder.createSubroutineType(DebugBuilder.getOrCreateTypeArray(tasktypes));
+	loop.Task->setSubprogram(DebugBuilder.createFunction(DebugCompileUnit, loop.Task->getName(), StringRef(), DebugFile, line, debugtype, true, true, line, DINode::FlagPrototyped, false));
+
+	auto arg = loop.Task->arg_begin();
+	Value* environment = &*arg++;
+	Value* slicebegin = &*arg++;
+	loop.SliceEnd = &*arg;
+
+	BasicBlock* entry = BasicBlock::Create(GlobalContext, "entry", loop.Task);
+	loop.Body = BasicBlock::Create(GlobalContext, "parallel.body", loop.Task);
+	loop.Exit = BasicBlock::Create(GlobalContext, "parallel.exit", loop.Task);
+
+	loop.ParentLocation = Builder.getCurrentDebugLocation();
+	Builder.SetCurrentDebugLocation(DILocation::get(GlobalContext, line, 1, loop.Task->getSubprogram()));
+	Builder.SetInsertPoint(entry);
+	Value* envptr = Builder.CreateBitCast(environment, loop.Environment->getPointerTo());
+	for (unsigned i = 0; i < loop.Captures.size(); ++i)
+		loop.CaptureLoads.push_back(Builder.CreateLoad(Builder.CreateStructGEP(loop.Environment, envptr, i)));
+
+	Builder.CreateCondBr(Builder.CreateICmpSLT(slicebegin, loop.SliceEnd), loop.Body, loop.Exit);
+
+	Builder.SetInsertPoint(loop.Body);
+	loop.Index = Builder.CreatePHI(i64, 2);
+	loop.Index->addIncoming(slicebegin, entry);
+
+	Value* index = Builder.CreateSExtOrTrunc(loop.Index, begin->getType());
+	ParallelLoops.push_back(loop);
+	return index;
+}
+
+//
+// The copy of the index'th queued capture, as seen by the innermost loop body
+//
+Value* CodeGenContext::CodeGetParallelCapture(unsigned index)
+{
+	const ParallelLoop& loop = ParallelLoops.back();
+	if (index >= loop.CaptureLoads.size())
+	{
+		std::cout << "Parallel loop has no capture #" << index << std::endl;
+		return nullptr;
+	}
+
+	return loop.CaptureLoads[index];
+}
+
+//
+// Close the innermost parallel loop body, and run the loop from the enclosing function
+//
+void CodeGenContext::CodeEndParallelFor()
+{
+	ParallelLoop loop = ParallelLoops.back();
+	ParallelLoops.pop_back();
+
+	Value* next = Builder.CreateAdd(loop.Index, Builder.getInt64(1));
+	loop.Index->addIncoming(next, Builder.GetInsertBlock());
+	Builder.CreateCondBr(Builder.CreateICmpSLT(next, loop.SliceEnd), loop.Body, loop.Exit);
+
+	Builder.SetInsertPoint(loop.Exit);
+	Builder.CreateRetVoid();
+
+	Builder.SetInsertPoint(loop.ParentBlock);
+	Builder.SetCurrentDebugLocation(loop.ParentLocation);
+	Value* environment = CreateEntryBlockAlloca(loop.Environment);
+	for (unsigned i = 0; i < loop.Captures.size(); ++i)
+		Builder.CreateStore(loop.Captures[i], Builder.CreateStructGEP(loop.Environment, environment, i));
+
+	// void EpochParallel_For(task, environment, begin, end)
+	Type* i8ptr = Type::getInt8PtrTy(GlobalContext);
+	Type* i64 = Type::getInt64Ty(GlobalContext);
+	FunctionType* fty = FunctionType::get(Type::getVoidTy(GlobalContext), { loop.Task->getType(), i8ptr, i64, i64 }, false);
+
+	if (!ParallelForImport)
+	{
+		ParallelForImport = new GlobalVariable(*LLVMModule, fty->getPointerTo(), true, GlobalValue::ExternalWeakLinkage, nullptr, "@parallel:EpochParallel_For");
+		ThunkImports.push_back({ ParallelForImport, "EpochParallel.dll", "EpochParallel_For" });
+	}
+
+	Builder.CreateCall(Builder.CreateLoad(ParallelForImport), { loop.Task, Builder.CreateBitCast(environment, i8ptr), loop.Begin, loop.End });
+}
+
+
+//
+// Atomics
+//
+// All atomic operations are sequentially consistent, and work on any
+// integer or pointer the target can access atomically. Pointer operands
+// come off the value stack below the values stored through them.
+//
+Value* CodeGenContext::CodeCreateAtomicLoad(Value* ptr)
+{
+	Type* ty = ptr->getType()->getPointerElementType();
+
+	LoadInst* load = Builder.CreateLoad(ptr);
+	load->setAlignment(static_cast<unsigned>(LLVMModule->getDataLayout().getTypeStoreSize(ty)));
+	load->setAtomic(AtomicOrdering::SequentiallyConsistent);
+	return load;
+}
+
+void CodeGenContext::CodeCreateAtomicStore()
+{
+	Value* value = ValueStack.back();
+	ValueStack.pop_back();
+	Value* ptr = ValueStack.back();
+	ValueStack.pop_back();
+
+	StoreInst* store = Builder.CreateStore(value, ptr);
+	store->setAlignment(static_cast<unsigned>(LLVMModule->getDataLayout().getTypeStoreSize(value->getType())));
+	store->setAtomic(AtomicOrdering::SequentiallyConsistent);
+}
+
+//
+// Atomically combine the value on the stack into the pointer below it
+//
+// Returns the previous contents. Operations, by number:
+//  0 exchange, 1 add, 2 subtract, 3 and, 4 or, 5 xor, 6 signed max, 7 signed min
+//
+Value* CodeGenContext::CodeCreateAtomicRMW(unsigned op)
+{
+	static const AtomicRMWInst::BinOp operations[] =
+	{
+		AtomicRMWInst::Xchg,
+		AtomicRMWInst::Add,
+		AtomicRMWInst::Sub,
+		AtomicRMWInst::And,
+		AtomicRMWInst::Or,
+		AtomicRMWInst::Xor,
+		AtomicRMWInst::Max,
+		AtomicRMWInst::Min,
+	};
+
+	if (op >= sizeof(operations) / sizeof(operations[0]))
+	{
+		std::cout << "Unknown atomic operation " << op << std::endl;
+		return nullptr;
+	}
+
+	Value* value = ValueStack.back();
+	ValueStack.pop_back();
+	Value* ptr = ValueStack.back();
+	ValueStack.pop_back();
+
+	return Builder.CreateAtomicRMW(operations[op], ptr, value, AtomicOrdering::SequentiallyConsistent);
+}
+
+//
+// Store the top of the stack through the pointer two below it, if the pointer still holds the value in between
+//
+// Returns the previous contents; the exchange happened if they equal the expected value.
+//
+Value* CodeGenContext::CodeCreateAtomicCompareExchange()
+{
+	Value* replacement = ValueStack.back();
+	ValueStack.pop_back();
+	Value* expected = ValueStack.back();
+	ValueStack.pop_back();
+	Value* ptr = ValueStack.back();
+	ValueStack.pop_back();
+
+	Value* result = Builder.CreateAtomicCmpXchg(ptr, expected, replacement, AtomicOrdering::SequentiallyConsistent, AtomicOrdering::SequentiallyConsistent);
+	return Builder.CreateExtractValue(result, 0);
+}
+
+void CodeGenContext::CodeCreateFence()
+{
+	Builder.CreateFence(AtomicOrdering::SequentiallyConsistent);
+}
+
+
+Value* CodeGenContext::GetStringPoolEntry(unsigned index)
+{
+	Value* cached = StringCache[index];
+	if (cached)
+		return cached;
+
+	std::ostringstream stringID;
+	stringID << "@epoch_static_string:" << index;
+	
+	auto* var = new GlobalVariable(*LLVMModule, Type::getInt8Ty(GlobalContext), true, GlobalValue::LinkageTypes::ExternalWeakLinkage, nullptr, stringID.str());
+	StringCache[index] = var;
+	return var;
+}
+
+//
+// Get a string literal as a constant in the module itself
+//
+// This is the /conststrings alternative to GetStringPoolEntry. The bytes
+// live in the module, so LLVM can fold lengths and comparisons, and no
+// string pool lookup or relocation is involved. Identical literals share
+// a single constant; see MergeStringLiterals for literals that are the
+// tail of another.
+//
+Value* CodeGenContext::GetStringLiteral(const char* text)
+{
+	GlobalVariable*& literal = StringLiterals[text];
+	if (!literal)
+	{
+		Constant* contents = ConstantDataArray::getString(GlobalContext, text);
+		literal = new GlobalVariable(*LLVMModule, contents->getType(), true, GlobalValue::LinkageTypes::PrivateLinkage, contents, "@epoch_literal");
+		literal->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+		literal->setAlignment(1);
+	}
+
+	return ConstantExpr::getInBoundsGetElementPtr(literal->getValueType(), literal, ArrayRef<Constant*>({ ConstantInt::get(Type::getInt32Ty(GlobalContext), 0), ConstantInt::get(Type::getInt32Ty(GlobalContext), 0) }));
+}
+
+//
+// Fold every string literal that is the tail of a longer one into it
+//
+// "world" can share storage with "hello world", for example. Literals are
+// sorted by their reversed contents, which places each one immediately
+// before a literal it is a suffix of, if there is any; walking the list
+// backwards then finds the longest such literal for each. Uses of folded
+// literals become pointers into the middle of their host.
+//
+// Every private read-only C string in the module takes part, not just the
+// ones made by GetStringLiteral, so strings imported from bitcode libraries
+// are covered too. Only those whose address is insignificant and that need
+// no alignment are folded away; the rest can still host others.
+//
+// Literals are placed in a read-only .strings section that the built-in
+// image writer maps after its own string table. LLD places them itself,
+// in .rdata.
+//
+void CodeGenContext::MergeStringLiterals(Module& module)
+{
+	struct Literal
+	{
+		std::string Reversed;
+		GlobalVariable* Variable;
+		bool Foldable;
+	};
+
+	std::vector<Literal> literals;
+	for (auto& global : module.globals())
+	{
+		if (!global.isConstant() || !global.hasPrivateLinkage() || !global.hasInitializer())
+			continue;
+
+		if (global.hasSection() && !global.getSection().startswith(".rdata") && global.getSection() != ".strings")
+			continue;
+
+		auto* data = dyn_cast<ConstantDataSequential>(global.getInitializer());
+		if (!data || !data->isCString())
+			continue;
+
+		StringRef contents = data->getAsCString();
+		bool foldable = global.hasGlobalUnnamedAddr() && global.getAlignment() <= 1;
+		literals.push_back({ std::string(contents.rbegin(), contents.rend()), &global, foldable });
+	}
+
+	StringLiterals.clear();
+	if (literals.empty())
+		return;
+
+	std::stable_sort(literals.begin(), literals.end(), [](const Literal& lhs, const Literal& rhs) { return lhs.Reversed < rhs.Reversed; });
+
+	std::vector<size_t> host(literals.size());
+	for (size_t index = literals.size(); index-- > 0; )
+	{
+		host[index] = index;
+		if (literals[index].Foldable && index + 1 < literals.size() && literals[index + 1].Reversed.compare(0, literals[index].Reversed.length(), literals[index].Reversed) == 0)
+			host[index] = host[index + 1];
+	}
+
+	size_t emittedbytes = 0;
+	unsigned folded = 0;
+	for (size_t index = 0; index < literals.size(); ++index)
+	{
+		GlobalVariable* literal = literals[index].Variable;
+		if (host[index] == index)
+		{
+			if (!LinkingWithLLD)
+				literal->setSection(".strings");
+
+			emittedbytes += literals[index].Reversed.length() + 1;
+			continue;
+		}
+
+		GlobalVariable* hostliteral = literals[host[index]].Variable;
+		uint64_t offset = literals[host[index]].Reversed.length() - literals[index].Reversed.length();
+
+		Constant* tail = ConstantExpr::getInBoundsGetElementPtr(hostliteral->getValueType(), hostliteral, ArrayRef<Constant*>({ ConstantInt::get(Type::getInt32Ty(GlobalContext), 0), ConstantInt::get(Type::getInt32Ty(GlobalContext), offset) }));
+		literal->replaceAllUsesWith(ConstantExpr::getPointerCast(tail, literal->getType()));
+		literal->eraseFromParent();
+		++folded;
+	}
+
+	std::cout << "String literals: " << (literals.size() - folded) << " emitted (" << emittedbytes << " bytes), " << folded << " folded into longer literals" << std::endl;
+}
+
+
+void CodeGenContext::FinalizeDebugInfo()
+{
+	if (DebugInfoFinalized)
+		return;
+
+	AssignDebugLines(*LLVMModule, DebugCompileUnit);
+	DebugBuilder.finalize();
+	DebugInfoFinalized = true;
+}
+
+
+//
+// Save the module as bitcode, for importing into later builds
+//
+// A ThinLTO module summary is embedded alongside the IR, so the output is
+// also usable by standard LTO tooling. Must be called before the module is
+// handed off by CreateBinaryModule.
+//
+bool CodeGenContext::ModuleWriteBitcode(const char* filename)
+{
+	FinalizeDebugInfo();
+
+	std::error_code ec;
+	raw_fd_ostream out(filename, ec, sys::fs::F_None);
+	if (ec)
+	{
+		std::cout << "Cannot open " << filename << " to write bitcode: " << ec.message() << std::endl;
+		return false;
+	}
+
+	ModuleSummaryIndex summary = buildModuleSummaryIndex(*LLVMModule, nullptr, nullptr);
+	WriteBitcodeToFile(LLVMModule.get(), out, false, &summary);
+	return true;
+}
+
+//
+// Import the definitions this module needs from a bitcode library
+//
+// Only functions that are referenced (directly or transitively) by the
+// module being built are brought in. They are internalized on arrival,
+// which lets the inliner fold them into their callers and keeps symbols
+// from different libraries from colliding.
+//
+bool CodeGenContext::ModuleImportBitcode(const char* filename)
+{
+	std::unique_ptr<Module> library = LoadBitcodeLibrary(filename);
+	if (!library)
+		return false;
+
+	return LinkBitcodeLibrary(filename, std::move(library));
+}
+
+//
+// Link in the runtime library, calling its primitives directly
+//
+// A bound thunk whose DLL export the runtime defines, as a function named
+// "@runtime:<library>:<function>" with the same signature, is redirected to
+// that definition. The import goes away and its calls become direct calls
+// that the inliner can fold. Imports the runtime itself needs are thunks
+// named "@import:<library>:<function>", which are bound once it is linked.
+// Must be called after any other bitcode libraries have been imported, so
+// that their thunks are redirected as well.
+//
+bool CodeGenContext::ModuleImportRuntime(const char* filename)
+{
+	std::unique_ptr<Module> library = LoadBitcodeLibrary(filename);
+	if (!library)
+		return false;
+
+	unsigned redirected = 0;
+	for (auto iter = ThunkImports.begin(); iter != ThunkImports.end(); )
+	{
+		std::string name = "@runtime:" + iter->Library + ":" + iter->Function;
+		FunctionType* fty = cast<FunctionType>(iter->Thunk->getValueType()->getPointerElementType());
+
+		Function* definition = library->getFunction(name);
+		if (!definition || definition->isDeclaration())
+		{
+			++iter;
+			continue;
+		}
+
+		if (definition->getFunctionType() != fty)
+		{
+			std::cout << "Runtime definition of " << iter->Function << " does not match the declared signature; calling " << iter->Library << " instead" << std::endl;
+			++iter;
+			continue;
+		}
+
+		if (!RedirectThunkCalls(iter->Thunk, LLVMModule->getOrInsertFunction(name, fty)))
+		{
+			++iter;
+			continue;
+		}
+
+		iter = ThunkImports.erase(iter);
+		++redirected;
+	}
+
+	if (!LinkBitcodeLibrary(filename, std::move(library)))
+		return false;
+
+	const std::string prefix = "@import:";
+	for (auto& global : LLVMModule->globals())
+	{
+		StringRef name = global.getName();
+		if (!global.hasExternalWeakLinkage() || !name.startswith(prefix))
+			continue;
+
+		bool bound = std::any_of(ThunkImports.begin(), ThunkImports.end(), [&](const ThunkImport& binding) { return binding.Thunk == &global; });
+		if (bound)
+			continue;
+
+		auto parts = name.drop_front(prefix.length()).split(':');
+		ThunkImports.push_back({ &global, parts.first.str(), parts.second.str() });
+	}
+
+	std::cout << "Runtime library: " << redirected << " imports replaced by direct calls" << std::endl;
+	return true;
+}
+
+std::unique_ptr<Module> CodeGenContext::LoadBitcodeLibrary(const char* filename)
+{
+	auto buffer = MemoryBuffer::getFile(filename);
+	if (!buffer)
+	{
+		std::cout << "Cannot open bitcode library " << filename << ": " << buffer.getError().message() << std::endl;
+		return nullptr;
+	}
+
+	auto parsed = parseBitcodeFile((*buffer)->getMemBufferRef(), GlobalContext);
+	if (!parsed)
+	{
+		std::cout << "Cannot read bitcode library " << filename << ": " << toString(parsed.takeError()) << std::endl;
+		return nullptr;
+	}
+
+	std::unique_ptr<Module> library = std::move(*parsed);
+
+	// String pool handles are only meaningful within the build that produced them
+	for (const auto& global : library->globals())
+	{
+		if (global.getName().startswith("@epoch_static_string:"))
+		{
+			std::cout << "Bitcode library " << filename << " refers to string pool entries and cannot be imported; rebuild it with /conststrings" << std::endl;
+			return nullptr;
+		}
+	}
+
+	return library;
+}
+
+bool CodeGenContext::LinkBitcodeLibrary(const char* filename, std::unique_ptr<Module> library)
+{
+	// Anything this module already defines stays as it is
+	std::vector<std::string> definitions;
+	for (const auto& func : *library)
+	{
+		Function* existing = LLVMModule->getFunction(func.getName());
+		if (!func.isDeclaration() && (!existing || existing->isDeclaration()))
+			definitions.push_back(func.getName().str());
+	}
+
+	if (Linker::linkModules(*LLVMModule, std::move(library), Linker::Flags::LinkOnlyNeeded))
+	{
+		std::cout << "Failed to link bitcode library " << filename << std::endl;
+		return false;
+	}
+
+	unsigned imported = 0;
+	for (const auto& name : definitions)
+	{
+		Function* func = LLVMModule->getFunction(name);
+		if (func && !func->isDeclaration() && func->getLinkage() == GlobalValue::LinkageTypes::ExternalLinkage)
+		{
+			func->setLinkage(GlobalValue::LinkageTypes::InternalLinkage);
+			FunctionOrigins[name] = filename;
+			++imported;
+		}
+	}
+
+	std::cout << "Imported " << imported << " functions from " << filename << std::endl;
+	ImportedFunctionCount += imported;
+	return true;
+}
+
+
+void CodeGenContext::SetStringPoolCallback(void* functionPointer)
+{
+	StringLookupFunction = functionPointer;
+}
+
+void CodeGenContext::SetOptimizeForSize(bool enable)
+{
+	OptimizeForSize = enable;
+}
+
+void CodeGenContext::SetProfileOutput(const char* filename)
+{
+	ProfileOutputPath = filename;
+}
+
+void CodeGenContext::SetMemoryBudget(unsigned megabytes)
+{
+	MemoryBudget = uint64_t(megabytes) * 1024 * 1024;
+}
+
+
+//
+// Load a sample profile to guide optimization of the module
+//
+// Either of LLVM's sample formats (text or binary) is accepted. Functions
+// are keyed by symbol name, as in the PDB and in .eprof files: the name the
+// front end passed to FunctionCreate, with the suffix LLVM gives overloads
+// that reuse a name (foo.1). The loader pass looks them up the same way. The file
+// is read here so that a bad profile fails the build before code generation;
+// the loader pass in OptimizeModule reads it again when it attaches the samples.
+//
+bool CodeGenContext::SetProfileInput(const char* filename)
+{
+	auto reader = sampleprof::SampleProfileReader::create(filename, GlobalContext);
+	if (!reader)
+	{
+		std::cout << "Cannot open sample profile " << filename << ": " << reader.getError().message() << std::endl;
+		return false;
+	}
+
+	if (std::error_code ec = (*reader)->read())
+	{
+		std::cout << "Cannot read sample profile " << filename << ": " << ec.message() << std::endl;
+		return false;
+	}
+
+	ProfileInputPath = filename;
+	ProfileReader = std::move(*reader);
+	return true;
+}
+
+
+//
+// Collect optimization remarks from every pass and write them to a YAML file
+//
+// Each remark is written by LLVM's own YAML mapping, the one behind clang's
+// -fsave-optimization-record, so the file carries source locations and the
+// structured arguments opt-viewer needs. Function names in the file are
+// symbol names; the per-function summaries use the names the front end
+// passed to FunctionCreate.
+//
+bool CodeGenContext::SetRemarksOutput(const char* filename)
+{
+	std::error_code ec;
+	RemarksStream = llvm::make_unique<raw_fd_ostream>(filename, ec, sys::fs::F_Text);
+	if (ec)
+	{
+		std::cout << "Cannot open " << filename << " to write optimization remarks: " << ec.message() << std::endl;
+		RemarksStream.reset();
+		return false;
+	}
+
+	RemarksYAML = llvm::make_unique<yaml::Output>(*RemarksStream);
+	GlobalContext.setDiagnosticHandler(llvm::make_unique<RemarkCollector>([this](const DiagnosticInfoOptimizationBase& remark) { RecordOptimizationRemark(remark); }));
+	return true;
+}
+
+void CodeGenContext::RecordOptimizationRemark(const DiagnosticInfoOptimizationBase& remark)
+{
+	std::string function;
+	if (auto* located = dyn_cast<DiagnosticInfoWithLocationBase>(&remark))
+	{
+		function = located->getFunction().getName().str();
+
+		auto epochname = EpochFunctionNames.find(function);
+		if (epochname != EpochFunctionNames.end())
+			function = epochname->second;
+	}
+
+	auto* document = const_cast<DiagnosticInfoOptimizationBase*>(&remark);
+	*RemarksYAML << document;
+
+	std::string message = remark.getMsg();
+	if (strcmp(GetRemarkTag(remark), "Missed") == 0)
+		MissedOptimizations[function].push_back(remark.getPassName().str() + ": " + message);
+}
+
+unsigned CodeGenContext::GetMissedOptimizationFunctionCount() const
+{
+	return static_cast<unsigned>(MissedOptimizations.size());
+}
+
+const char* CodeGenContext::GetMissedOptimizationFunction(unsigned index, unsigned* outLength) const
+{
+	if (index >= MissedOptimizations.size())
+	{
+		if (outLength)
+			*outLength = 0;
+
+		return nullptr;
+	}
+
+	auto iter = MissedOptimizations.begin();
+	std::advance(iter, index);
+
+	if (outLength)
+		*outLength = static_cast<unsigned>(iter->first.length());
+
+	return iter->first.c_str();
+}
+
+//
+// Summarize the missed optimizations reported for one function
+//
+// Each distinct remark appears once, as "pass: message", followed by the
+// number of times it was reported if more than once.
+//
+const char* CodeGenContext::GetMissedOptimizationSummary(const char* function, unsigned* outLength)
+{
+	MissedOptimizationSummary.clear();
+
+	auto remarks = MissedOptimizations.find(function);
+	if (remarks != MissedOptimizations.end())
+	{
+		std::map<std::string, unsigned> counts;
+		std::vector<std::string> order;
+		for (const auto& remark : remarks->second)
+		{
+			if (counts[remark]++ == 0)
+				order.push_back(remark);
+		}
+
+		for (const auto& remark : order)
+		{
+			MissedOptimizationSummary += remark;
+			if (counts[remark] > 1)
+				MissedOptimizationSummary += " (x" + std::to_string(counts[remark]) + ")";
+
+			MissedOptimizationSummary += "\n";
+		}
+	}
+
+	if (outLength)
+		*outLength = static_cast<unsigned>(MissedOptimizationSummary.length());
+
+	return MissedOptimizationSummary.c_str();
+}
+
+
+//
+// Add per-function call counters and inclusive cycle timers
+//
+// Every function except @init bumps its call counter on entry and reads the
+// cycle counter; each return adds the elapsed cycles to the function's
+// total. When the return follows a tail call, the timer stops before the
+// call instead, so the call stays in tail position. The whole profile block
+// (see ProfileFormat.h) is written to the requested file by @profile:flush,
+// which runs as @init returns and also just before any call to ExitProcess,
+// so programs that exit without returning from their entry point still
+// leave a profile behind.
+//
+// Only llvm.readcyclecounter and ordinary loads and stores are used, so the
+// instrumentation does not depend on the target; file output goes through
+// imported CreateFileA, WriteFile and CloseHandle.
+//
+void CodeGenContext::InstrumentModule(Module& module)
+{
+	Function* init = module.getFunction("@init");
+
+	std::vector<Function*> targets;
+	std::string names;
+	for (auto& func : module)
+	{
+		if (func.isDeclaration() || &func == init)
+			continue;
+
+		targets.push_back(&func);
+		names += func.getName().str();
+		names.push_back(0);
+	}
+
+	Type* i8 = Type::getInt8Ty(GlobalContext);
+	Type* i32 = Type::getInt32Ty(GlobalContext);
+	Type* i64 = Type::getInt64Ty(GlobalContext);
+
+	StructType* recordtype = StructType::get(GlobalContext, { i64, i64 });
+	ArrayType* recordstype = ArrayType::get(recordtype, targets.size());
+	ArrayType* namestype = ArrayType::get(i8, names.size());
+	StructType* profiletype = StructType::get(GlobalContext, { i32, i32, i32, i32, recordstype, namestype });
+
+	Constant* initializer = ConstantStruct::get(profiletype, {
+		ConstantInt::get(i32, ProfileFileMagic),
+		ConstantInt::get(i32, ProfileFileVersion),
+		ConstantInt::get(i32, targets.size()),
+		ConstantInt::get(i32, names.size()),
+		ConstantAggregateZero::get(recordstype),
+		ConstantDataArray::getString(GlobalContext, names, false)
+	});
+
+	// The built-in image writer only maps .global as writable data; LLD can take a section of its own
+	const char* section = LinkingWithLLD ? ".prof" : ".global";
+
+	auto* profile = new GlobalVariable(module, profiletype, false, GlobalValue::LinkageTypes::InternalLinkage, initializer, "@epoch_profile");
+	profile->setSection(section);
+
+	Function* cyclecounter = Intrinsic::getDeclaration(&module, Intrinsic::readcyclecounter);
+
+	for (unsigned index = 0; index < targets.size(); ++index)
+	{
+		Function* func = targets[index];
+
+		IRBuilder<> entry(&*func->getEntryBlock().getFirstInsertionPt());
+		Value* calls = entry.CreateConstInBoundsGEP2_32(profiletype, profile, 0, 4);
+		calls = entry.CreateConstInBoundsGEP2_32(recordstype, calls, 0, index);
+		Value* cycles = entry.CreateStructGEP(recordtype, calls, 1);
+		calls = entry.CreateStructGEP(recordtype, calls, 0);
+
+		entry.CreateStore(entry.CreateAdd(entry.CreateLoad(calls), ConstantInt::get(i64, 1)), calls);
+		Value* start = entry.CreateCall(cyclecounter);
+
+		for (auto& block : *func)
+		{
+			auto* ret = dyn_cast_or_null<ReturnInst>(block.getTerminator());
+			if (!ret)
+				continue;
+
+			Instruction* exitpoint = ret;
+			auto* tailcall = dyn_cast_or_null<CallInst>(ret->getPrevNode());
+			if (tailcall && tailcall->isTailCall())
+				exitpoint = tailcall;
+
+			IRBuilder<> exit(exitpoint);
+			Value* elapsed = exit.CreateSub(exit.CreateCall(cyclecounter), start);
+			exit.CreateStore(exit.CreateAdd(exit.CreateLoad(cycles), elapsed), cycles);
+		}
+	}
+
+	if (!init)
+		return;
+
+	// HANDLE CreateFileA(LPCSTR, DWORD, DWORD, LPSECURITY_ATTRIBUTES, DWORD, DWORD, HANDLE)
+	// BOOL WriteFile(HANDLE, LPCVOID, DWORD, LPDWORD, LPOVERLAPPED)
+	// BOOL CloseHandle(HANDLE)
+	Type* ptr = i8->getPointerTo();
+	FunctionType* createfilety = FunctionType::get(ptr, { ptr, i32, i32, ptr, i32, i32, ptr }, false);
+	FunctionType* writefilety = FunctionType::get(i32, { ptr, ptr, i32, i32->getPointerTo(), ptr }, false);
+	FunctionType* closehandlety = FunctionType::get(i32, { ptr }, false);
+
+	auto createimport = [&](FunctionType* fty, const char* function)
+	{
+		auto* thunk = new GlobalVariable(module, fty->getPointerTo(), true, GlobalValue::ExternalWeakLinkage, nullptr, std::string("@profile:") + function);
+		ThunkImports.push_back({ thunk, "Kernel32.dll", function });
+		return thunk;
+	};
+
+	GlobalVariable* createfile = createimport(createfilety, "CreateFileA");
+	GlobalVariable* writefile = createimport(writefilety, "WriteFile");
+	GlobalVariable* closehandle = createimport(closehandlety, "CloseHandle");
+
+	auto* path = new GlobalVariable(module, ArrayType::get(i8, ProfileOutputPath.length() + 1), true, GlobalValue::LinkageTypes::PrivateLinkage, ConstantDataArray::getString(GlobalContext, ProfileOutputPath), "@epoch_profile_path");
+	path->setSection(section);
+
+	uint64_t profilesize = module.getDataLayout().getStructLayout(profiletype)->getElementOffset(5) + names.size();
+
+	const uint32_t GenericWrite = 0x40000000;
+	const uint32_t CreateAlways = 2;
+	const uint32_t FileAttributeNormal = 0x80;
+
+	auto* flushfunc = Function::Create(FunctionType::get(Type::getVoidTy(GlobalContext), false), GlobalValue::LinkageTypes::InternalLinkage, "@profile:flush", &module);
+	flushfunc->addFnAttr(Attribute::NoInline);
+	{
+		IRBuilder<> flush(BasicBlock::Create(GlobalContext, "", flushfunc));
+		Value* nullptrvalue = ConstantPointerNull::get(cast<PointerType>(ptr));
+		Value* written = flush.CreateAlloca(i32, nullptr, "written");
+
+		Value* handle = flush.CreateCall(flush.CreateLoad(createfile), { flush.CreatePointerCast(path, ptr), ConstantInt::get(i32, GenericWrite), ConstantInt::get(i32, 0), nullptrvalue, ConstantInt::get(i32, CreateAlways), ConstantInt::get(i32, FileAttributeNormal), nullptrvalue });
+		flush.CreateCall(flush.CreateLoad(writefile), { handle, flush.CreatePointerCast(profile, ptr), ConstantInt::get(i32, profilesize), written, nullptrvalue });
+		flush.CreateCall(flush.CreateLoad(closehandle), { handle });
+		flush.CreateRetVoid();
+	}
+
+	std::vector<Instruction*> flushpoints;
+	for (auto& block : *init)
+	{
+		if (auto* ret = dyn_cast_or_null<ReturnInst>(block.getTerminator()))
+			flushpoints.push_back(ret);
+	}
+
+	// ExitProcess is reached either through a bound import thunk or, in
+	// bitcode linked in from a library, as a plain external declaration
+	for (const auto& binding : ThunkImports)
+	{
+		if (binding.Function != "ExitProcess")
+			continue;
+
+		for (User* user : binding.Thunk->users())
+		{
+			if (!isa<LoadInst>(user))
+				continue;
+
+			for (User* loaduser : user->users())
+			{
+				auto* call = dyn_cast<CallInst>(loaduser);
+				if (call && call->getCalledValue() == user)
+					flushpoints.push_back(call);
+			}
+		}
+	}
+
+	if (Function* exitprocess = module.getFunction("ExitProcess"))
+	{
+		for (User* user : exitprocess->users())
+		{
+			auto* call = dyn_cast<CallInst>(user);
+			if (call && call->getCalledFunction() == exitprocess)
+				flushpoints.push_back(call);
+		}
+	}
+
+	for (Instruction* point : flushpoints)
+	{
+		CallInst* call = CallInst::Create(flushfunc, "", point);
+		if (DISubprogram* subprogram = point->getFunction()->getSubprogram())
+			call->setDebugLoc(DILocation::get(GlobalContext, point->getDebugLoc() ? point->getDebugLoc().getLine() : subprogram->getLine(), 1, subprogram));
+	}
+
+	std::cout << "Instrumented " << targets.size() << " functions; profile will be written to " << ProfileOutputPath << std::endl;
+}
+
+
+//
+// Report how much of the program the sample profile covers
+//
+// Functions the profile has no samples for are left as they are. A
+// sampling profile misses code that runs rarely or briefly, and a function
+// the production runs never reached may be the one the next input needs,
+// so no samples is not evidence that a function is cold. The loader pass
+// gives them no entry count, and they are optimized as without a profile.
+// @init, helpers with internal "@" names, and functions imported from
+// bitcode libraries are never in an Epoch profile, so they are not counted.
+//
+void CodeGenContext::MatchSampleProfile(Module& module)
+{
+	std::set<std::string> programnames;
+	unsigned matched = 0;
+	unsigned unmatched = 0;
+
+	for (auto& func : module)
+	{
+		if (func.isDeclaration() || func.getName().startswith("@") || FunctionOrigins.count(func.getName().str()))
+			continue;
+
+		// Looked up by symbol name, as the loader pass does, so each overload has its own samples
+		std::string name = func.getName().str();
+		programnames.insert(name);
+
+		auto samples = ProfileReader->getProfiles().find(name);
+		if (samples != ProfileReader->getProfiles().end() && samples->second.getTotalSamples())
+		{
+			++matched;
+			continue;
+		}
+
+		++unmatched;
+	}
+
+	std::vector<std::string> missing;
+	for (const auto& entry : ProfileReader->getProfiles())
+	{
+		if (!programnames.count(entry.getKey().str()))
+			missing.push_back(entry.getKey().str());
+	}
+
+	std::cout << "Sample profile: " << matched << " functions matched, " << unmatched << " without samples, " << missing.size() << " profiled functions not in the program" << std::endl;
+
+	const size_t listlimit = 10;
+	for (size_t i = 0; i < missing.size() && i < listlimit; ++i)
+		std::cout << "Sample profile: no function named " << missing[i] << std::endl;
+
+	if (missing.size() > listlimit)
+		std::cout << "Sample profile: ... and " << (missing.size() - listlimit) << " more" << std::endl;
+}
+
+
+void CodeGenContext::CreateBinaryModule()
+{
+	// Target initialization is done once per process when the first context is created
+	FinalizeDebugInfo();
+
+	std::unique_ptr<TargetMachine> machine = AcquireTargetMachine();
+	if (!machine)
+		return;
+
+	StringCallbackT StringCallback = reinterpret_cast<StringCallbackT>(StringLookupFunction);
+
+	CachedMemoryManager = std::make_unique<TrivialMemoryManager>(&ThunkImportAddresses, StringCallback, &EmissionAddress, &EmissionSize, &EmittedPData, &EmittedPDataSize, &EmittedXData, &EmittedXDataSize, &EmittedGlobals, &EmittedGlobalsSize, &EmittedStrings, &EmittedStringsSize);
+	CachedLoader = std::make_unique<RuntimeDyld>(*CachedMemoryManager, *CachedMemoryManager);
+
+	Module* llvmmodule = LLVMModule.get();
+	llvmmodule->setDataLayout(machine->createDataLayout());
+
+	OptimizeModule(*llvmmodule);
+
+	llvmmodule->dump();
+
+	Batches.clear();
+	if (MemoryBudget)
+		GenerateCodeInBatches(*llvmmodule, *machine);
+	else
+		GenerateBatch(llvmmodule, *machine);
+
+	ReleaseTargetMachine(std::move(machine));
+
+	// Unwind records are folded before anyone asks for the .xdata size, so the image layout sees the smaller section
+	if (OptimizeForSize)
+	{
+		size_t foldedbytes = 0;
+		for (auto& batch : Batches)
+		{
+			if (!batch.XData)
+				continue;
+
+			for (const auto& section : batch.Image->sections())
+			{
+				StringRef sectionname;
+				section.getName(sectionname);
+				if (sectionname != ".pdata")
+					continue;
+
+				size_t originalsize = batch.XDataSize;
+				batch.XDataRemap = DeduplicateUnwindInfo(section, reinterpret_cast<char*>(batch.XData), &batch.XDataSize);
+				foldedbytes += originalsize - batch.XDataSize;
+			}
+		}
+
+		std::cout << "Size optimization: " << foldedbytes << " bytes of duplicate unwind data folded" << std::endl;
+	}
+
+	MergeDebugTypes();
+	LayoutBatches();
+}
+
+//
+// Generate code for the module a batch of functions at a time
+//
+// Each batch is cloned into a module of its own and compiled to a separate
+// object, after which the clone and the original function bodies are both
+// freed. Peak memory is then the remaining IR plus one batch's worth of code
+// generation state, instead of IR, MC state and the emitted object for the
+// whole program at once. Batches are sized from whatever is left of the
+// budget as each one starts, and follow module order so the call graph
+// layout is preserved in .text. Global variables stay in the original
+// module, which is compiled last once it no longer holds any code.
+//
+void CodeGenContext::GenerateCodeInBatches(Module& module, TargetMachine& machine)
+{
+	// Batches refer to each other's functions and to the globals by name, so nothing can stay local
+	unsigned unnamedcount = 0;
+	auto externalize = [&unnamedcount](GlobalValue& gv)
+	{
+		if (gv.isDeclaration() || !gv.hasLocalLinkage())
+			return;
+
+		if (!gv.hasName())
+			gv.setName("@batch_local:" + std::to_string(unnamedcount++));
+
+		gv.setLinkage(GlobalValue::LinkageTypes::ExternalLinkage);
+	};
+
+	std::vector<Function*> pending;
+	for (auto& func : module)
+	{
+		externalize(func);
+		if (!func.isDeclaration())
+			pending.push_back(&func);
+	}
+
+	for (auto& global : module.globals())
+		externalize(global);
+
+	uint64_t peakusage = 0;
+	size_t next = 0;
+	while (next < pending.size())
+	{
+		uint64_t usage = GetPrivateMemoryUsage();
+		uint64_t headroom = MemoryBudget > usage ? MemoryBudget - usage : 0;
+		uint64_t limit = std::max(headroom / CodeGenBytesPerInstruction, MinimumBatchInstructions);
+
+		size_t first = next;
+		std::set<const GlobalValue*> members;
+		uint64_t instructions = 0;
+		while (next < pending.size())
+		{
+			uint64_t size = CountInstructions(*pending[next]);
+			if (!members.empty() && instructions + size > limit)
+				break;
+
+			members.insert(pending[next]);
+			instructions += size;
+			++next;
+		}
+
+		ValueToValueMapTy vmap;
+		std::unique_ptr<Module> clone = CloneModule(&module, vmap, [&members](const GlobalValue* gv) { return members.count(gv) != 0; });
+		GenerateBatch(clone.get(), machine);
+
+		peakusage = std::max(peakusage, GetPrivateMemoryUsage());
+
+		// The object keeps everything finalization needs; the IR on both sides can go
+		clone.reset();
+
+		for (size_t index = first; index < next; ++index)
+			pending[index]->deleteBody();
+
+		std::cout << "Code generation batch " << Batches.size() << ": " << (next - first) << " functions, " << instructions << " instructions" << std::endl;
+	}
+
+	GenerateBatch(&module, machine);
+
+	const uint64_t megabyte = 1024 * 1024;
+	std::cout << "Streaming code generation: " << Batches.size() << " objects, peak " << (peakusage / megabyte) << " MB of " << (MemoryBudget / megabyte) << " MB budget" << std::endl;
+	if (peakusage > MemoryBudget)
+		std::cout << "WARNING: memory budget exceeded; the IR for the whole program may not fit" << std::endl;
+}
+
+//
+// Compile one module to an object, load it, and record where its sections landed
+//
+// The object stays loaded until the context is destroyed, so that
+// FinalizeBinaryModule can relocate it together with the other batches.
+//
+void CodeGenContext::GenerateBatch(Module* module, TargetMachine& machine)
+{
+	// Objects without code (or unwind data) never allocate those sections, so stale values must not carry over
+	EmittedImage = nullptr;
+	EmissionAddress = 0;
+	EmissionSize = 0;
+	EmittedXData = 0;
+	EmittedXDataSize = 0;
+
+	SmallVector<char, 0> objectbytes;
+	{
+		raw_svector_ostream stream(objectbytes);
+		legacy::PassManager pm;
+		MCContext* mccontext = nullptr;
+		if (machine.addPassesToEmitMC(pm, mccontext, stream))
+		{
+			std::cout << "Target cannot emit objects in memory" << std::endl;
+			return;
+		}
+
+		pm.run(*module);
+	}
+
+	std::unique_ptr<MemoryBuffer> buffer = MemoryBuffer::getMemBufferCopy(StringRef(objectbytes.data(), objectbytes.size()), module->getModuleIdentifier());
+	auto object = object::ObjectFile::createObjectFile(buffer->getMemBufferRef());
+	if (!object)
+	{
+		std::cout << "Cannot read generated object: " << toString(object.takeError()) << std::endl;
+		return;
+	}
+
+	CachedLoader->loadObject(**object);
+	if (CachedLoader->hasError())
+	{
+		std::cout << "Cannot load generated object: " << CachedLoader->getErrorString().str() << std::endl;
+		return;
+	}
+
+	EmittedImage = object->get();
+	EmittedObjectBuffers.push_back(std::move(buffer));
+	EmittedObjects.push_back(std::move(*object));
+
+	// The allocator only records the last code section it handed out, so count them all here
+	EmissionSize = 0;
+	for (const auto& section : EmittedImage->sections())
+	{
+		if (section.isText())
+			EmissionSize += static_cast<size_t>(section.getSize());
+	}
+
+	EmittedBatch batch;
+	batch.Image = EmittedImage;
+	batch.Code = EmissionAddress;
+	batch.CodeSize = EmissionSize;
+	batch.XData = EmittedXData;
+	batch.XDataSize = EmittedXDataSize;
+
+	// Only record sizes here; the contents are written out once, during relocation
+	for (const auto& section : EmittedImage->sections())
+	{
+		if (!section.isText() && !section.isBSS() && !section.isVirtual())
+		{
+			StringRef sectionname;
+			section.getName(sectionname);
+
+			if (sectionname == ".pdata")
+				batch.PDataSize = static_cast<size_t>(section.getSize());
+			else if (sectionname == ".debug$S")
+				batch.DebugSize = static_cast<size_t>(section.getSize());
+		}
+	}
+
+	Batches.push_back(std::move(batch));
+}
+
+//
+// Place every batch within the combined output sections
+//
+// Code is padded to 16 bytes between batches and unwind data to 4. Debug
+// records carry a CodeView signature at the start of each object's section,
+// which the combined section only needs once, so every batch after the
+// first is positioned to overlap its signature with the end of the
+// previous batch.
+//
+void CodeGenContext::LayoutBatches()
+{
+	EmissionSize = 0;
+	PDataSize = 0;
+	EmittedXDataSize = 0;
+	DebugDataSize = 0;
+
+	for (auto& batch : Batches)
+	{
+		if (batch.CodeSize)
+		{
+			batch.CodeOffset = static_cast<size_t>(alignTo(EmissionSize, 16));
+			EmissionSize = batch.CodeOffset + batch.CodeSize;
+		}
+
+		batch.PDataOffset = PDataSize;
+		PDataSize += batch.PDataSize;
+
+		if (batch.XDataSize)
+		{
+			batch.XDataOffset = static_cast<size_t>(alignTo(EmittedXDataSize, 4));
+			EmittedXDataSize = batch.XDataOffset + batch.XDataSize;
+		}
+
+		if (batch.DebugSize <= CodeViewSignatureSize)
+			continue;
+
+		if (DebugDataSize)
+			batch.DebugOffset = static_cast<size_t>(alignTo(DebugDataSize, 4)) - CodeViewSignatureSize;
+
+		DebugDataSize = batch.DebugOffset + batch.DebugSize;
+	}
+}
+
+//
+// Combine the CodeView type records of every batch into one TPI and one IPI stream
+//
+// Each object numbers its own type records from 0x1000, so the same type
+// appears once per object that uses it. Records are deduplicated by their
+// global hash, which covers everything a record refers to; an identical
+// hash means an identical type, so no record is ever compared byte for
+// byte. Hashes come from .debug$H, or are computed here, in parallel, for
+// objects without one. Merging itself is sequential, in batch order, so
+// the resulting type indices do not depend on thread timing.
+//
+void CodeGenContext::MergeDebugTypes()
+{
+	DebugTypes = DebugTypeStream();
+	DebugIds = DebugTypeStream();
+
+	std::vector<ObjectDebugTypes> objects(Batches.size());
+
+	std::atomic<size_t> nextobject(0);
+	auto hashobjects = [&]()
+	{
+		for (size_t index = nextobject++; index < objects.size(); index = nextobject++)
+			ReadObjectDebugTypes(Batches[index].Image, &objects[index]);
+	};
+
+	size_t threadcount = std::min<size_t>(objects.size(), std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < threadcount; ++i)
+		threads.emplace_back(hashobjects);
+
+	hashobjects();
+	for (auto& thread : threads)
+		thread.join();
+
+	BumpPtrAllocator storage;
+	codeview::GlobalTypeTableBuilder types(storage);
+	codeview::GlobalTypeTableBuilder ids(storage);
+
+	size_t recordcount = 0;
+	size_t precomputed = 0;
+	for (size_t index = 0; index < objects.size(); ++index)
+	{
+		auto& batch = Batches[index];
+		batch.TypeMap.clear();
+
+		if (objects[index].Hashes.empty())
+			continue;
+
+		recordcount += objects[index].Hashes.size();
+		if (objects[index].Precomputed)
+			++precomputed;
+
+		SmallVector<codeview::TypeIndex, 128> typemap;
+		if (auto err = codeview::mergeTypeAndIdRecords(ids, types, typemap, objects[index].Records, objects[index].Hashes))
+		{
+			std::cout << "Cannot merge debug types of object " << index << ": " << toString(std::move(err)) << std::endl;
+			continue;
+		}
+
+		batch.TypeMap.assign(typemap.begin(), typemap.end());
+	}
+
+	FlattenTypeTable(types, &DebugTypes);
+	FlattenTypeTable(ids, &DebugIds);
+
+	std::cout << "Debug types: " << recordcount << " records from " << objects.size() << " objects (" << precomputed << " with precomputed hashes) merged into " << DebugTypes.Count << " types and " << DebugIds.Count << " ids" << std::endl;
+}
+
+//
+// Run the IR-level optimization pipeline shared by every output mode
+//
+void CodeGenContext::OptimizeModule(Module& module)
+{
+	// TODO - reexamine optimizations
+
+	ReportInstanceCache();
+	EvaluateGlobalInitializers(module);
+	MergeStringLiterals(module);
+
+	// In size mode only @init needs to stay visible, so everything it cannot reach can go
+	unsigned initialfunctions = CountFunctionDefinitions(module);
+	if (OptimizeForSize)
+	{
+		for (auto& func : module)
+			func.addFnAttr(Attribute::OptimizeForSize);
+
+		legacy::PassManager dcepm;
+		dcepm.add(createInternalizePass([](const GlobalValue& gv) { return gv.getName() == "@init"; }));
+		dcepm.add(createGlobalDCEPass());
+		dcepm.run(module);
+	}
+	unsigned reachablefunctions = CountFunctionDefinitions(module);
+
+	AssignCallingConventions(module);
+	MarkTailPositionCalls(module);
+
+	std::map<Function*, unsigned> selftailcalls;
+	for (auto& func : module)
+	{
+		unsigned count = CountSelfTailCalls(func);
+		if (count)
+			selftailcalls[&func] = count;
+	}
 
-	std::ostringstream stringID;
-	stringID << "@epoch_static_string:" << index;
-	
-	auto* var = new GlobalVariable(*LLVMModule, Type::getInt8Ty(GlobalContext), true, GlobalValue::LinkageTypes::ExternalWeakLinkage, nullptr, stringID.str());
-	StringCache[index] = var;
-	return var;
-}
+	// Counters go in after tail calls are marked, so the timer code can stay clear of them
+	if (!ProfileOutputPath.empty())
+		InstrumentModule(module);
 
+	if (ProfileReader)
+		MatchSampleProfile(module);
 
-void CodeGenContext::SetStringPoolCallback(void* functionPointer)
-{
-	StringLookupFunction = functionPointer;
+	legacy::PassManager mpm;
+
+	// Coroutines are split into their ramp, resume and destroy functions before
+	// anything else can inline them. With the ramps inlined, CoroElide can then
+	// move the frames of coroutines that do not outlive their caller onto its stack.
+	bool coroutines = !Coroutines.empty();
+	if (coroutines)
+		mpm.add(createCoroEarlyPass());
+
+	mpm.add(createPromoteMemoryToRegisterPass());
+
+	// Samples are matched to blocks by line offset, so they go on before anything
+	// reshapes the CFG. The loader sets entry counts and branch weights, which the
+	// inliner's hot call site threshold and machine block placement both read.
+	if (ProfileReader)
+		mpm.add(createSampleProfileLoaderPass(ProfileInputPath));
+
+	if (coroutines)
+		mpm.add(createCoroSplitPass());
+
+	// Functions imported from bitcode libraries are internal, so the inliner can fold them into their callers;
+	// with a sample profile it also inlines call sites the profile shows are hot, and it removes instance forwarders
+	if (ImportedFunctionCount || coroutines || ProfileReader || ForwardedInstanceCount)
+		mpm.add(createFunctionInliningPass());
+
+	if (coroutines)
+		mpm.add(createCoroElidePass());
+
+	mpm.add(createSCCPPass());
+	mpm.add(createCFGSimplificationPass());
+	mpm.add(createTailCallEliminationPass());
+
+	if (coroutines)
+	{
+		mpm.add(createBarrierNoopPass());
+		mpm.add(createCoroCleanupPass());
+	}
+
+	mpm.run(module);
+
+	if (coroutines)
+		RestoreEscapingCallingConventions(module);
+
+	// Merging runs last so that functions which simplify to the same body fold together,
+	// such as generic instantiations whose type arguments share a representation
+	unsigned optimizedfunctions = CountFunctionDefinitions(module);
+	legacy::PassManager mergepm;
+	mergepm.add(createMergeFunctionsPass());
+	if (OptimizeForSize)
+		mergepm.add(createGlobalDCEPass());
+	mergepm.run(module);
+
+	unsigned finalfunctions = CountFunctionDefinitions(module);
+	if (OptimizeForSize)
+		std::cout << "Size optimization: " << (initialfunctions - reachablefunctions) << " unreachable functions removed, " << (optimizedfunctions - finalfunctions) << " identical functions merged" << std::endl;
+	else if (finalfunctions < optimizedfunctions)
+		std::cout << "Identical functions merged: " << (optimizedfunctions - finalfunctions) << std::endl;
+
+	TailRecursionReport.clear();
+	TailRecursionCount = 0;
+	for (const auto& pair : selftailcalls)
+	{
+		unsigned converted = pair.second - std::min(pair.second, CountSelfTailCalls(*pair.first));
+		if (!converted)
+			continue;
+
+		std::string name = pair.first->getName().str();
+		std::cout << "Tail recursion converted to loop: " << name << " (" << converted << " sites)" << std::endl;
+
+		std::copy(std::begin(name), std::end(name), std::back_inserter(TailRecursionReport));
+		TailRecursionReport.push_back(0);
+		AppendToBuffer(&TailRecursionReport, uint32_t(converted));
+		++TailRecursionCount;
+	}
+
+	OrderFunctionsByCallGraph(module);
 }
 
 
-void CodeGenContext::CreateBinaryModule()
+//
+// Emit the module as a standard COFF object and link it in-process with LLD
+//
+// This is an alternative to CreateBinaryModule and the hand-written PE and
+// PDB writers in the compiler. The object, plus one import library per DLL
+// that thunks were bound to, are written next to the output image and then
+// handed to LLD's COFF driver with lld-link semantics. LLD takes care of
+// section layout, unreferenced code removal, identical code folding, and
+// merging type records into the PDB.
+//
+bool CodeGenContext::ModuleLinkImage(const char* filename)
 {
-	LLVMLinkInMCJIT();
-	LLVMInitializeNativeAsmPrinter();
-	LLVMInitializeNativeAsmParser();
+	// LLD keeps its configuration in globals, so links cannot overlap
+	static std::mutex linkmutex;
 
-	DebugBuilder.finalize();
+	FinalizeDebugInfo();
+
+	for (const auto& global : LLVMModule->globals())
+	{
+		if (global.getName().startswith("@epoch_static_string:"))
+		{
+			std::cout << "String pool entries cannot be placed in a linkable object; build with /conststrings" << std::endl;
+			return false;
+		}
+	}
 
 	std::string errstr;
+	const Target* target = TargetRegistry::lookupTarget(LLVMModule->getTargetTriple(), errstr);
+	if (!target)
+	{
+		std::cout << "Cannot find target for object emission: " << errstr << std::endl;
+		return false;
+	}
 
 	TargetOptions opts;
 	opts.UnsafeFPMath = true;
 	opts.AllowFPOpFusion = FPOpFusion::Fast;
-	opts.EnableFastISel = false;
 	opts.GuaranteedTailCallOpt = true;
 
-	ThunkCallbackT ThunkCallback = nullptr;
-	StringCallbackT StringCallback = reinterpret_cast<StringCallbackT>(StringLookupFunction);
+	std::unique_ptr<TargetMachine> machine(target->createTargetMachine(LLVMModule->getTargetTriple(), "", "", opts, Reloc::PIC_));
 
-	std::unique_ptr<TrivialMemoryManager> blobmgr = std::make_unique<TrivialMemoryManager>(ThunkCallback, StringCallback, &EmissionAddress, &EmissionSize, &EmittedPData, &EmittedPDataSize, &EmittedXData, &EmittedXDataSize);
-	
-	// HACK! We move the smart pointer's contents into the EngineBuilder
-	// below, but we still want to access the module for other purposes.
-	Module* llvmmodule = LLVMModule.get();
-	CachedMemoryManager = blobmgr.get();
+	LinkingWithLLD = true;
+	OptimizeModule(*LLVMModule);
+
+	// Each thunk becomes a reference to the import address table slot the linker creates for it
+	for (const auto& binding : ThunkImports)
+	{
+		std::string slotname = "__imp_" + binding.Function;
 
+		GlobalVariable* existing = LLVMModule->getNamedGlobal(slotname);
+		if (existing)
+		{
+			binding.Thunk->replaceAllUsesWith(ConstantExpr::getBitCast(existing, binding.Thunk->getType()));
+			binding.Thunk->eraseFromParent();
+			continue;
+		}
 
-	EngineBuilder eb(std::move(LLVMModule));
-	eb.setErrorStr(&errstr);
-	eb.setTargetOptions(opts);
-	eb.setMCJITMemoryManager(std::move(blobmgr));
+		binding.Thunk->setName(slotname);
+		binding.Thunk->setLinkage(GlobalValue::LinkageTypes::ExternalLinkage);
+	}
 
-	SmallVector<std::string, 2> emptyvec;
-	TargetMachine* machine = eb.selectTarget(Triple("x86_64-pc-windows-msvc"), "", "", emptyvec);
+	SmallString<256> objpath(filename);
+	sys::path::replace_extension(objpath, "obj");
 
-	CachedExecutionEngine = eb.create(machine);
-	if (!CachedExecutionEngine)
 	{
-		return;
-	}
+		std::error_code ec;
+		raw_fd_ostream out(objpath, ec, sys::fs::F_None);
+		if (ec)
+		{
+			std::cout << "Cannot open " << objpath.str().str() << " to write object: " << ec.message() << std::endl;
+			return false;
+		}
+
+		legacy::PassManager pm;
+		if (machine->addPassesToEmitFile(pm, out, TargetMachine::CGFT_ObjectFile))
+		{
+			std::cout << "Target cannot emit object files" << std::endl;
+			return false;
+		}
 
-	llvmmodule->setDataLayout(CachedExecutionEngine->getDataLayout());
+		pm.run(*LLVMModule);
+	}
 
-	// TODO - reexamine optimizations
+	std::vector<std::string> inputs;
+	inputs.push_back(objpath.str().str());
+	if (!WriteImportLibraries(filename, &inputs))
+		return false;
 
-	legacy::PassManager mpm;
-	mpm.add(createPromoteMemoryToRegisterPass());
+	std::vector<std::string> args = { "lld-link", "/nologo", "/machine:x64", "/subsystem:console", "/entry:@init", "/nodefaultlib", "/opt:ref", "/opt:icf", "/debug:ghash" };
+	args.push_back(std::string("/out:") + filename);
+	args.insert(args.end(), inputs.begin(), inputs.end());
 
-	mpm.run(*llvmmodule);
+	std::vector<const char*> argv;
+	for (const auto& arg : args)
+		argv.push_back(arg.c_str());
 
-	llvmmodule->dump();
+	std::lock_guard<std::mutex> lock(linkmutex);
 
-	class JEL : public JITEventListener
+	raw_os_ostream diag(std::cout);
+	if (!lld::coff::link(argv, false, diag))
 	{
-		uint64_t* OutEmissionAddr;
-		size_t* OutSize;
-
-		const object::ObjectFile** OutImage;
+		std::cout << "LLD failed to link " << filename << std::endl;
+		return false;
+	}
 
-	public:
-		JEL(uint64_t* outaddr, size_t* outsize, const object::ObjectFile** image)
-			: OutSize(outsize),
-			OutEmissionAddr(outaddr),
-			OutImage(image)
-		{ }
+	return true;
+}
 
-		void NotifyObjectEmitted(const object::ObjectFile& img, const RuntimeDyld::LoadedObjectInfo& info) override
-		{
-			*OutSize = 0;
+//
+// Write an import library for every DLL that thunks have been bound to
+//
+// Libraries are named after the output image and the DLL, e.g. foo.Kernel32.lib
+// for foo.exe, and their paths are appended to outPaths.
+//
+bool CodeGenContext::WriteImportLibraries(const char* filename, std::vector<std::string>* outPaths)
+{
+	std::map<std::string, std::vector<object::COFFShortExport>> exportsbylibrary;
+	for (const auto& binding : ThunkImports)
+	{
+		object::COFFShortExport exp;
+		exp.Name = binding.Function;
+		exportsbylibrary[binding.Library].push_back(exp);
+	}
 
-			*OutImage = &img;
+	for (const auto& pair : exportsbylibrary)
+	{
+		SmallString<256> libpath(filename);
+		sys::path::replace_extension(libpath, sys::path::stem(pair.first) + ".lib");
 
-			for (const auto & section : img.sections())
-			{
-				if (section.isText())
-				{
-					*OutSize += static_cast<size_t>(section.getSize());
-				}
-			}
+		Error err = object::writeImportLibrary(pair.first, libpath, pair.second, COFF::IMAGE_FILE_MACHINE_AMD64, false, false);
+		if (err)
+		{
+			std::cout << "Cannot write import library " << libpath.str().str() << ": " << toString(std::move(err)) << std::endl;
+			return false;
 		}
-	} listener(&EmissionAddress, &EmissionSize, &EmittedImage);
 
-	CachedExecutionEngine->RegisterJITEventListener(&listener);
+		outPaths->push_back(libpath.str().str());
+	}
 
-	CachedExecutionEngine->DisableLazyCompilation(true);
-	CachedExecutionEngine->generateCodeForModule(llvmmodule);
+	return true;
+}
 
+//
+// Register caller-owned memory as the final destination of a section
+//
+// Sections with a registered region are written straight into it when they
+// are relocated or finalized, instead of into buffers owned by the context.
+// Regions must be registered after CreateBinaryModule, once section sizes are
+// known, and are rejected if they are too small.
+//
+bool CodeGenContext::SetOutputRegion(unsigned section, void* destination, unsigned capacity)
+{
+	if (section >= OutputSectionCount)
+		return false;
 
-	for (const auto& section : EmittedImage->sections())
+	if (capacity < GetOutputSectionSize(section))
 	{
-		if (!section.isText() && !section.isBSS() && !section.isVirtual())
-		{
-			StringRef sectionname;
-			section.getName(sectionname);
-
-			if (sectionname == ".pdata")
-			{
-				StringRef sectiondata;
-				section.getContents(sectiondata);
-				std::copy(sectiondata.begin(), sectiondata.end(), std::back_inserter(PData));
-			}
-			else if (sectionname == ".debug$S")
-			{
-				StringRef sectiondata;
-				section.getContents(sectiondata);
-				std::copy(sectiondata.begin(), sectiondata.end(), std::back_inserter(DebugData));
-			}
-		}
+		std::cout << "Output region too small for section " << section << std::endl;
+		return false;
 	}
+
+	OutputRegions[section] = reinterpret_cast<char*>(destination);
+	return true;
 }
 
-void CodeGenContext::RelocateBuffers(unsigned codeOffset, unsigned xDataOffset)
+size_t CodeGenContext::GetOutputSectionSize(unsigned section) const
 {
-	for (const auto& section : EmittedImage->sections())
+	switch (section)
 	{
-		if (!section.isText() && !section.isBSS() && !section.isVirtual())
-		{
-			StringRef sectionname;
-			section.getName(sectionname);
-
-			if (sectionname == ".pdata")
-			{
-				ProcessPDataRelocations(section, PData.data(), PData.size(), xDataOffset, codeOffset);
-			}
-			else if (sectionname == ".debug$S")
-			{
-				ProcessArbitraryRelocations(section, &DebugRelocs);
-			}
-		}
+	case OutputSectionCode:		return EmissionSize;
+	case OutputSectionPData:	return PDataSize;
+	case OutputSectionXData:	return EmittedXDataSize;
+	case OutputSectionDebug:	return DebugDataSize;
+	case OutputSectionGlobals:	return EmittedGlobalsSize;
+	case OutputSectionStrings:	return EmittedStringsSize;
 	}
 
+	return 0;
+}
+
+char* CodeGenContext::GetOutputStorage(unsigned section, std::vector<char>* fallback)
+{
+	if (OutputRegions[section])
+		return OutputRegions[section];
+
+	fallback->resize(GetOutputSectionSize(section));
+	return fallback->data();
+}
+
+void CodeGenContext::RelocateBuffers(unsigned codeOffset, unsigned xDataOffset)
+{
+	char* pdata = GetOutputStorage(OutputSectionPData, &PData);
+	char* debug = GetOutputStorage(OutputSectionDebug, &DebugData);
+	bool debugstarted = false;
+
 	DebugSymbolCount = 0;
 	std::vector<char> stringbuffer;
 
 	uint32_t offset = 4;
-	for (const auto& sym : EmittedImage->symbols())
+	for (const auto& batch : Batches)
 	{
-		IMAGE_SYMBOL symbol;
-
-		memset(symbol.N.ShortName, 0, 8);
+		unsigned symbolbase = DebugSymbolCount;
 
-		auto nameerr = sym.getName();
-		if (!nameerr)
+		for (const auto& section : batch.Image->sections())
 		{
-			std::cout << "SKIP nameless symbol" << std::endl;
-			continue;
+			if (!section.isText() && !section.isBSS() && !section.isVirtual())
+			{
+				StringRef sectionname;
+				section.getName(sectionname);
+
+				if (sectionname == ".pdata")
+				{
+					StringRef sectiondata;
+					section.getContents(sectiondata);
+
+					std::copy(sectiondata.begin(), sectiondata.end(), pdata + batch.PDataOffset);
+					ProcessPDataRelocations(section, pdata + batch.PDataOffset, batch.PDataSize, xDataOffset + batch.XDataOffset, codeOffset + batch.CodeOffset, batch.XDataRemap);
+				}
+				else if (sectionname == ".debug$S" && batch.DebugSize > CodeViewSignatureSize)
+				{
+					StringRef sectiondata;
+					section.getContents(sectiondata);
+
+					// See LayoutBatches; later batches drop their signature
+					size_t skip = debugstarted ? CodeViewSignatureSize : 0;
+					debugstarted = true;
+
+					std::copy(sectiondata.begin() + skip, sectiondata.end(), debug + batch.DebugOffset + skip);
+					RemapSymbolTypeIndices(debug + batch.DebugOffset, batch.DebugSize, batch.TypeMap);
+					ProcessArbitraryRelocations(section, &DebugRelocs, static_cast<uint32_t>(batch.DebugOffset), symbolbase);
+				}
+			}
 		}
 
-		auto nameref = nameerr.get();
-		auto symname = nameref.str();
+		for (const auto& sym : batch.Image->symbols())
+		{
+			IMAGE_SYMBOL symbol;
 
-		symbol.N.LongName[1] = offset;
+			memset(symbol.N.ShortName, 0, 8);
 
+			auto nameerr = sym.getName();
+			if (!nameerr)
+			{
+				std::cout << "SKIP nameless symbol" << std::endl;
+				continue;
+			}
 
-		std::copy(std::begin(symname), std::end(symname), std::back_inserter(stringbuffer));
-		stringbuffer.push_back(0);
-		offset += symname.length() + 1;
+			auto nameref = nameerr.get();
+			auto symname = nameref.str();
 
-		symbol.Value = (DWORD)sym.getValue();
-		symbol.SectionNumber = IMAGE_SYM_ABSOLUTE;
-		symbol.StorageClass = IMAGE_SYM_CLASS_EXTERNAL;
+			symbol.N.LongName[1] = offset;
 
-		switch (sym.getType().get())
-		{
-		case object::SymbolRef::ST_Function:
-			std::cout << "Function: " << symname << std::endl;
-			symbol.SectionNumber = 9;
-			symbol.Type = (IMAGE_SYM_DTYPE_FUNCTION << N_BTSHFT);
-			break;
 
-		default:
-			std::cout << "Symbol: " << symname << std::endl;
-			symbol.Value = 0;
-			symbol.Type = (IMAGE_SYM_DTYPE_POINTER << N_BTSHFT);
-			break;
-		}
+			std::copy(std::begin(symname), std::end(symname), std::back_inserter(stringbuffer));
+			stringbuffer.push_back(0);
+			offset += symname.length() + 1;
 
-		symbol.NumberOfAuxSymbols = 0;
+			symbol.Value = (DWORD)sym.getValue();
+			symbol.SectionNumber = IMAGE_SYM_ABSOLUTE;
+			symbol.StorageClass = IMAGE_SYM_CLASS_EXTERNAL;
 
-		AppendToBuffer<IMAGE_SYMBOL, IMAGE_SIZEOF_SYMBOL>(&DebugSymbols, symbol);
-		++DebugSymbolCount;
+			switch (sym.getType().get())
+			{
+			case object::SymbolRef::ST_Function:
+				std::cout << "Function: " << symname << std::endl;
+				symbol.Value += (DWORD)batch.CodeOffset;
+				symbol.SectionNumber = 9;
+				symbol.Type = (IMAGE_SYM_DTYPE_FUNCTION << N_BTSHFT);
+				break;
+
+			default:
+				std::cout << "Symbol: " << symname << std::endl;
+				symbol.Value = 0;
+				symbol.Type = (IMAGE_SYM_DTYPE_POINTER << N_BTSHFT);
+				break;
+			}
+
+			symbol.NumberOfAuxSymbols = 0;
+
+			AppendToBuffer<IMAGE_SYMBOL, IMAGE_SIZEOF_SYMBOL>(&DebugSymbols, symbol);
+			++DebugSymbolCount;
+		}
 	}
 
 	AppendToBuffer(&DebugSymbols, uint32_t(stringbuffer.size() + 8));
@@ -583,29 +4235,78 @@ void CodeGenContext::RelocateBuffers(unsigned codeOffset, unsigned xDataOffset)
 	std::copy(std::begin(stringbuffer), std::end(stringbuffer), std::back_inserter(DebugSymbols));
 }
 
+void CodeGenContext::MapGlobalData(unsigned moduleBaseAddress, unsigned globalsOffset)
+{
+	if (EmittedGlobals)
+		CachedLoader->mapSectionAddress((void*)EmittedGlobals, moduleBaseAddress + globalsOffset);
+}
+
+void CodeGenContext::MapStringData(unsigned moduleBaseAddress, unsigned stringsOffset)
+{
+	if (EmittedStrings)
+		CachedLoader->mapSectionAddress((void*)EmittedStrings, moduleBaseAddress + stringsOffset);
+}
+
 void CodeGenContext::FinalizeBinaryModule(unsigned moduleBaseAddress, unsigned codeOffset)
 {
 	CachedMemoryManager->GCDataAddress = 0;
-	CachedExecutionEngine->mapSectionAddress((void*)EmissionAddress, moduleBaseAddress + codeOffset);
-	CachedExecutionEngine->finalizeObject();
+	for (const auto& batch : Batches)
+	{
+		if (batch.CodeSize)
+			CachedLoader->mapSectionAddress((void*)batch.Code, moduleBaseAddress + codeOffset + batch.CodeOffset);
+	}
 
-	CodeBuffer.resize(EmissionSize);
-	memcpy(CodeBuffer.data(), (void*)(EmissionAddress), EmissionSize);
+	CachedLoader->resolveRelocations();
+	CachedLoader->registerEHFrames();
+	CachedMemoryManager->finalizeMemory(nullptr);
+
+	// Code and globals are relocated in place in JIT memory, so unless the
+	// caller wants them elsewhere, or several batches need stitching
+	// together, there is nothing left to copy.
+	if (OutputRegions[OutputSectionCode] || Batches.size() > 1)
+	{
+		char* code = GetOutputStorage(OutputSectionCode, &Code);
+		for (const auto& batch : Batches)
+			memcpy(code + batch.CodeOffset, (void*)(batch.Code), batch.CodeSize);
+	}
+
+	if (OutputRegions[OutputSectionGlobals])
+		memcpy(OutputRegions[OutputSectionGlobals], (void*)(EmittedGlobals), EmittedGlobalsSize);
+
+	if (OutputRegions[OutputSectionStrings])
+		memcpy(OutputRegions[OutputSectionStrings], (void*)(EmittedStrings), EmittedStringsSize);
+
+	if (OutputRegions[OutputSectionXData] || Batches.size() > 1)
+	{
+		char* xdata = GetOutputStorage(OutputSectionXData, &XData);
+		for (const auto& batch : Batches)
+			memcpy(xdata + batch.XDataOffset, (void*)(batch.XData), batch.XDataSize);
+	}
 }
 
 void* CodeGenContext::GetCodeBuffer(unsigned* outSize)
 {
 	if (outSize)
-		*outSize = (unsigned)(CodeBuffer.size());
+		*outSize = (unsigned)(EmissionSize);
 
-	return (void*)(CodeBuffer.data());
+	if (OutputRegions[OutputSectionCode])
+		return OutputRegions[OutputSectionCode];
+
+	// Batched code is only contiguous once FinalizeBinaryModule has stitched it together
+	if (!Code.empty())
+		return Code.data();
+
+	return Batches.empty() ? nullptr : (void*)(Batches.front().Code);
 }
 
 
 void* CodeGenContext::GetDebugBuffer(unsigned* outSize)
 {
 	if (outSize)
-		*outSize = (unsigned)(DebugData.size());
+		*outSize = (unsigned)(DebugDataSize);
+
+	if (OutputRegions[OutputSectionDebug])
+		return OutputRegions[OutputSectionDebug];
 
 	return (void*)(DebugData.data());
 }
@@ -629,10 +4330,48 @@ void* CodeGenContext::GetDebugSymbolsBuffer(unsigned* outSize, unsigned* outCoun
 	return (void*)(DebugSymbols.data());
 }
 
+//
+// Merged type (TPI) or id (IPI) records, in type index order from 0x1000
+//
+void* CodeGenContext::GetDebugTypeRecordsBuffer(bool ids, unsigned* outSize, unsigned* outCount)
+{
+	const DebugTypeStream& stream = ids ? DebugIds : DebugTypes;
+
+	if (outSize)
+		*outSize = (unsigned)(stream.Records.size());
+
+	if (outCount)
+		*outCount = stream.Count;
+
+	return (void*)(stream.Records.data());
+}
+
+//
+// Contents of the hash stream that goes with the TPI or IPI stream
+//
+// The first outHashValueSize bytes are the hash values, one per record;
+// the rest are the (type index, record offset) pairs.
+//
+void* CodeGenContext::GetDebugTypeHashBuffer(bool ids, unsigned* outSize, unsigned* outHashValueSize)
+{
+	const DebugTypeStream& stream = ids ? DebugIds : DebugTypes;
+
+	if (outSize)
+		*outSize = (unsigned)(stream.Hashes.size());
+
+	if (outHashValueSize)
+		*outHashValueSize = (unsigned)(stream.HashValueSize);
+
+	return (void*)(stream.Hashes.data());
+}
+
 void* CodeGenContext::GetPDataBuffer(unsigned* outSize)
 {
 	if (outSize)
-		*outSize = (unsigned)(PData.size());
+		*outSize = (unsigned)(PDataSize);
+
+	if (OutputRegions[OutputSectionPData])
+		return OutputRegions[OutputSectionPData];
 
 	return PData.data();
 }
@@ -643,6 +4382,190 @@ void* CodeGenContext::GetXDataBuffer(unsigned* outSize)
 	if (outSize)
 		*outSize = (unsigned)(EmittedXDataSize);
 
-	return (void*)(EmittedXData);
+	if (OutputRegions[OutputSectionXData])
+		return OutputRegions[OutputSectionXData];
+
+	if (!XData.empty())
+		return XData.data();
+
+	return Batches.empty() ? nullptr : (void*)(Batches.front().XData);
+}
+
+void* CodeGenContext::GetTailRecursionReportBuffer(unsigned* outSize, unsigned* outCount)
+{
+	if (outSize)
+		*outSize = (unsigned)(TailRecursionReport.size());
+
+	if (outCount)
+		*outCount = TailRecursionCount;
+
+	return (void*)(TailRecursionReport.data());
+}
+
+
+void* CodeGenContext::GetGlobalDataBuffer(unsigned* outSize)
+{
+	if (outSize)
+		*outSize = (unsigned)(EmittedGlobalsSize);
+
+	if (OutputRegions[OutputSectionGlobals])
+		return OutputRegions[OutputSectionGlobals];
+
+	return (void*)(EmittedGlobals);
+}
+
+
+void* CodeGenContext::GetStringDataBuffer(unsigned* outSize)
+{
+	if (outSize)
+		*outSize = (unsigned)(EmittedStringsSize);
+
+	if (OutputRegions[OutputSectionStrings])
+		return OutputRegions[OutputSectionStrings];
+
+	return (void*)(EmittedStrings);
 }
 
+
+//
+// Write a breakdown of the image's size by section, module, generic template and function
+//
+// Each line gives the code, unwind and debug bytes of one entry, largest
+// first, with the change in its total against a baseline report. Without
+// an explicit baseline, the previous contents of the report file are used,
+// so each build shows what grew since the last one.
+//
+// A template's line adds up every body generated from it, however many
+// instantiations share each one.
+//
+bool CodeGenContext::WriteSizeReport(const char* filename, const char* baseline)
+{
+	if (Batches.empty())
+	{
+		std::cout << "Size reports are only available from the built-in linker, not with /lld" << std::endl;
+		return false;
+	}
+
+	std::map<std::string, uint64_t> previous;
+	auto baselinebuffer = MemoryBuffer::getFile((baseline && *baseline) ? baseline : filename);
+	if (baselinebuffer)
+	{
+		SmallVector<StringRef, 0> lines;
+		(*baselinebuffer)->getBuffer().split(lines, '\n', -1, false);
+
+		for (StringRef line : lines)
+		{
+			SmallVector<StringRef, 7> fields;
+			line.rtrim('\r').split(fields, '\t');
+
+			uint64_t total = 0;
+			if (fields.size() < 6 || fields[0].startswith("#") || fields[0] == "removed" || fields[5].getAsInteger(10, total))
+				continue;
+
+			previous[fields[0].str() + "\t" + fields[1].str()] = total;
+		}
+	}
+
+	std::map<std::string, SizeAttribution> objectsizes;
+	for (const auto& batch : Batches)
+		AttributeObjectSizes(*batch.Image, &objectsizes);
+
+	std::map<std::string, SizeAttribution> functions;
+	std::map<std::string, SizeAttribution> modules;
+	std::map<std::string, SizeAttribution> templates;
+	for (const auto& pair : objectsizes)
+	{
+		auto epochname = EpochFunctionNames.find(pair.first);
+		functions[epochname != EpochFunctionNames.end() ? epochname->second : pair.first] += pair.second;
+
+		std::string module = "(program)";
+		auto origin = FunctionOrigins.find(pair.first);
+		if (origin != FunctionOrigins.end())
+			module = origin->second;
+		else if (pair.first == "(shared)")
+			module = pair.first;
+		else if (pair.first[0] == '@')
+			module = "(compiler)";
+
+		modules[module] += pair.second;
+
+		auto instance = InstanceTemplates.find(pair.first);
+		if (instance != InstanceTemplates.end())
+			templates[instance->second] += pair.second;
+	}
+
+	std::map<std::string, SizeAttribution> sections;
+	for (const auto& batch : Batches)
+	{
+		sections[".text"].Code += batch.CodeSize;
+		sections[".pdata"].Unwind += batch.PDataSize;
+		sections[".xdata"].Unwind += batch.XDataSize;
+	}
+	sections[".debug$S"].Debug = DebugDataSize;
+
+	std::error_code ec;
+	raw_fd_ostream out(filename, ec, sys::fs::F_Text);
+	if (ec)
+	{
+		std::cout << "Cannot open " << filename << " to write size report: " << ec.message() << std::endl;
+		return false;
+	}
+
+	std::vector<std::pair<int64_t, std::string>> growth;
+
+	auto writegroup = [&](const char* kind, const std::map<std::string, SizeAttribution>& entries)
+	{
+		std::vector<std::pair<std::string, SizeAttribution>> sorted(entries.begin(), entries.end());
+		std::stable_sort(sorted.begin(), sorted.end(), [](const auto& lhs, const auto& rhs) { return lhs.second.Total() > rhs.second.Total(); });
+
+		for (const auto& entry : sorted)
+		{
+			out << kind << "\t" << entry.first << "\t" << entry.second.Code << "\t" << entry.second.Unwind << "\t" << entry.second.Debug << "\t" << entry.second.Total() << "\t";
+
+			auto old = previous.find(std::string(kind) + "\t" + entry.first);
+			if (old == previous.end())
+			{
+				out << (previous.empty() ? "" : "new");
+			}
+			else
+			{
+				int64_t change = static_cast<int64_t>(entry.second.Total()) - static_cast<int64_t>(old->second);
+				out << (change > 0 ? "+" : "") << change;
+
+				if (change && std::string(kind) == "function")
+					growth.emplace_back(change, entry.first);
+
+				previous.erase(old);
+			}
+
+			out << "\n";
+		}
+	};
+
+	out << "# Epoch size report\n";
+	out << "# kind\tname\tcode\tunwind\tdebug\ttotal\tchange\n";
+	writegroup("section", sections);
+	writegroup("module", modules);
+	writegroup("template", templates);
+	writegroup("function", functions);
+
+	// Whatever is left in the baseline no longer exists
+	for (const auto& old : previous)
+	{
+		out << "removed\t" << old.first << "\t" << -static_cast<int64_t>(old.second) << "\n";
+		if (StringRef(old.first).startswith("function\t"))
+			growth.emplace_back(-static_cast<int64_t>(old.second), old.first.substr(strlen("function\t")));
+	}
+
+	uint64_t total = 0;
+	for (const auto& pair : sections)
+		total += pair.second.Total();
+
+	std::cout << "Size report: " << total << " bytes in " << functions.size() << " functions, written to " << filename << std::endl;
+
+	std::stable_sort(growth.begin(), growth.end(), [](const auto& lhs, const auto& rhs) { return lhs.first > rhs.first; });
+	for (size_t i = 0; i < growth.size() && i < 10 && growth[i].first > 0; ++i)
+		std::cout << "\tgrew: " << growth[i].second << " +" << growth[i].first << std::endl;
+
+	return true;
+}
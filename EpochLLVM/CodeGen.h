@@ -4,9 +4,154 @@
 namespace CodeGenInternal
 {
 	class TrivialMemoryManager;
+
+	struct StructureMember
+	{
+		llvm::Type* MemberType;
+		std::string Name;
+		bool Cold;
+	};
+
+	struct StructureLayout
+	{
+		std::vector<StructureMember> Members;		// In declaration order
+		std::vector<unsigned> PhysicalIndex;		// Declaration index -> element index in the hot or cold structure
+
+		llvm::StructType* ColdType = nullptr;
+		unsigned ColdPointerIndex = ~0u;
+
+		uint64_t DeclaredSize = 0;
+	};
+
+	struct ThunkImport
+	{
+		llvm::GlobalVariable* Thunk;
+		std::string Library;
+		std::string Function;
+	};
+
+	//
+	// One object's worth of generated code
+	//
+	// Without a memory budget the whole module is emitted as a single batch.
+	// The offsets give each batch's position within the combined sections.
+	//
+	struct EmittedBatch
+	{
+		const llvm::object::ObjectFile* Image = nullptr;
+
+		uint64_t Code = 0;
+		size_t CodeSize = 0;
+		uint64_t XData = 0;
+		size_t XDataSize = 0;
+		size_t PDataSize = 0;
+		size_t DebugSize = 0;
+
+		size_t CodeOffset = 0;
+		size_t PDataOffset = 0;
+		size_t XDataOffset = 0;
+		size_t DebugOffset = 0;
+
+		// Original -> folded offset of each .xdata record, when size optimizing
+		std::map<uint32_t, uint32_t> XDataRemap;
+
+		// Type index in the object's .debug$T (less 0x1000) -> index in the merged TPI/IPI streams
+		std::vector<llvm::codeview::TypeIndex> TypeMap;
+	};
+
+	//
+	// Merged CodeView records for the TPI or IPI stream of the PDB
+	//
+	struct DebugTypeStream
+	{
+		std::vector<char> Records;
+		unsigned Count = 0;
+
+		// Hash stream contents: a value per record, then (type index, offset) pairs
+		std::vector<char> Hashes;
+		size_t HashValueSize = 0;
+	};
+
+	//
+	// Instantiations of one generic function, for the instance cache report
+	//
+	struct TemplateInstanceCounts
+	{
+		unsigned Requested = 0;
+		unsigned Generated = 0;
+	};
+
+	//
+	// Blocks and values shared by every suspension point of one coroutine
+	//
+	struct CoroutineFrame
+	{
+		llvm::Value* Id = nullptr;
+		llvm::Value* Handle = nullptr;
+		llvm::BasicBlock* Cleanup = nullptr;		// Frees the frame, then exits through Suspend
+		llvm::BasicBlock* Suspend = nullptr;		// Returns the handle to whoever started or resumed the coroutine
+	};
+
+	//
+	// State of a parallel loop whose body is being generated
+	//
+	struct ParallelLoop
+	{
+		llvm::Function* Task = nullptr;
+		llvm::StructType* Environment = nullptr;
+		std::vector<llvm::Value*> Captures;			// In the enclosing function
+		std::vector<llvm::Value*> CaptureLoads;		// The same values, read back inside the task
+
+		llvm::BasicBlock* ParentBlock = nullptr;	// Where the loop is run from once the body is done
+		llvm::DebugLoc ParentLocation;
+		llvm::Value* Begin = nullptr;
+		llvm::Value* End = nullptr;
+
+		llvm::BasicBlock* Body = nullptr;
+		llvm::BasicBlock* Exit = nullptr;
+		llvm::PHINode* Index = nullptr;
+		llvm::Value* SliceEnd = nullptr;
+	};
+
+	//
+	// Bytes of the image attributed to one function, or to a group of functions
+	//
+	struct SizeAttribution
+	{
+		uint64_t Code = 0;
+		uint64_t Unwind = 0;		// .pdata and .xdata
+		uint64_t Debug = 0;			// .debug$S
+
+		uint64_t Total() const
+		{
+			return Code + Unwind + Debug;
+		}
+
+		SizeAttribution& operator+=(const SizeAttribution& other)
+		{
+			Code += other.Code;
+			Unwind += other.Unwind;
+			Debug += other.Debug;
+			return *this;
+		}
+	};
 }
 
 
+// Identifiers for sections that can be written into caller-supplied memory
+enum OutputSection : unsigned
+{
+	OutputSectionCode = 0,
+	OutputSectionPData,
+	OutputSectionXData,
+	OutputSectionDebug,
+	OutputSectionGlobals,
+	OutputSectionStrings,
+
+	OutputSectionCount
+};
+
+
 class CodeGenContext
 {
 public:
@@ -19,39 +164,145 @@ public:
 
 	llvm::Type* TypeGetString();
 
+	void TypeQueueStructureMember(llvm::Type* ty, const char* name, bool cold);
+	llvm::StructType* TypeCreateStructure(const char* name);
+	llvm::Type* TypeGetStructureColdType(llvm::StructType* st);
+
+	void TypeQueueSumTypeAlternative(llvm::Type* ty);
+	llvm::StructType* TypeCreateSumType(const char* name);
+
+	void TypeQueueTemplateArgument(llvm::Type* ty);
+
 	llvm::Function* FunctionCreate(llvm::FunctionType* fty, const char* name);
+	llvm::Function* FunctionCreateInstance(llvm::FunctionType* fty, const char* templatename, const char* name, bool* outNeedsBody);
 	llvm::GlobalVariable* FunctionCreateThunk(llvm::FunctionType* fty, const char* name);
+	void FunctionBindThunkImport(llvm::GlobalVariable* thunk, const char* library, const char* function);
+
+	unsigned GetThunkImportCount() const;
+	const char* GetThunkImportLibrary(unsigned index, unsigned* outLength) const;
+	const char* GetThunkImportFunction(unsigned index, unsigned* outLength) const;
+	void SetThunkImportAddress(unsigned index, uint64_t address);
+
+	llvm::GlobalVariable* GlobalCreate(llvm::Type* ty, const char* name);
+	llvm::Function* GlobalCreateInitializer(llvm::GlobalVariable* var);
 
 	llvm::BasicBlock* BasicBlockCreate(llvm::Function* func);
 	void BasicBlockSetInsertPoint(llvm::BasicBlock* block);
 
 	llvm::Value* CodeCreateCall(llvm::Function* target);
+	llvm::Value* CodeCreateTailCall(llvm::Function* target);
 	llvm::Value* CodeCreateCallThunk(llvm::GlobalVariable* target);
 	void CodeCreateRetVoid();
 
 	void CodePushValue(llvm::Value* value);
+	void CodeCreateGlobalStore(llvm::GlobalVariable* var);
+
+	llvm::Value* CodeCreateMemberAddress(llvm::Value* structptr, unsigned member);
+	void CodeAttachColdStorage(llvm::Value* structptr, llvm::Value* coldptr);
+
+	llvm::Value* CodeCreateSumTypeValue(llvm::StructType* sumtype, unsigned tag);
+	void CodeQueueDispatchTarget(llvm::Function* target);
+	llvm::Value* CodeCreateDispatch(llvm::StructType* sumtype);
+
+	llvm::Type* TypeGetCoroutineHandle();
+	llvm::FunctionType* TypeCreateCoroutineFunction();
+	bool FunctionMakeCoroutine(llvm::Function* func);
+	void CodeCreateSuspend();
+	void CodeCreateCoroutineReturn();
+	llvm::Value* CodeGetCoroutineHandle();
+	void CodeCreateCoroutineResume();
+	void CodeCreateCoroutineDestroy();
+	llvm::Value* CodeCreateCoroutineDone();
+
+	void CodeQueueParallelCapture(llvm::Value* value);
+	llvm::Value* CodeBeginParallelFor();
+	llvm::Value* CodeGetParallelCapture(unsigned index);
+	void CodeEndParallelFor();
+
+	llvm::Value* CodeCreateAtomicLoad(llvm::Value* ptr);
+	void CodeCreateAtomicStore();
+	llvm::Value* CodeCreateAtomicRMW(unsigned op);
+	llvm::Value* CodeCreateAtomicCompareExchange();
+	void CodeCreateFence();
 
 	llvm::Value* GetStringPoolEntry(unsigned index);
+	llvm::Value* GetStringLiteral(const char* text);
 
 public:
 	void SetStringPoolCallback(void* functionPointer);
+	void SetOptimizeForSize(bool enable);
+	void SetProfileOutput(const char* filename);
+	void SetMemoryBudget(unsigned megabytes);
+	bool SetRemarksOutput(const char* filename);
+	bool SetProfileInput(const char* filename);
+
+	bool ModuleWriteBitcode(const char* filename);
+	bool ModuleImportBitcode(const char* filename);
+	bool ModuleImportRuntime(const char* filename);
+	bool ModuleLinkImage(const char* filename);
 
 	void CreateBinaryModule();
+	bool SetOutputRegion(unsigned section, void* destination, unsigned capacity);
 	void RelocateBuffers(unsigned codeOffset, unsigned xDataOffset);
+	void MapGlobalData(unsigned moduleBaseAddress, unsigned globalsOffset);
+	void MapStringData(unsigned moduleBaseAddress, unsigned stringsOffset);
 	void FinalizeBinaryModule(unsigned moduleBaseAddress, unsigned codeOffset);
 
 	void* GetCodeBuffer(unsigned* outSize);
 	void* GetDebugBuffer(unsigned* outSize);
 	void* GetDebugRelocBuffer(unsigned* outSize);
 	void* GetDebugSymbolsBuffer(unsigned* outSize, unsigned* outCount);
+	void* GetDebugTypeRecordsBuffer(bool ids, unsigned* outSize, unsigned* outCount);
+	void* GetDebugTypeHashBuffer(bool ids, unsigned* outSize, unsigned* outHashValueSize);
 	void* GetPDataBuffer(unsigned* outSize);
 	void* GetXDataBuffer(unsigned* outSize);
+	void* GetGlobalDataBuffer(unsigned* outSize);
+	void* GetStringDataBuffer(unsigned* outSize);
+
+	void* GetTailRecursionReportBuffer(unsigned* outSize, unsigned* outCount);
+	void* GetStructureLayoutReport(unsigned* outSize);
+	bool WriteSizeReport(const char* filename, const char* baseline);
+
+	unsigned GetMissedOptimizationFunctionCount() const;
+	const char* GetMissedOptimizationFunction(unsigned index, unsigned* outLength) const;
+	const char* GetMissedOptimizationSummary(const char* function, unsigned* outLength);
 
 public:
 	void DebugDump();
 
+public:
+	static bool PrepareTargetMachine();
+	static void ReleaseTargetMachines();
+
 private:
 	llvm::DIType* TypeGetDebugType(llvm::Type* t);
+	llvm::DIType* TypeGetStructureDebugType(llvm::StructType* st, const CodeGenInternal::StructureLayout& layout);
+
+	std::vector<llvm::Value*> PopCallArguments(llvm::FunctionType* fty);
+	llvm::Value* CreateEntryBlockAlloca(llvm::Type* ty);
+	llvm::Value* CreateCoroutineHeapCall(const char* function, std::vector<llvm::Value*> args);
+
+	void EvaluateGlobalInitializers(llvm::Module& module);
+	void MergeStringLiterals(llvm::Module& module);
+	void ReportInstanceCache() const;
+	void RecordOptimizationRemark(const llvm::DiagnosticInfoOptimizationBase& remark);
+	void OptimizeModule(llvm::Module& module);
+	void InstrumentModule(llvm::Module& module);
+	void MatchSampleProfile(llvm::Module& module);
+	void FinalizeDebugInfo();
+
+	void GenerateCodeInBatches(llvm::Module& module, llvm::TargetMachine& machine);
+	void GenerateBatch(llvm::Module* module, llvm::TargetMachine& machine);
+	void MergeDebugTypes();
+	void LayoutBatches();
+
+	std::unique_ptr<llvm::Module> LoadBitcodeLibrary(const char* filename);
+	bool LinkBitcodeLibrary(const char* filename, std::unique_ptr<llvm::Module> library);
+
+	bool WriteImportLibraries(const char* filename, std::vector<std::string>* outPaths);
+
+	size_t GetOutputSectionSize(unsigned section) const;
+	char* GetOutputStorage(unsigned section, std::vector<char>* fallback);
 
 private:
 	llvm::LLVMContext GlobalContext;
@@ -59,16 +310,57 @@ private:
 	llvm::IRBuilder<> Builder;
 	llvm::DIBuilder DebugBuilder;
 
-	std::vector<char> CodeBuffer;
+	// Fallback storage for sections without a caller-supplied output region
+	std::vector<char> Code;
 	std::vector<char> PData;
+	std::vector<char> XData;
 	std::vector<char> DebugData;
+	size_t PDataSize = 0;
+	size_t DebugDataSize = 0;
+
+	char* OutputRegions[OutputSectionCount] = {};
 	std::vector<char> DebugRelocs;
 	std::vector<char> DebugSymbols;
+	CodeGenInternal::DebugTypeStream DebugTypes;
+	CodeGenInternal::DebugTypeStream DebugIds;
 
 	std::vector<llvm::Value*> ValueStack;
 	std::vector<llvm::Type*> FunctionParamTypeStack;
+	std::vector<llvm::Type*> SumTypeAlternativeStack;
+	std::vector<CodeGenInternal::StructureMember> StructureMemberStack;
+	std::vector<llvm::Function*> DispatchTargetStack;
+	std::vector<llvm::Type*> TemplateArgumentStack;
+
+	std::map<llvm::StructType*, std::vector<llvm::Type*>> SumTypeAlternatives;
+
+	std::map<llvm::Function*, CodeGenInternal::CoroutineFrame> Coroutines;
+	std::map<std::string, llvm::GlobalVariable*> CoroutineImports;
+
+	std::vector<llvm::Value*> ParallelCaptureQueue;
+	std::vector<CodeGenInternal::ParallelLoop> ParallelLoops;		// Innermost last
+	llvm::GlobalVariable* ParallelForImport = nullptr;
+	unsigned ParallelTaskCount = 0;
+
+	std::map<llvm::StructType*, CodeGenInternal::StructureLayout> StructureLayouts;
+	std::map<llvm::Type*, llvm::DIType*> StructureDebugTypes;
+	std::vector<char> StructureLayoutReport;
+
+	std::vector<llvm::Function*> GlobalInitializers;
+	std::vector<CodeGenInternal::ThunkImport> ThunkImports;
+
+	// Generic instances by name, and the body generated for each template + type argument representation
+	std::map<std::string, llvm::Function*> InstancesByName;
+	std::map<std::string, llvm::Function*> InstanceBodies;
+	std::map<std::string, CodeGenInternal::TemplateInstanceCounts> InstanceCounts;
+	std::map<std::string, std::string> InstanceTemplates;		// LLVM name -> template, for size reports
+	unsigned ForwardedInstanceCount = 0;
+
+	// LLVM name -> name given to FunctionCreate, for functions LLVM had to rename
+	std::map<std::string, std::string> EpochFunctionNames;
+	std::map<std::string, uint64_t> ThunkImportAddresses;		// Thunk name -> import address table slot
 
 	std::map<unsigned, llvm::Value*> StringCache;
+	std::map<std::string, llvm::GlobalVariable*> StringLiterals;
 	void* StringLookupFunction;
 
 	uint64_t EmissionAddress = 0;
@@ -77,14 +369,52 @@ private:
 	size_t EmittedPDataSize = 0;
 	uint64_t EmittedXData = 0;
 	size_t EmittedXDataSize = 0;
+	uint64_t EmittedGlobals = 0;
+	size_t EmittedGlobalsSize = 0;
+	uint64_t EmittedStrings = 0;
+	size_t EmittedStringsSize = 0;
 	const llvm::object::ObjectFile* EmittedImage;
 
-	llvm::ExecutionEngine* CachedExecutionEngine;
-	CodeGenInternal::TrivialMemoryManager* CachedMemoryManager;
+	// Generated objects in .text order; a single entry unless code generation was batched
+	std::vector<CodeGenInternal::EmittedBatch> Batches;
+
+	// Generated objects, and the loader that relocates them into the image
+	std::unique_ptr<CodeGenInternal::TrivialMemoryManager> CachedMemoryManager;
+	std::vector<std::unique_ptr<llvm::MemoryBuffer>> EmittedObjectBuffers;
+	std::vector<std::unique_ptr<llvm::object::ObjectFile>> EmittedObjects;
+	std::unique_ptr<llvm::RuntimeDyld> CachedLoader;
 
 	llvm::DIFile* DebugFile;
 	llvm::DICompileUnit* DebugCompileUnit;
+	unsigned NextDebugLine = 1;
+	bool DebugInfoFinalized = false;
+
+	unsigned ImportedFunctionCount = 0;
+	std::map<std::string, std::string> FunctionOrigins;		// LLVM name -> bitcode library it was imported from
+
+	bool OptimizeForSize = false;
+	bool LinkingWithLLD = false;
+
+	// Peak private bytes allowed during code generation (/maxmem:); zero for no limit
+	uint64_t MemoryBudget = 0;
+
+	// Where /instrument builds write their profile; empty if not instrumenting
+	std::string ProfileOutputPath;
+
+	// Sample profile given with /profile-use:; null if optimizing without one
+	std::string ProfileInputPath;
+	std::unique_ptr<llvm::sampleprof::SampleProfileReader> ProfileReader;
+
+	// Optimization remarks, as YAML, and the missed ones grouped by function
+	std::unique_ptr<llvm::raw_fd_ostream> RemarksStream;
+	std::unique_ptr<llvm::yaml::Output> RemarksYAML;
+	std::map<std::string, std::vector<std::string>> MissedOptimizations;
+	std::string MissedOptimizationSummary;
 
 	unsigned DebugSymbolCount = 0;
+
+	// Sequence of (null-terminated function name, uint32 site count) records
+	std::vector<char> TailRecursionReport;
+	unsigned TailRecursionCount = 0;
 };
 
@@ -0,0 +1,295 @@
+#include "stdafx.h"
+
+#include "CompileServer.h"
+
+
+#pragma comment(lib, "ws2_32.lib")
+
+
+// Older SDK headers predate AF_UNIX support
+#ifndef IO_REPARSE_TAG_AF_UNIX
+#define IO_REPARSE_TAG_AF_UNIX 0x80000023L
+#endif
+
+
+namespace CompileServerInternal
+{
+
+	//
+	// Winsock must be started before any socket call, and stays up
+	// for the life of the process once anyone has needed it.
+	//
+	bool StartWinsock()
+	{
+		static std::once_flag flag;
+		static bool started = false;
+
+		std::call_once(flag, []()
+		{
+			WSADATA data;
+			started = (WSAStartup(MAKEWORD(2, 2), &data) == 0);
+		});
+
+		return started;
+	}
+
+	bool FillAddress(const std::string& socketpath, sockaddr_un* address)
+	{
+		if (socketpath.length() >= sizeof(address->sun_path))
+			return false;
+
+		memset(address, 0, sizeof(*address));
+		address->sun_family = AF_UNIX;
+		memcpy(address->sun_path, socketpath.c_str(), socketpath.length());
+		return true;
+	}
+
+	bool SendAll(SOCKET s, const char* data, size_t size)
+	{
+		while (size > 0)
+		{
+			int sent = send(s, data, static_cast<int>(size), 0);
+			if (sent <= 0)
+				return false;
+
+			data += sent;
+			size -= sent;
+		}
+
+		return true;
+	}
+
+	bool ReceiveAll(SOCKET s, char* data, size_t size)
+	{
+		while (size > 0)
+		{
+			int received = recv(s, data, static_cast<int>(size), 0);
+			if (received <= 0)
+				return false;
+
+			data += received;
+			size -= received;
+		}
+
+		return true;
+	}
+
+	bool SendFrame(SOCKET s, uint32_t type, const char* payload, size_t size)
+	{
+		CompileServerMessageHeader header;
+		header.Type = type;
+		header.PayloadSize = static_cast<uint32_t>(size);
+
+		if (!SendAll(s, reinterpret_cast<const char*>(&header), sizeof(header)))
+			return false;
+
+		return SendAll(s, payload, size);
+	}
+
+	bool ReceiveFrame(SOCKET s, CompileServerMessageHeader* header, std::vector<char>* payload)
+	{
+		if (!ReceiveAll(s, reinterpret_cast<char*>(header), sizeof(*header)))
+			return false;
+
+		payload->resize(header->PayloadSize);
+		if (header->PayloadSize == 0)
+			return true;
+
+		return ReceiveAll(s, payload->data(), payload->size());
+	}
+
+	//
+	// Clear the way for bind() if a previous server left its socket behind
+	//
+	// Only a socket file that nobody is listening on is deleted. Returns
+	// false if the path is held by a live server or by something that is
+	// not a socket at all, in which case it is left alone.
+	//
+	bool RemoveStaleSocket(const std::string& socketpath, const sockaddr_un& address)
+	{
+		WIN32_FIND_DATAA finddata;
+		HANDLE find = FindFirstFileA(socketpath.c_str(), &finddata);
+		if (find == INVALID_HANDLE_VALUE)
+			return true;
+
+		FindClose(find);
+
+		if (!(finddata.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) || finddata.dwReserved0 != IO_REPARSE_TAG_AF_UNIX)
+		{
+			std::cout << socketpath << " exists and is not a socket" << std::endl;
+			return false;
+		}
+
+		SOCKET probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (probe == INVALID_SOCKET)
+			return false;
+
+		bool live = (connect(probe, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+		closesocket(probe);
+
+		if (live)
+		{
+			std::cout << "Another compile server is already listening on " << socketpath << std::endl;
+			return false;
+		}
+
+		return DeleteFileA(socketpath.c_str()) != 0;
+	}
+
+}
+
+using namespace CompileServerInternal;
+
+
+CompileServer::CompileServer(const std::string& socketpath)
+	: SocketPath(socketpath)
+{
+	sockaddr_un address;
+	if (!StartWinsock() || !FillAddress(SocketPath, &address))
+		return;
+
+	// A stale socket file from a previous server would make bind() fail
+	if (!RemoveStaleSocket(SocketPath, address))
+		return;
+
+	ListenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ListenSocket == INVALID_SOCKET)
+		return;
+
+	if (bind(ListenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(ListenSocket, SOMAXCONN) != 0)
+	{
+		closesocket(ListenSocket);
+		ListenSocket = INVALID_SOCKET;
+		return;
+	}
+
+	std::cout << "Compile server listening on " << SocketPath << std::endl;
+}
+
+CompileServer::~CompileServer()
+{
+	if (ClientSocket != INVALID_SOCKET)
+		closesocket(ClientSocket);
+
+	if (ListenSocket != INVALID_SOCKET)
+	{
+		closesocket(ListenSocket);
+		DeleteFileA(SocketPath.c_str());
+	}
+}
+
+
+//
+// Block until a client connects and sends a well-formed request
+//
+// Malformed requests and clients that disconnect early are dropped and
+// the server keeps waiting. Returns false only if the listening socket
+// itself has failed.
+//
+bool CompileServer::AcceptRequest()
+{
+	while (ListenSocket != INVALID_SOCKET)
+	{
+		ClientSocket = accept(ListenSocket, nullptr, nullptr);
+		if (ClientSocket == INVALID_SOCKET)
+			return false;
+
+		CompileServerMessageHeader header;
+		std::vector<char> payload;
+		if (ReceiveFrame(ClientSocket, &header, &payload) && header.Type == CompileServerMessageRequest)
+		{
+			auto separator = std::find(payload.begin(), payload.end(), '\0');
+			if (separator != payload.end())
+			{
+				RequestFiles.assign(payload.begin(), separator);
+				RequestOutput.assign(separator + 1, payload.end());
+
+				++RequestsServed;
+				std::cout << "Compile request #" << RequestsServed << ": " << RequestFiles << " ---> " << RequestOutput << std::endl;
+				return true;
+			}
+		}
+
+		closesocket(ClientSocket);
+		ClientSocket = INVALID_SOCKET;
+	}
+
+	return false;
+}
+
+void CompileServer::SendDiagnostic(const std::string& message)
+{
+	if (ClientSocket == INVALID_SOCKET)
+		return;
+
+	// A client that went away mid-build just stops receiving output; the build still completes
+	if (!SendFrame(ClientSocket, CompileServerMessageDiagnostic, message.data(), message.size()))
+	{
+		closesocket(ClientSocket);
+		ClientSocket = INVALID_SOCKET;
+	}
+}
+
+void CompileServer::CompleteRequest(uint32_t exitcode)
+{
+	if (ClientSocket == INVALID_SOCKET)
+		return;
+
+	SendFrame(ClientSocket, CompileServerMessageComplete, reinterpret_cast<const char*>(&exitcode), sizeof(exitcode));
+
+	closesocket(ClientSocket);
+	ClientSocket = INVALID_SOCKET;
+}
+
+
+//
+// Client side: hand a build to a running server and relay its output
+//
+// Returns the exit code reported by the server, or -1 if no server could
+// be reached or the connection dropped before the build completed.
+//
+int CompileServer::ForwardRequest(const std::string& socketpath, const std::string& files, const std::string& output)
+{
+	sockaddr_un address;
+	if (!StartWinsock() || !FillAddress(socketpath, &address))
+		return -1;
+
+	SOCKET s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET)
+		return -1;
+
+	if (connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+	{
+		closesocket(s);
+		return -1;
+	}
+
+	std::vector<char> request(files.begin(), files.end());
+	request.push_back('\0');
+	request.insert(request.end(), output.begin(), output.end());
+
+	int exitcode = -1;
+	if (SendFrame(s, CompileServerMessageRequest, request.data(), request.size()))
+	{
+		CompileServerMessageHeader header;
+		std::vector<char> payload;
+		while (ReceiveFrame(s, &header, &payload))
+		{
+			if (header.Type == CompileServerMessageDiagnostic)
+			{
+				std::cout.write(payload.data(), payload.size());
+				std::cout << std::endl;
+			}
+			else if (header.Type == CompileServerMessageComplete && payload.size() == sizeof(uint32_t))
+			{
+				uint32_t code = 0;
+				memcpy(&code, payload.data(), sizeof(code));
+				exitcode = static_cast<int>(code);
+				break;
+			}
+		}
+	}
+
+	closesocket(s);
+	return exitcode;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+
+//
+// Local compile server
+//
+// Keeps a single compiler process alive across many builds. Requests arrive
+// over a Unix domain socket; each carries the same /files and /output values
+// the command line would. The compiler services one request at a time and
+// streams diagnostics back to the client while it works, finishing with the
+// exit code the equivalent standalone build would have produced. The image
+// itself is written to the requested output path, which the client shares
+// with the server since the socket is machine-local.
+//
+// Besides process startup and LLVM's target registration, the server keeps
+// its target machines pooled between requests, and the front end keeps the
+// parsed functions of every source file keyed by a hash of its contents.
+// Only files whose contents changed are lexed and parsed again. Each request
+// still gets its own code generator, module and literal string table.
+//
+// Wire format: every message is a CompileServerMessageHeader followed by
+// PayloadSize bytes. Strings are UTF-8 and not null terminated.
+//
+
+
+enum CompileServerMessageType : uint32_t
+{
+	CompileServerMessageRequest = 1,		// Client -> server: files, NUL, output
+	CompileServerMessageDiagnostic,			// Server -> client: one line of output
+	CompileServerMessageComplete,			// Server -> client: uint32 exit code
+};
+
+struct CompileServerMessageHeader
+{
+	uint32_t Type;
+	uint32_t PayloadSize;
+};
+
+
+class CompileServer
+{
+public:
+	explicit CompileServer(const std::string& socketpath);
+	~CompileServer();
+
+	CompileServer(const CompileServer&) = delete;
+	CompileServer& operator=(const CompileServer&) = delete;
+
+public:
+	bool IsListening() const
+	{
+		return ListenSocket != INVALID_SOCKET;
+	}
+
+	bool AcceptRequest();
+
+	const std::string& GetRequestFiles() const
+	{
+		return RequestFiles;
+	}
+
+	const std::string& GetRequestOutput() const
+	{
+		return RequestOutput;
+	}
+
+	void SendDiagnostic(const std::string& message);
+	void CompleteRequest(uint32_t exitcode);
+
+public:
+	static int ForwardRequest(const std::string& socketpath, const std::string& files, const std::string& output);
+
+private:
+	std::string SocketPath;
+
+	SOCKET ListenSocket = INVALID_SOCKET;
+	SOCKET ClientSocket = INVALID_SOCKET;
+
+	std::string RequestFiles;
+	std::string RequestOutput;
+
+	unsigned RequestsServed = 0;
+};
+
@@ -0,0 +1,162 @@
+;
+; EpochRuntime
+; Runtime primitives linked into programs as bitcode
+;
+; The EpochLLVM build assembles this file into EpochRuntime.bc next to
+; EpochLLVM.dll, and the compiler links it unless given /noruntime. A
+; program that binds a thunk to a DLL export defined here as
+; @"@runtime:<library>:<function>" calls the definition directly instead
+; (see CodeGenContext::ModuleImportRuntime), so these helpers can be
+; inlined where they are used. A definition must have exactly the
+; signature the front end gives the export; otherwise the import is kept.
+;
+; The front end declares every function as returning i32, passes strings as
+; null-terminated i8* and integers as i32. Integers that carry a pointer are
+; i32 as well: the image is not marked large address aware, so every
+; address in it, heap included, is below 2GB.
+;
+; Anything that really needs the OS calls through a thunk named
+; @"@import:<library>:<function>", which becomes a normal import once the
+; runtime is linked in. Exports the front end binds for its own use, such
+; as OutputDebugStringA for print, are not defined here and keep their
+; imports.
+;
+
+target datalayout = "e-m:w-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-windows-msvc"
+
+
+@"@import:Kernel32.dll:GetProcessHeap" = extern_weak constant i8* ()*
+@"@import:Kernel32.dll:HeapAlloc" = extern_weak constant i8* (i8*, i32, i64)*
+
+
+;
+; Heap storage for strings built at runtime
+;
+; TODO - nothing is freed until the runtime has a collector
+;
+define internal i8* @"@runtime:allocate"(i64 %size) {
+entry:
+  %getprocessheap = load i8* ()*, i8* ()** @"@import:Kernel32.dll:GetProcessHeap"
+  %heap = call i8* %getprocessheap()
+  %heapalloc = load i8* (i8*, i32, i64)*, i8* (i8*, i32, i64)** @"@import:Kernel32.dll:HeapAlloc"
+  %ret = call i8* %heapalloc(i8* %heap, i32 0, i64 %size)
+  ret i8* %ret
+}
+
+
+;
+; Character access
+;
+
+; EpochLib_StrPointer : string s -> integer pointer
+define i32 @"@runtime:EpochLibrary.dll:EpochLib_StrPointer"(i8* %s) alwaysinline {
+entry:
+  %pointer = ptrtoint i8* %s to i32
+  ret i32 %pointer
+}
+
+; EpochLib_SubstrCharDirect : integer pointer, integer pos -> integer ch
+define i32 @"@runtime:EpochLibrary.dll:EpochLib_SubstrCharDirect"(i32 %pointer, i32 %pos) alwaysinline {
+entry:
+  %base = inttoptr i32 %pointer to i8*
+  %offset = sext i32 %pos to i64
+  %address = getelementptr inbounds i8, i8* %base, i64 %offset
+  %c = load i8, i8* %address
+  %ch = zext i8 %c to i32
+  ret i32 %ch
+}
+
+
+;
+; Length
+;
+
+; EpochLib_StrLen : string s -> integer len
+define i32 @"@runtime:EpochLibrary.dll:EpochLib_StrLen"(i8* %s) {
+entry:
+  br label %scan
+
+scan:
+  %index = phi i64 [ 0, %entry ], [ %next, %scan ]
+  %address = getelementptr inbounds i8, i8* %s, i64 %index
+  %c = load i8, i8* %address
+  %next = add i64 %index, 1
+  %done = icmp eq i8 %c, 0
+  br i1 %done, label %exit, label %scan
+
+exit:
+  %len = trunc i64 %index to i32
+  ret i32 %len
+}
+
+; hackstrlen : integer strptr -> integer len (PDB writer)
+define i32 @"@runtime:EpochPDBShim.dll:StrLen"(i32 %strptr) {
+entry:
+  %s = inttoptr i32 %strptr to i8*
+  %len = call i32 @"@runtime:EpochLibrary.dll:EpochLib_StrLen"(i8* %s)
+  ret i32 %len
+}
+
+
+;
+; Substrings
+;
+
+; EpochLib_SubstrDirect : integer pointer, integer pos, integer length -> string s
+define i32 @"@runtime:EpochLibrary.dll:EpochLib_SubstrDirect"(i32 %pointer, i32 %pos, i32 %length) {
+entry:
+  %base = inttoptr i32 %pointer to i8*
+  %offset = sext i32 %pos to i64
+  %source = getelementptr inbounds i8, i8* %base, i64 %offset
+  %count = sext i32 %length to i64
+  %size = add i64 %count, 1
+  %s = call i8* @"@runtime:allocate"(i64 %size)
+  %empty = icmp sle i64 %count, 0
+  br i1 %empty, label %terminate, label %copy
+
+  ; A plain loop rather than llvm.memcpy, which may lower to a CRT call the built-in linker cannot resolve
+copy:
+  %index = phi i64 [ 0, %entry ], [ %next, %copy ]
+  %from = getelementptr inbounds i8, i8* %source, i64 %index
+  %to = getelementptr inbounds i8, i8* %s, i64 %index
+  %c = load i8, i8* %from
+  store i8 %c, i8* %to
+  %next = add i64 %index, 1
+  %done = icmp eq i64 %next, %count
+  br i1 %done, label %terminate, label %copy
+
+terminate:
+  %end = phi i64 [ 0, %entry ], [ %count, %copy ]
+  %terminator = getelementptr inbounds i8, i8* %s, i64 %end
+  store i8 0, i8* %terminator
+  %ret = ptrtoint i8* %s to i32
+  ret i32 %ret
+}
+
+
+;
+; Buffer writes
+;
+
+; EpochLib_WriteByteDirect : integer pointer, integer offset, integer value
+define i32 @"@runtime:EpochLibrary.dll:EpochLib_WriteByteDirect"(i32 %pointer, i32 %offset, i32 %value) alwaysinline {
+entry:
+  %base = inttoptr i32 %pointer to i8*
+  %index = sext i32 %offset to i64
+  %address = getelementptr inbounds i8, i8* %base, i64 %index
+  %byte = trunc i32 %value to i8
+  store i8 %byte, i8* %address, align 1
+  ret i32 0
+}
+
+; EpochLib_WriteDwordDirect : integer pointer, integer offset, integer value
+define i32 @"@runtime:EpochLibrary.dll:EpochLib_WriteDwordDirect"(i32 %pointer, i32 %offset, i32 %value) alwaysinline {
+entry:
+  %base = inttoptr i32 %pointer to i8*
+  %index = sext i32 %offset to i64
+  %address = getelementptr inbounds i8, i8* %base, i64 %index
+  %dword = bitcast i8* %address to i32*
+  store i32 %value, i32* %dword, align 1
+  ret i32 0
+}
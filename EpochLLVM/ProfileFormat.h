@@ -0,0 +1,39 @@
+#pragma once
+
+
+//
+// Profile files written by /instrument builds
+//
+// The instrumented image keeps its profile as one block of data, laid out
+// exactly as the file is. When @init returns, or the program calls
+// ExitProcess, the block is written out verbatim, in this order:
+//
+//  - a ProfileFileHeader
+//  - FunctionCount ProfileFunctionRecords, one per instrumented function
+//  - NameTableSize bytes of null-terminated function names, in record order
+//
+// All fields are little-endian. Cycle counts are inclusive: a function's
+// time includes its callees, except for callees reached by a tail call,
+// since those replace the caller's frame.
+//
+
+#include <stdint.h>
+
+
+const uint32_t ProfileFileMagic = 0x46525045;		// "EPRF"
+const uint32_t ProfileFileVersion = 1;
+
+struct ProfileFileHeader
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t FunctionCount;
+	uint32_t NameTableSize;
+};
+
+struct ProfileFunctionRecord
+{
+	uint64_t CallCount;
+	uint64_t InclusiveCycles;
+};
+
@@ -0,0 +1,94 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "AllocationCounters.h"
+
+
+namespace
+{
+
+	std::atomic<uint64_t> AllocationCount(0);
+	std::atomic<uint64_t> AllocationBytes(0);
+
+
+	void* CountedAllocate(size_t size)
+	{
+		AllocationCount.fetch_add(1, std::memory_order_relaxed);
+		AllocationBytes.fetch_add(size, std::memory_order_relaxed);
+
+		// malloc(0) may return null, which new must not
+		return malloc(size ? size : 1);
+	}
+
+}
+
+
+//
+// Replacements for the global allocation functions
+//
+// Every translation unit linked into the executable, the backend
+// included, reaches these instead of the CRT's own.
+//
+void* operator new(size_t size)
+{
+	void* ptr = CountedAllocate(size);
+	if (!ptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	free(ptr);
+}
+
+
+AllocationCounters GetAllocationCounters()
+{
+	AllocationCounters ret;
+	ret.Count = AllocationCount.load(std::memory_order_relaxed);
+	ret.Bytes = AllocationBytes.load(std::memory_order_relaxed);
+	return ret;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+
+//
+// Heap allocations made through operator new in the benchmark process
+//
+// The backend sources are compiled into the benchmark executable rather
+// than loaded from EpochLLVM.dll, so the replaced global operator new in
+// AllocationCounters.cpp sees every IR, MC and container allocation LLVM
+// makes with new, and the shipping DLL carries no counting code. Blocks
+// LLVM takes straight from malloc (bump allocator slabs, SmallVector
+// growth) do not go through operator new and are not counted. Frees are
+// not counted either.
+//
+// Counters are process-wide and never reset; callers measure a phase by
+// taking the difference across it.
+//
+
+#include <stdint.h>
+
+
+struct AllocationCounters
+{
+	uint64_t Count;
+	uint64_t Bytes;
+};
+
+AllocationCounters GetAllocationCounters();
@@ -0,0 +1,550 @@
+//
+// EpochLLVMBenchmark
+// Throughput benchmark for the EpochLLVM backend
+//
+// Synthesizes a program through the same C interface the Epoch compiler
+// uses, then runs it through code generation and the in-process linker
+// steps, timing each phase separately. The backend sources are compiled
+// into this executable instead of loading EpochLLVM.dll, so that its
+// allocations can be counted:
+//
+//  synthesize    building the IR (functions, calls, string references)
+//  createbinary  optimization and machine code generation
+//  finalize      mapping data sections and resolving addresses
+//  relocate      applying relocations to the output regions
+//
+// Each phase reports wall time, functions and bytes of generated code per
+// second, operator new allocations, and the process's peak working set.
+// Results can be saved as JSON and compared against an earlier run, in
+// which case the exit code is 1 if any phase got slower, or allocated
+// more, by more than the threshold.
+//
+// Usage:
+//   EpochLLVMBenchmark [/functions N] [/calls M] [/strings K] [/iterations I]
+//                      [/conststrings] [/json out.json]
+//                      [/baseline old.json] [/threshold percent]
+//
+
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "AllocationCounters.h"
+#include "EpochLLVMApi.h"
+
+
+#pragma comment(lib, "psapi.lib")
+
+
+namespace
+{
+
+	enum Phase
+	{
+		PhaseSynthesize,
+		PhaseCreateBinary,
+		PhaseFinalize,
+		PhaseRelocate,
+
+		PhaseCount
+	};
+
+	const char* const PhaseNames[PhaseCount] = { "synthesize", "createbinary", "finalize", "relocate" };
+
+
+	struct BenchmarkConfig
+	{
+		unsigned Functions = 1000;
+		unsigned Calls = 10;
+		unsigned Strings = 100;
+		unsigned Iterations = 5;
+		bool ConstantStrings = false;
+
+		std::string JsonOutput;
+		std::string Baseline;
+		double Threshold = 10.0;			// Percent
+	};
+
+	struct PhaseSample
+	{
+		double Seconds = 0.0;
+		uint64_t Allocations = 0;
+		uint64_t AllocatedBytes = 0;
+		uint64_t PeakWorkingSet = 0;
+	};
+
+	struct PhaseResult
+	{
+		std::string Name;
+		double Seconds = 0.0;
+		double FunctionsPerSecond = 0.0;
+		double BytesPerSecond = 0.0;
+		uint64_t Allocations = 0;
+		uint64_t AllocatedBytes = 0;
+		uint64_t PeakWorkingSet = 0;
+	};
+
+
+	// Addresses handed to the backend; they only need to be consistent, since nothing is executed
+	const unsigned ImageBase = 0x400000;
+	const unsigned ThunkOffset = 0x1000;
+	const unsigned StringsOffset = 0x2000;
+	const unsigned XDataOffset = 0x3000;
+	const unsigned GlobalsOffset = 0x4000;
+	const unsigned CodeOffset = 0x10000;
+
+
+	//
+	// Stand-in for the compiler's string pool; each handle gets its own 16-byte slot
+	//
+	size_t __stdcall LookupPooledString(size_t handle)
+	{
+		return ImageBase + StringsOffset + handle * 16;
+	}
+
+
+	uint64_t GetPeakWorkingSet()
+	{
+		PROCESS_MEMORY_COUNTERS counters;
+		if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+			return 0;
+
+		return counters.PeakWorkingSetSize;
+	}
+
+	//
+	// Measures one phase from construction to destruction
+	//
+	class PhaseTimer
+	{
+	public:
+		explicit PhaseTimer(PhaseSample* sample)
+			: Sample(sample)
+		{
+			AllocationCounters counters = GetAllocationCounters();
+			StartAllocations = counters.Count;
+			StartBytes = counters.Bytes;
+			QueryPerformanceCounter(&Start);
+		}
+
+		~PhaseTimer()
+		{
+			LARGE_INTEGER end, frequency;
+			QueryPerformanceCounter(&end);
+			QueryPerformanceFrequency(&frequency);
+
+			AllocationCounters counters = GetAllocationCounters();
+
+			Sample->Seconds = double(end.QuadPart - Start.QuadPart) / double(frequency.QuadPart);
+			Sample->Allocations = counters.Count - StartAllocations;
+			Sample->AllocatedBytes = counters.Bytes - StartBytes;
+			Sample->PeakWorkingSet = GetPeakWorkingSet();
+		}
+
+	private:
+		PhaseSample* Sample;
+		LARGE_INTEGER Start;
+		uint64_t StartAllocations = 0;
+		uint64_t StartBytes = 0;
+	};
+
+
+	//
+	// Build the synthetic program: a chain of functions, each making a mix of
+	// calls to an imported thunk (with a string argument) and to its predecessor
+	//
+	void SynthesizeProgram(LLVMContextHandle context, const BenchmarkConfig& config)
+	{
+		EpochLLVMTypeQueueFunctionParameter(context, EpochLLVMTypeGetString(context));
+		LLVMFunctionType printtype = EpochLLVMTypeCreateFunction(context);
+		LLVMFunctionThunk print = EpochLLVMFunctionCreateThunk(context, printtype, L"print");
+		EpochLLVMFunctionBindThunkImport(context, print, L"Kernel32.dll", L"OutputDebugStringA");
+
+		LLVMFunction init = EpochLLVMFunctionCreate(context, EpochLLVMTypeCreateFunction(context), L"@init");
+		LLVMBasicBlock initblock = EpochLLVMBasicBlockCreate(context, init);
+
+		std::vector<LLVMFunction> functions;
+		functions.reserve(config.Functions);
+
+		unsigned stringindex = 0;
+		for (unsigned i = 0; i < config.Functions; ++i)
+		{
+			std::wstring name = L"benchmark" + std::to_wstring(i);
+			LLVMFunction func = EpochLLVMFunctionCreate(context, EpochLLVMTypeCreateFunction(context), name.c_str());
+			EpochLLVMBasicBlockSetInsertPoint(context, EpochLLVMBasicBlockCreate(context, func));
+
+			for (unsigned j = 0; j < config.Calls; ++j)
+			{
+				if (i > 0 && (j % 2) == 1)
+				{
+					EpochLLVMCodeCreateCall(context, functions.back());
+					continue;
+				}
+
+				LLVMValue str = nullptr;
+				if (config.ConstantStrings)
+				{
+					std::wstring text = L"Benchmark string #" + std::to_wstring(stringindex);
+					str = EpochLLVMCodeGetStringLiteral(context, text.c_str());
+				}
+				else
+				{
+					str = EpochLLVMCodeGetStringValue(context, stringindex);
+				}
+
+				EpochLLVMCodePushValue(context, str);
+				EpochLLVMCodeCreateCallThunk(context, print);
+
+				stringindex = (stringindex + 1) % std::max(1u, config.Strings);
+			}
+
+			EpochLLVMCodeCreateRetVoid(context);
+			functions.push_back(func);
+		}
+
+		EpochLLVMBasicBlockSetInsertPoint(context, initblock);
+		if (!functions.empty())
+			EpochLLVMCodeCreateCall(context, functions.back());
+
+		EpochLLVMCodeCreateRetVoid(context);
+	}
+
+
+	//
+	// Run the whole pipeline once in a fresh context, returning the size of the generated code
+	//
+	unsigned RunPipeline(const BenchmarkConfig& config, PhaseSample* samples)
+	{
+		LLVMContextHandle context = EpochLLVMContextCreate();
+		EpochLLVMContextSetStringPoolCallback(context, reinterpret_cast<void*>(&LookupPooledString));
+
+		{
+			PhaseTimer timer(&samples[PhaseSynthesize]);
+			SynthesizeProgram(context, config);
+		}
+
+		{
+			PhaseTimer timer(&samples[PhaseCreateBinary]);
+			EpochLLVMModuleCreateBinary(context);
+		}
+
+		// Output regions are set up the way the PE writer does it, outside any timed phase
+		unsigned sizes[OutputSectionCount] = {};
+		EpochLLVMModuleGetCodeBuffer(context, &sizes[OutputSectionCode]);
+		EpochLLVMModuleGetPDataBuffer(context, &sizes[OutputSectionPData]);
+		EpochLLVMModuleGetXDataBuffer(context, &sizes[OutputSectionXData]);
+		EpochLLVMModuleGetDebugBuffer(context, &sizes[OutputSectionDebug]);
+		EpochLLVMModuleGetGlobalDataBuffer(context, &sizes[OutputSectionGlobals]);
+		EpochLLVMModuleGetStringDataBuffer(context, &sizes[OutputSectionStrings]);
+
+		std::vector<char> regions[OutputSectionCount];
+		for (unsigned section = 0; section < OutputSectionCount; ++section)
+		{
+			regions[section].resize(sizes[section] + 8);
+			EpochLLVMModuleSetOutputRegion(context, section, regions[section].data(), static_cast<unsigned>(regions[section].size()));
+		}
+
+		unsigned thunkcount = EpochLLVMModuleGetThunkImportCount(context);
+		for (unsigned i = 0; i < thunkcount; ++i)
+			EpochLLVMModuleSetThunkImportAddress(context, i, ImageBase + ThunkOffset + i * 8);
+
+		{
+			PhaseTimer timer(&samples[PhaseFinalize]);
+			EpochLLVMModuleMapGlobalData(context, ImageBase, GlobalsOffset);
+			EpochLLVMModuleMapStringData(context, ImageBase, StringsOffset);
+			EpochLLVMModuleFinalize(context, ImageBase, CodeOffset);
+		}
+
+		{
+			PhaseTimer timer(&samples[PhaseRelocate]);
+			EpochLLVMModuleRelocateBuffers(context, CodeOffset, XDataOffset);
+		}
+
+		EpochLLVMContextDestroy(context);
+		return sizes[OutputSectionCode];
+	}
+
+
+	//
+	// Combine the runs: median time, fewest allocations, highest peak working set
+	//
+	std::vector<PhaseResult> SummarizeRuns(const BenchmarkConfig& config, const std::vector<std::vector<PhaseSample>>& runs, unsigned codesize)
+	{
+		std::vector<PhaseResult> results;
+		for (unsigned phase = 0; phase < PhaseCount; ++phase)
+		{
+			std::vector<double> seconds;
+			PhaseResult result;
+			result.Name = PhaseNames[phase];
+			result.Allocations = UINT64_MAX;
+			result.AllocatedBytes = UINT64_MAX;
+
+			for (const auto& run : runs)
+			{
+				const PhaseSample& sample = run[phase];
+				seconds.push_back(sample.Seconds);
+				result.Allocations = std::min(result.Allocations, sample.Allocations);
+				result.AllocatedBytes = std::min(result.AllocatedBytes, sample.AllocatedBytes);
+				result.PeakWorkingSet = std::max(result.PeakWorkingSet, sample.PeakWorkingSet);
+			}
+
+			std::sort(seconds.begin(), seconds.end());
+			result.Seconds = seconds[seconds.size() / 2];
+
+			if (result.Seconds > 0.0)
+			{
+				result.FunctionsPerSecond = config.Functions / result.Seconds;
+				result.BytesPerSecond = codesize / result.Seconds;
+			}
+
+			results.push_back(result);
+		}
+
+		return results;
+	}
+
+	void PrintResults(const std::vector<PhaseResult>& results)
+	{
+		std::cout << std::left << std::setw(14) << "phase"
+			<< std::right << std::setw(12) << "wall ms"
+			<< std::setw(14) << "functions/s"
+			<< std::setw(12) << "MB/s"
+			<< std::setw(12) << "allocs"
+			<< std::setw(12) << "alloc MB"
+			<< std::setw(14) << "peak RSS MB" << std::endl;
+
+		const double megabyte = 1024.0 * 1024.0;
+		for (const auto& result : results)
+		{
+			std::cout << std::left << std::setw(14) << result.Name << std::right << std::fixed
+				<< std::setw(12) << std::setprecision(2) << (result.Seconds * 1000.0)
+				<< std::setw(14) << std::setprecision(0) << result.FunctionsPerSecond
+				<< std::setw(12) << std::setprecision(2) << (result.BytesPerSecond / megabyte)
+				<< std::setw(12) << result.Allocations
+				<< std::setw(12) << std::setprecision(2) << (result.AllocatedBytes / megabyte)
+				<< std::setw(14) << std::setprecision(1) << (result.PeakWorkingSet / megabyte) << std::endl;
+		}
+	}
+
+
+	bool WriteJson(const std::string& filename, const BenchmarkConfig& config, unsigned codesize, const std::vector<PhaseResult>& results)
+	{
+		std::ofstream out(filename);
+		if (!out)
+			return false;
+
+		out << "{\n";
+		out << "  \"functions\": " << config.Functions << ",\n";
+		out << "  \"calls\": " << config.Calls << ",\n";
+		out << "  \"strings\": " << config.Strings << ",\n";
+		out << "  \"iterations\": " << config.Iterations << ",\n";
+		out << "  \"conststrings\": " << (config.ConstantStrings ? "true" : "false") << ",\n";
+		out << "  \"code_bytes\": " << codesize << ",\n";
+		out << "  \"phases\": [\n";
+
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const PhaseResult& result = results[i];
+			out << "    { \"name\": \"" << result.Name << "\""
+				<< ", \"seconds\": " << std::setprecision(9) << result.Seconds
+				<< ", \"functions_per_second\": " << result.FunctionsPerSecond
+				<< ", \"bytes_per_second\": " << result.BytesPerSecond
+				<< ", \"allocations\": " << result.Allocations
+				<< ", \"allocated_bytes\": " << result.AllocatedBytes
+				<< ", \"peak_working_set\": " << result.PeakWorkingSet
+				<< " }" << (i + 1 < results.size() ? "," : "") << "\n";
+		}
+
+		out << "  ]\n";
+		out << "}\n";
+		return static_cast<bool>(out);
+	}
+
+	//
+	// Read back the phases of a file written by WriteJson
+	//
+	// Only this tool's own output needs to be understood, so each phase is
+	// found by its "name" key and its fields are read from the same line.
+	//
+	bool ReadJson(const std::string& filename, std::vector<PhaseResult>* outResults)
+	{
+		std::ifstream in(filename);
+		if (!in)
+			return false;
+
+		auto readnumber = [](const std::string& line, const char* key, double* out)
+		{
+			std::string pattern = std::string("\"") + key + "\": ";
+			size_t pos = line.find(pattern);
+			if (pos == std::string::npos)
+				return false;
+
+			std::istringstream stream(line.substr(pos + pattern.length()));
+			return static_cast<bool>(stream >> *out);
+		};
+
+		std::string line;
+		while (std::getline(in, line))
+		{
+			const std::string namekey = "\"name\": \"";
+			size_t pos = line.find(namekey);
+			if (pos == std::string::npos)
+				continue;
+
+			size_t start = pos + namekey.length();
+			size_t end = line.find('"', start);
+			if (end == std::string::npos)
+				return false;
+
+			PhaseResult result;
+			result.Name = line.substr(start, end - start);
+
+			double allocations = 0.0;
+			double bytes = 0.0;
+			double peak = 0.0;
+			if (!readnumber(line, "seconds", &result.Seconds) || !readnumber(line, "allocations", &allocations) || !readnumber(line, "allocated_bytes", &bytes) || !readnumber(line, "peak_working_set", &peak))
+				return false;
+
+			readnumber(line, "functions_per_second", &result.FunctionsPerSecond);
+			readnumber(line, "bytes_per_second", &result.BytesPerSecond);
+			result.Allocations = static_cast<uint64_t>(allocations);
+			result.AllocatedBytes = static_cast<uint64_t>(bytes);
+			result.PeakWorkingSet = static_cast<uint64_t>(peak);
+			outResults->push_back(result);
+		}
+
+		return !outResults->empty();
+	}
+
+	//
+	// Compare against a baseline run, returning false if anything regressed past the threshold
+	//
+	// Wall time is noisy, so the threshold should allow for the machine's
+	// jitter; allocation counts are deterministic for a given configuration.
+	//
+	bool CompareWithBaseline(const std::vector<PhaseResult>& results, const std::vector<PhaseResult>& baseline, double threshold)
+	{
+		auto change = [](double current, double previous)
+		{
+			return previous > 0.0 ? (current - previous) * 100.0 / previous : 0.0;
+		};
+
+		bool ok = true;
+		std::cout << std::endl << "Compared with baseline (threshold " << std::setprecision(1) << threshold << "%):" << std::endl;
+
+		for (const auto& result : results)
+		{
+			auto previous = std::find_if(baseline.begin(), baseline.end(), [&](const PhaseResult& p) { return p.Name == result.Name; });
+			if (previous == baseline.end())
+			{
+				std::cout << "  " << std::left << std::setw(14) << result.Name << "not in baseline" << std::endl;
+				continue;
+			}
+
+			double timechange = change(result.Seconds, previous->Seconds);
+			double allocationchange = change(double(result.Allocations), double(previous->Allocations));
+			bool regressed = (timechange > threshold) || (allocationchange > threshold);
+
+			std::cout << "  " << std::left << std::setw(14) << result.Name << std::right << std::showpos << std::fixed << std::setprecision(1)
+				<< std::setw(8) << timechange << "% time"
+				<< std::setw(8) << allocationchange << "% allocations" << std::noshowpos
+				<< (regressed ? "   REGRESSION" : "") << std::endl;
+
+			if (regressed)
+				ok = false;
+		}
+
+		return ok;
+	}
+
+
+	bool ParseArguments(int argc, char* argv[], BenchmarkConfig* config)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			std::string arg = argv[i];
+			bool hasvalue = (i + 1 < argc);
+
+			if (arg == "/conststrings")
+				config->ConstantStrings = true;
+			else if (arg == "/functions" && hasvalue)
+				config->Functions = std::stoul(argv[++i]);
+			else if (arg == "/calls" && hasvalue)
+				config->Calls = std::stoul(argv[++i]);
+			else if (arg == "/strings" && hasvalue)
+				config->Strings = std::stoul(argv[++i]);
+			else if (arg == "/iterations" && hasvalue)
+				config->Iterations = std::max(1ul, std::stoul(argv[++i]));
+			else if (arg == "/json" && hasvalue)
+				config->JsonOutput = argv[++i];
+			else if (arg == "/baseline" && hasvalue)
+				config->Baseline = argv[++i];
+			else if (arg == "/threshold" && hasvalue)
+				config->Threshold = std::stod(argv[++i]);
+			else
+			{
+				std::cout << "Unrecognized argument: " << arg << std::endl;
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	BenchmarkConfig config;
+	if (!ParseArguments(argc, argv, &config))
+		return 2;
+
+	std::cout << "EpochLLVM backend benchmark: " << config.Functions << " functions, " << config.Calls << " calls each, " << config.Strings << " strings" << (config.ConstantStrings ? " (constant)" : "") << std::endl;
+
+	// The first pipeline pays for one-time LLVM initialization, so it is not counted
+	std::vector<PhaseSample> warmup(PhaseCount);
+	unsigned codesize = RunPipeline(config, warmup.data());
+
+	std::vector<std::vector<PhaseSample>> runs;
+	for (unsigned i = 0; i < config.Iterations; ++i)
+	{
+		runs.emplace_back(PhaseCount);
+		codesize = RunPipeline(config, runs.back().data());
+	}
+
+	std::vector<PhaseResult> results = SummarizeRuns(config, runs, codesize);
+
+	std::cout << "Generated " << codesize << " bytes of code; median of " << config.Iterations << " runs" << std::endl << std::endl;
+	PrintResults(results);
+
+	if (!config.JsonOutput.empty() && !WriteJson(config.JsonOutput, config, codesize, results))
+	{
+		std::cout << "Failed to write " << config.JsonOutput << std::endl;
+		return 2;
+	}
+
+	if (!config.Baseline.empty())
+	{
+		std::vector<PhaseResult> baseline;
+		if (!ReadJson(config.Baseline, &baseline))
+		{
+			std::cout << "Failed to read baseline " << config.Baseline << std::endl;
+			return 2;
+		}
+
+		if (!CompareWithBaseline(results, baseline, config.Threshold))
+			return 1;
+	}
+
+	return 0;
+}
+
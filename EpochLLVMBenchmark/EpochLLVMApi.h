@@ -0,0 +1,87 @@
+#pragma once
+
+
+//
+// The parts of the EpochLLVM interface the benchmark and the scheduler tests drive
+//
+// These mirror the exports in EpochLLVM.cpp; LLVM objects are passed
+// around as opaque handles, exactly as the Epoch compiler sees them.
+//
+
+#include <stdint.h>
+
+
+typedef void* LLVMContextHandle;
+typedef void* LLVMType;
+typedef void* LLVMFunctionType;
+typedef void* LLVMFunction;
+typedef void* LLVMFunctionThunk;
+typedef void* LLVMBasicBlock;
+typedef void* LLVMValue;
+
+
+// Section numbers for EpochLLVMModuleSetOutputRegion; must match CodeGen.h
+enum OutputSection : unsigned
+{
+	OutputSectionCode = 0,
+	OutputSectionPData,
+	OutputSectionXData,
+	OutputSectionDebug,
+	OutputSectionGlobals,
+	OutputSectionStrings,
+
+	OutputSectionCount
+};
+
+
+extern "C"
+{
+	LLVMContextHandle EpochLLVMContextCreate();
+	void EpochLLVMContextDestroy(LLVMContextHandle context);
+
+	void EpochLLVMContextSetStringPoolCallback(LLVMContextHandle context, void* functionPointer);
+
+	LLVMFunctionType EpochLLVMTypeCreateFunction(LLVMContextHandle context);
+	void EpochLLVMTypeQueueFunctionParameter(LLVMContextHandle context, LLVMType ty);
+	LLVMType EpochLLVMTypeGetString(LLVMContextHandle context);
+	LLVMType EpochLLVMTypeGetCoroutineHandle(LLVMContextHandle context);
+	LLVMFunctionType EpochLLVMTypeCreateCoroutineFunction(LLVMContextHandle context);
+
+	LLVMFunction EpochLLVMFunctionCreate(LLVMContextHandle context, LLVMFunctionType fty, const wchar_t* wideName);
+	LLVMFunctionThunk EpochLLVMFunctionCreateThunk(LLVMContextHandle context, LLVMFunctionType fty, const wchar_t* wideName);
+	void EpochLLVMFunctionBindThunkImport(LLVMContextHandle context, LLVMFunctionThunk thunk, const wchar_t* wideLibrary, const wchar_t* wideFunction);
+	unsigned EpochLLVMFunctionMakeCoroutine(LLVMContextHandle context, LLVMFunction func);
+
+	LLVMBasicBlock EpochLLVMBasicBlockCreate(LLVMContextHandle context, LLVMFunction func);
+	void EpochLLVMBasicBlockSetInsertPoint(LLVMContextHandle context, LLVMBasicBlock block);
+
+	LLVMValue EpochLLVMCodeCreateCall(LLVMContextHandle context, LLVMFunction target);
+	LLVMValue EpochLLVMCodeCreateCallThunk(LLVMContextHandle context, LLVMFunctionThunk target);
+	void EpochLLVMCodeCreateRetVoid(LLVMContextHandle context);
+	void EpochLLVMCodePushValue(LLVMContextHandle context, LLVMValue value);
+	LLVMValue EpochLLVMCodeGetStringValue(LLVMContextHandle context, unsigned index);
+	LLVMValue EpochLLVMCodeGetStringLiteral(LLVMContextHandle context, const wchar_t* wideText);
+
+	void EpochLLVMCodeCreateSuspend(LLVMContextHandle context);
+	void EpochLLVMCodeCreateCoroutineReturn(LLVMContextHandle context);
+	LLVMValue EpochLLVMCodeGetCoroutineHandle(LLVMContextHandle context);
+
+	void EpochLLVMModuleCreateBinary(LLVMContextHandle context);
+	bool EpochLLVMModuleSetOutputRegion(LLVMContextHandle context, unsigned section, void* destination, unsigned capacity);
+	void EpochLLVMModuleMapGlobalData(LLVMContextHandle context, unsigned moduleBaseAddress, unsigned globalsOffset);
+	void EpochLLVMModuleMapStringData(LLVMContextHandle context, unsigned moduleBaseAddress, unsigned stringsOffset);
+	void EpochLLVMModuleFinalize(LLVMContextHandle context, unsigned moduleBaseAddress, unsigned codeOffset);
+	void EpochLLVMModuleRelocateBuffers(LLVMContextHandle context, unsigned codeOffset, unsigned xDataOffset);
+
+	void* EpochLLVMModuleGetCodeBuffer(LLVMContextHandle context, unsigned* outSize);
+	void* EpochLLVMModuleGetDebugBuffer(LLVMContextHandle context, unsigned* outSize);
+	void* EpochLLVMModuleGetPDataBuffer(LLVMContextHandle context, unsigned* outSize);
+	void* EpochLLVMModuleGetXDataBuffer(LLVMContextHandle context, unsigned* outSize);
+	void* EpochLLVMModuleGetGlobalDataBuffer(LLVMContextHandle context, unsigned* outSize);
+	void* EpochLLVMModuleGetStringDataBuffer(LLVMContextHandle context, unsigned* outSize);
+
+	unsigned EpochLLVMModuleGetThunkImportCount(LLVMContextHandle context);
+	const char* EpochLLVMModuleGetThunkImportFunction(LLVMContextHandle context, unsigned index, unsigned* outLength);
+	void EpochLLVMModuleSetThunkImportAddress(LLVMContextHandle context, unsigned index, unsigned address);
+}
+
@@ -0,0 +1,38 @@
+#include "TaskRuntime.h"
+
+
+//
+// C interface for compiled programs
+//
+// Programs reach this through the EpochParallel_For import that
+// CodeEndParallelFor emits. The runtime is created on first use, with one
+// worker per hardware thread.
+//
+
+namespace
+{
+
+	TaskRuntime& GetProcessRuntime()
+	{
+		static TaskRuntime runtime;
+		return runtime;
+	}
+
+}
+
+
+extern "C"
+{
+
+	void EpochParallel_For(ParallelTask task, void* environment, int64_t begin, int64_t end)
+	{
+		GetProcessRuntime().ParallelFor(task, environment, begin, end);
+	}
+
+	unsigned EpochParallel_GetWorkerCount()
+	{
+		return GetProcessRuntime().GetWorkerCount();
+	}
+
+}
+
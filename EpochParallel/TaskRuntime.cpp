@@ -0,0 +1,275 @@
+#include "TaskRuntime.h"
+
+#include <algorithm>
+
+
+namespace TaskRuntimeInternal
+{
+
+	//
+	// Chunks per worker that a loop is cut into when every worker joins in
+	//
+	// More chunks balance uneven iterations better; fewer keep the per-chunk
+	// overhead down for cheap bodies.
+	//
+	const int64_t ChunksPerWorker = 8;
+
+	// Failed searches for work before an idle worker goes to sleep
+	const unsigned SpinLimit = 64;
+
+	thread_local void* CurrentWorker = nullptr;
+
+	uint32_t NextRandom(uint32_t* seed)
+	{
+		// xorshift32
+		uint32_t x = *seed;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		*seed = x;
+		return x;
+	}
+
+}
+
+using namespace TaskRuntimeInternal;
+
+
+TaskRuntime::TaskRuntime(unsigned workercount)
+{
+	if (workercount == 0)
+		workercount = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned i = 0; i < workercount; ++i)
+	{
+		Workers.emplace_back(new Worker);
+		Workers.back()->Runtime = this;
+		Workers.back()->Index = i;
+		Workers.back()->Seed = 0x9E3779B9u * (i + 1);
+	}
+
+	for (unsigned i = 1; i < workercount; ++i)
+	{
+		Worker* worker = Workers[i].get();
+		worker->Thread = std::thread([this, worker]() { WorkerMain(worker); });
+	}
+}
+
+TaskRuntime::~TaskRuntime()
+{
+	{
+		std::lock_guard<std::mutex> lock(SleepLock);
+		ShuttingDown.store(true);
+	}
+	SleepSignal.notify_all();
+
+	for (auto& worker : Workers)
+	{
+		if (worker->Thread.joinable())
+			worker->Thread.join();
+	}
+}
+
+
+//
+// Run task over [begin, end), returning once every iteration has run
+//
+// May be called from any thread, including from inside another loop's body.
+// Loops started from outside the runtime's workers run one at a time.
+//
+void TaskRuntime::ParallelFor(ParallelTask task, void* environment, int64_t begin, int64_t end)
+{
+	if (end <= begin)
+		return;
+
+	int64_t count = end - begin;
+	int64_t grain = std::max<int64_t>(1, count / (static_cast<int64_t>(Workers.size()) * ChunksPerWorker));
+
+	// Nothing to share, or nobody to share it with
+	if (Workers.size() == 1 || count <= grain)
+	{
+		task(environment, begin, end);
+		return;
+	}
+
+	Worker* self = static_cast<Worker*>(CurrentWorker);
+	std::unique_lock<std::mutex> outside;
+	if (!self || self->Runtime != this)
+	{
+		outside = std::unique_lock<std::mutex>(OutsideCaller);
+		self = Workers[0].get();
+	}
+
+	void* previousworker = CurrentWorker;
+	CurrentWorker = self;
+
+	Loop loop;
+	loop.Task = task;
+	loop.Environment = environment;
+	loop.Grain = grain;
+	loop.Remaining.store(count, std::memory_order_relaxed);
+
+	PostWork(self, new Range{ &loop, begin, end });
+
+	unsigned idle = 0;
+	uint64_t seen = WorkPosted.load();
+	while (loop.Remaining.load(std::memory_order_acquire) > 0)
+	{
+		Range* range = FindWork(self);
+		if (range)
+		{
+			RunRange(self, range);
+			idle = 0;
+			seen = WorkPosted.load();
+			continue;
+		}
+
+		if (++idle < SpinLimit)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		Park(seen, &loop);
+		idle = 0;
+		seen = WorkPosted.load();
+	}
+
+	CurrentWorker = previousworker;
+}
+
+
+void TaskRuntime::WorkerMain(Worker* self)
+{
+	CurrentWorker = self;
+
+	unsigned idle = 0;
+	uint64_t seen = WorkPosted.load();
+	while (!ShuttingDown.load(std::memory_order_relaxed))
+	{
+		Range* range = FindWork(self);
+		if (range)
+		{
+			RunRange(self, range);
+			idle = 0;
+			seen = WorkPosted.load();
+			continue;
+		}
+
+		if (++idle < SpinLimit)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		Park(seen, nullptr);
+		idle = 0;
+		seen = WorkPosted.load();
+	}
+}
+
+//
+// Take a range from this worker's own deque, or else steal one from a random victim
+//
+TaskRuntime::Range* TaskRuntime::FindWork(Worker* self)
+{
+	Range* range = self->Deque.Pop();
+	if (range)
+		return range;
+
+	unsigned count = static_cast<unsigned>(Workers.size());
+	unsigned start = NextRandom(&self->Seed) % count;
+	for (unsigned i = 0; i < count; ++i)
+	{
+		Worker* victim = Workers[(start + i) % count].get();
+		if (victim == self)
+			continue;
+
+		range = victim->Deque.Steal();
+		if (range)
+		{
+			Steals.fetch_add(1, std::memory_order_relaxed);
+			return range;
+		}
+	}
+
+	return nullptr;
+}
+
+void TaskRuntime::RunRange(Worker* self, Range* range)
+{
+	Loop* loop = range->Owner;
+	int64_t begin = range->Begin;
+	int64_t end = range->End;
+	delete range;
+
+	// The loop may be gone as soon as its last iterations are counted, so it
+	// is only touched while this worker still holds some of them.
+	while (begin < end)
+	{
+		if (end - begin > loop->Grain && self->Deque.IsEmpty())
+		{
+			int64_t middle = begin + (end - begin) / 2;
+			PostWork(self, new Range{ loop, middle, end });
+			end = middle;
+			continue;
+		}
+
+		int64_t chunkend = std::min(end, begin + loop->Grain);
+		ParallelTask task = loop->Task;
+		void* environment = loop->Environment;
+		int64_t ran = chunkend - begin;
+
+		task(environment, begin, chunkend);
+		begin = chunkend;
+
+		// The joining thread may be asleep; it is the only one waiting on this
+		if (loop->Remaining.fetch_sub(ran, std::memory_order_acq_rel) == ran)
+		{
+			std::lock_guard<std::mutex> lock(SleepLock);
+			SleepSignal.notify_all();
+		}
+	}
+}
+
+
+//
+// Push a range for this worker or thieves to run, waking a sleeper to take it
+//
+// One sleeper is enough: whoever wakes splits what it steals and posts the
+// other half, waking the next.
+//
+void TaskRuntime::PostWork(Worker* self, Range* range)
+{
+	self->Deque.Push(range);
+	WorkPosted.fetch_add(1);
+
+	if (Sleeping.load() > 0)
+	{
+		std::lock_guard<std::mutex> lock(SleepLock);
+		SleepSignal.notify_one();
+	}
+}
+
+//
+// Sleep until work is posted after seen was read, the runtime shuts down, or the joined loop finishes
+//
+// Sleeping is raised before WorkPosted is checked, and PostWork bumps
+// WorkPosted before it checks Sleeping, so one side always sees the other.
+//
+void TaskRuntime::Park(uint64_t seen, const Loop* joining)
+{
+	std::unique_lock<std::mutex> lock(SleepLock);
+	Sleeping.fetch_add(1);
+
+	SleepSignal.wait(lock, [this, seen, joining]()
+	{
+		if (ShuttingDown.load() || WorkPosted.load() != seen)
+			return true;
+
+		return joining && joining->Remaining.load(std::memory_order_acquire) == 0;
+	});
+
+	Sleeping.fetch_sub(1);
+}
+
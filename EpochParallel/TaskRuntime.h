@@ -0,0 +1,109 @@
+#pragma once
+
+
+//
+// Work-stealing runtime for parallel loops compiled by EpochLLVM
+//
+// Each worker thread owns a Chase-Lev deque of iteration ranges. A loop
+// starts out as one range on the deque of the thread that runs it. Ranges
+// are split in half lazily, only while the splitting worker has nothing
+// queued for others to steal, and are otherwise run in grain-sized chunks.
+// Loops that are spread across idle workers therefore split finely, while
+// loops on a busy pool barely split at all.
+//
+// The thread that starts a loop works on it until every iteration has run,
+// which is the loop's join barrier. It may run other ranges while it waits,
+// including ranges of loops nested inside this one.
+//
+// Threads that find nothing to run spin briefly, then sleep until another
+// range is pushed or, for a joining thread, until its loop finishes. Every
+// push bumps a counter, so a thread that looked for work before the push
+// and sleeps after it sees the change and does not miss the wakeup.
+//
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "WorkStealingDeque.h"
+
+
+//
+// One slice of a parallel loop body, covering iterations [begin, end)
+//
+typedef void (*ParallelTask)(void* environment, int64_t begin, int64_t end);
+
+
+class TaskRuntime
+{
+public:
+	explicit TaskRuntime(unsigned workercount = 0);
+	~TaskRuntime();
+
+	TaskRuntime(const TaskRuntime&) = delete;
+	TaskRuntime& operator=(const TaskRuntime&) = delete;
+
+public:
+	void ParallelFor(ParallelTask task, void* environment, int64_t begin, int64_t end);
+
+	unsigned GetWorkerCount() const
+	{
+		return static_cast<unsigned>(Workers.size());
+	}
+
+	uint64_t GetStealCount() const
+	{
+		return Steals.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Loop
+	{
+		ParallelTask Task;
+		void* Environment;
+		int64_t Grain;
+		std::atomic<int64_t> Remaining;			// Iterations not yet run; zero releases the join
+	};
+
+	struct Range
+	{
+		Loop* Owner;
+		int64_t Begin;
+		int64_t End;
+	};
+
+	struct Worker
+	{
+		TaskRuntime* Runtime = nullptr;
+		unsigned Index = 0;
+		uint32_t Seed = 0;
+		WorkStealingDeque<Range> Deque;
+		std::thread Thread;
+	};
+
+private:
+	void WorkerMain(Worker* self);
+	Range* FindWork(Worker* self);
+	void RunRange(Worker* self, Range* range);
+
+	void PostWork(Worker* self, Range* range);
+	void Park(uint64_t seen, const Loop* joining);
+
+private:
+	// Worker 0 has no thread of its own; it stands in for whichever outside thread is running a loop
+	std::vector<std::unique_ptr<Worker>> Workers;
+	std::mutex OutsideCaller;
+
+	std::atomic<bool> ShuttingDown{ false };
+	std::atomic<uint64_t> WorkPosted{ 0 };			// Bumped after every push
+	std::atomic<unsigned> Sleeping{ 0 };
+	std::mutex SleepLock;
+	std::condition_variable SleepSignal;
+
+	std::atomic<uint64_t> Steals{ 0 };
+};
+
@@ -0,0 +1,149 @@
+#pragma once
+
+
+//
+// Chase-Lev work-stealing deque
+//
+// The owning worker pushes and pops at the bottom; any other thread may
+// steal from the top. The orderings follow Le, Pop, Cohen and Zappa
+// Nardelli, "Correct and Efficient Work-Stealing for Weak Memory Models".
+//
+// Elements must be pointers, so that an empty deque can be reported as
+// nullptr. Capacities are powers of two and double as needed. Outgrown
+// arrays are kept until the deque is destroyed, since a thief may still be
+// reading from one.
+//
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+template<typename T>
+class WorkStealingDeque
+{
+public:
+	explicit WorkStealingDeque(int64_t capacity = 64)
+	{
+		Arrays.emplace_back(new Array(capacity));
+		Buffer.store(Arrays.back().get(), std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque&) = delete;
+	WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+public:
+	// Owner only
+	void Push(T* item)
+	{
+		int64_t bottom = Bottom.load(std::memory_order_relaxed);
+		int64_t top = Top.load(std::memory_order_acquire);
+		Array* array = Buffer.load(std::memory_order_relaxed);
+
+		if (bottom - top > array->Capacity - 1)
+			array = Grow(array, bottom, top);
+
+		array->Put(bottom, item);
+		Bottom.store(bottom + 1, std::memory_order_release);
+	}
+
+	// Owner only
+	T* Pop()
+	{
+		int64_t bottom = Bottom.load(std::memory_order_relaxed) - 1;
+		Array* array = Buffer.load(std::memory_order_relaxed);
+		Bottom.store(bottom, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t top = Top.load(std::memory_order_relaxed);
+
+		if (top > bottom)
+		{
+			Bottom.store(bottom + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		T* item = array->Get(bottom);
+		if (top == bottom)
+		{
+			// Last item; race any thief for it
+			if (!Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				item = nullptr;
+
+			Bottom.store(bottom + 1, std::memory_order_relaxed);
+		}
+
+		return item;
+	}
+
+	// Any thread
+	T* Steal()
+	{
+		int64_t top = Top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t bottom = Bottom.load(std::memory_order_acquire);
+
+		if (top >= bottom)
+			return nullptr;
+
+		Array* array = Buffer.load(std::memory_order_acquire);
+		T* item = array->Get(top);
+		if (!Top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return nullptr;
+
+		return item;
+	}
+
+	// Owner only; a hint, since thieves may be emptying it concurrently
+	bool IsEmpty() const
+	{
+		return Bottom.load(std::memory_order_relaxed) <= Top.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Array
+	{
+		explicit Array(int64_t capacity)
+			: Capacity(capacity),
+			  Mask(capacity - 1),
+			  Slots(new std::atomic<T*>[static_cast<size_t>(capacity)])
+		{
+		}
+
+		T* Get(int64_t index) const
+		{
+			return Slots[index & Mask].load(std::memory_order_relaxed);
+		}
+
+		void Put(int64_t index, T* item)
+		{
+			Slots[index & Mask].store(item, std::memory_order_relaxed);
+		}
+
+		int64_t Capacity;
+		int64_t Mask;
+		std::unique_ptr<std::atomic<T*>[]> Slots;
+	};
+
+	Array* Grow(Array* array, int64_t bottom, int64_t top)
+	{
+		Arrays.emplace_back(new Array(array->Capacity * 2));
+		Array* grown = Arrays.back().get();
+
+		for (int64_t i = top; i < bottom; ++i)
+			grown->Put(i, array->Get(i));
+
+		Buffer.store(grown, std::memory_order_release);
+		return grown;
+	}
+
+private:
+	// Thieves hammer Top while the owner works on Bottom; keep them on separate cache lines
+	std::atomic<int64_t> Top{ 0 };
+	char Padding[64 - sizeof(std::atomic<int64_t>)];
+	std::atomic<int64_t> Bottom{ 0 };
+	std::atomic<Array*> Buffer;
+
+	std::vector<std::unique_ptr<Array>> Arrays;		// Owner only
+};
+
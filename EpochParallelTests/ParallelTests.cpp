@@ -0,0 +1,445 @@
+//
+// EpochParallelTests
+// Native tests for the work-stealing deque and the parallel loop runtime
+//
+// The deque tests race an owner against several thieves and check that
+// every pushed item is taken exactly once, including when owner and
+// thieves fight over the last item. The runtime tests run loops of
+// assorted shapes on pools of 1 to 8 workers and check that every
+// iteration runs exactly once, then time a compute-bound loop to check
+// that more workers actually make it faster. The speedup check is skipped
+// on machines with a single hardware thread.
+//
+// Prints one line per test and exits with the number of failures.
+//
+
+#include "TaskRuntime.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+	bool Check(bool condition, const char* what)
+	{
+		if (!condition)
+			std::cout << "  check failed: " << what << std::endl;
+
+		return condition;
+	}
+
+	//
+	// Check that each of count items or iterations was seen exactly once
+	//
+	bool CheckExactlyOnce(const std::vector<std::atomic<unsigned>>& seen, const char* what)
+	{
+		size_t missing = 0;
+		size_t repeated = 0;
+		for (const auto& count : seen)
+		{
+			unsigned value = count.load();
+			if (value == 0)
+				++missing;
+			else if (value > 1)
+				++repeated;
+		}
+
+		if (missing == 0 && repeated == 0)
+			return true;
+
+		std::cout << "  " << what << ": " << missing << " missing, " << repeated << " repeated" << std::endl;
+		return false;
+	}
+
+
+	//
+	// Work-stealing deque
+	//
+
+	bool TestDequeOrder()
+	{
+		WorkStealingDeque<int> deque(4);
+		int items[10];
+
+		for (int i = 0; i < 10; ++i)
+		{
+			items[i] = i;
+			deque.Push(&items[i]);
+		}
+
+		// Thieves take the oldest items, the owner the newest; pushing ten into four slots grew it twice
+		bool pass = true;
+		pass &= Check(deque.Steal() == &items[0], "steal takes the oldest item");
+		pass &= Check(deque.Steal() == &items[1], "steal takes the next oldest item");
+		pass &= Check(deque.Pop() == &items[9], "pop takes the newest item");
+		pass &= Check(deque.Pop() == &items[8], "pop takes the next newest item");
+
+		unsigned remaining = 0;
+		while (deque.Pop())
+			++remaining;
+
+		pass &= Check(remaining == 6, "every other item is still there");
+		pass &= Check(deque.IsEmpty(), "deque is empty");
+		pass &= Check(deque.Pop() == nullptr && deque.Steal() == nullptr, "empty deque gives nullptr");
+		return pass;
+	}
+
+	//
+	// Owner pushes in bursts and pops some back while thieves steal
+	//
+	bool TestDequePushPopStealRace()
+	{
+		const unsigned itemcount = 200000;
+		const unsigned thiefcount = 3;
+
+		std::vector<unsigned> items(itemcount);
+		std::vector<std::atomic<unsigned>> seen(itemcount);
+		for (unsigned i = 0; i < itemcount; ++i)
+			items[i] = i;
+
+		WorkStealingDeque<unsigned> deque(8);
+		std::atomic<bool> done{ false };
+
+		std::vector<std::thread> thieves;
+		for (unsigned t = 0; t < thiefcount; ++t)
+		{
+			thieves.emplace_back([&]()
+			{
+				while (!done.load())
+				{
+					unsigned* item = deque.Steal();
+					if (item)
+						seen[*item].fetch_add(1);
+					else
+						std::this_thread::yield();
+				}
+			});
+		}
+
+		for (unsigned i = 0; i < itemcount; ++i)
+		{
+			deque.Push(&items[i]);
+
+			if (i % 3 == 0)
+			{
+				unsigned* item = deque.Pop();
+				if (item)
+					seen[*item].fetch_add(1);
+			}
+		}
+
+		while (unsigned* item = deque.Pop())
+			seen[*item].fetch_add(1);
+
+		done.store(true);
+		for (auto& thief : thieves)
+			thief.join();
+
+		return CheckExactlyOnce(seen, "items taken");
+	}
+
+	//
+	// Owner and thieves race for a lone item, over and over
+	//
+	bool TestDequeLastItemRace()
+	{
+		const unsigned itemcount = 100000;
+		const unsigned thiefcount = 2;
+
+		std::vector<unsigned> items(itemcount);
+		std::vector<std::atomic<unsigned>> seen(itemcount);
+		for (unsigned i = 0; i < itemcount; ++i)
+			items[i] = i;
+
+		WorkStealingDeque<unsigned> deque;
+		std::atomic<bool> done{ false };
+
+		std::vector<std::thread> thieves;
+		for (unsigned t = 0; t < thiefcount; ++t)
+		{
+			thieves.emplace_back([&]()
+			{
+				while (!done.load())
+				{
+					unsigned* item = deque.Steal();
+					if (item)
+						seen[*item].fetch_add(1);
+				}
+			});
+		}
+
+		for (unsigned i = 0; i < itemcount; ++i)
+		{
+			deque.Push(&items[i]);
+
+			unsigned* item = deque.Pop();
+			if (item)
+				seen[*item].fetch_add(1);
+		}
+
+		done.store(true);
+		for (auto& thief : thieves)
+			thief.join();
+
+		return CheckExactlyOnce(seen, "items taken");
+	}
+
+
+	//
+	// Parallel loops
+	//
+
+	struct CountingLoop
+	{
+		int64_t Base;
+		std::vector<std::atomic<unsigned>>* Seen;
+	};
+
+	void CountIterations(void* environment, int64_t begin, int64_t end)
+	{
+		CountingLoop* loop = static_cast<CountingLoop*>(environment);
+		for (int64_t i = begin; i < end; ++i)
+			(*loop->Seen)[static_cast<size_t>(i - loop->Base)].fetch_add(1);
+	}
+
+	bool RunCountingLoop(TaskRuntime& runtime, int64_t begin, int64_t end)
+	{
+		std::vector<std::atomic<unsigned>> seen(static_cast<size_t>(end - begin));
+		CountingLoop loop = { begin, &seen };
+
+		runtime.ParallelFor(&CountIterations, &loop, begin, end);
+		return CheckExactlyOnce(seen, "iterations run");
+	}
+
+	bool TestLoopShapes()
+	{
+		bool pass = true;
+		for (unsigned workers = 1; workers <= 8; workers *= 2)
+		{
+			TaskRuntime runtime(workers);
+			pass &= Check(runtime.GetWorkerCount() == workers, "pool has the requested workers");
+
+			pass &= RunCountingLoop(runtime, 0, 1);
+			pass &= RunCountingLoop(runtime, 0, 7);
+			pass &= RunCountingLoop(runtime, -500, 500);
+			pass &= RunCountingLoop(runtime, 1000, 101000);
+
+			for (unsigned repeat = 0; repeat < 100; ++repeat)
+				pass &= RunCountingLoop(runtime, 0, 4096);
+
+			// Empty and reversed ranges run nothing
+			std::vector<std::atomic<unsigned>> none(1);
+			CountingLoop loop = { 0, &none };
+			runtime.ParallelFor(&CountIterations, &loop, 5, 5);
+			runtime.ParallelFor(&CountIterations, &loop, 5, 0);
+			pass &= Check(none[0].load() == 0, "empty ranges run nothing");
+		}
+
+		return pass;
+	}
+
+
+	struct NestedLoop
+	{
+		TaskRuntime* Runtime;
+		int64_t Columns;
+		std::vector<std::atomic<unsigned>>* Seen;
+	};
+
+	struct NestedRow
+	{
+		NestedLoop* Outer;
+		int64_t Row;
+	};
+
+	void CountNestedColumns(void* environment, int64_t begin, int64_t end)
+	{
+		NestedRow* row = static_cast<NestedRow*>(environment);
+		for (int64_t column = begin; column < end; ++column)
+			(*row->Outer->Seen)[static_cast<size_t>(row->Row * row->Outer->Columns + column)].fetch_add(1);
+	}
+
+	void RunNestedRows(void* environment, int64_t begin, int64_t end)
+	{
+		NestedLoop* loop = static_cast<NestedLoop*>(environment);
+		for (int64_t row = begin; row < end; ++row)
+		{
+			NestedRow inner = { loop, row };
+			loop->Runtime->ParallelFor(&CountNestedColumns, &inner, 0, loop->Columns);
+		}
+	}
+
+	bool TestNestedLoops()
+	{
+		bool pass = true;
+		for (unsigned workers = 1; workers <= 8; workers *= 2)
+		{
+			TaskRuntime runtime(workers);
+
+			const int64_t rows = 64;
+			const int64_t columns = 1000;
+			std::vector<std::atomic<unsigned>> seen(static_cast<size_t>(rows * columns));
+			NestedLoop loop = { &runtime, columns, &seen };
+
+			runtime.ParallelFor(&RunNestedRows, &loop, 0, rows);
+			pass &= CheckExactlyOnce(seen, "nested iterations run");
+		}
+
+		return pass;
+	}
+
+	//
+	// Several outside threads start loops on one runtime at once
+	//
+	bool TestConcurrentCallers()
+	{
+		TaskRuntime runtime(4);
+
+		const unsigned callers = 4;
+		std::atomic<unsigned> failures{ 0 };
+
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < callers; ++t)
+		{
+			threads.emplace_back([&]()
+			{
+				for (unsigned repeat = 0; repeat < 50; ++repeat)
+				{
+					std::vector<std::atomic<unsigned>> seen(10000);
+					CountingLoop loop = { 0, &seen };
+					runtime.ParallelFor(&CountIterations, &loop, 0, 10000);
+
+					for (const auto& count : seen)
+					{
+						if (count.load() != 1)
+						{
+							failures.fetch_add(1);
+							break;
+						}
+					}
+				}
+			});
+		}
+
+		for (auto& thread : threads)
+			thread.join();
+
+		return Check(failures.load() == 0, "every caller's loop ran each iteration once");
+	}
+
+
+	//
+	// Compute-bound loop for timing; each iteration hashes its own index
+	//
+	void HashIterations(void* environment, int64_t begin, int64_t end)
+	{
+		uint32_t* out = static_cast<uint32_t*>(environment);
+		for (int64_t i = begin; i < end; ++i)
+		{
+			uint32_t x = static_cast<uint32_t>(i) + 1;
+			for (unsigned round = 0; round < 2000; ++round)
+			{
+				x ^= x << 13;
+				x ^= x >> 17;
+				x ^= x << 5;
+			}
+
+			out[i] = x;
+		}
+	}
+
+	double TimeHashLoop(unsigned workers, std::vector<uint32_t>* out)
+	{
+		TaskRuntime runtime(workers);
+
+		// Best of three, so one unlucky run does not decide the result
+		double best = 0.0;
+		for (unsigned run = 0; run < 3; ++run)
+		{
+			auto start = std::chrono::steady_clock::now();
+			runtime.ParallelFor(&HashIterations, out->data(), 0, static_cast<int64_t>(out->size()));
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			if (run == 0 || seconds < best)
+				best = seconds;
+		}
+
+		return best;
+	}
+
+	bool TestSpeedup()
+	{
+		unsigned hardware = std::thread::hardware_concurrency();
+
+		std::vector<uint32_t> serial(20000);
+		std::vector<uint32_t> parallel(serial.size());
+		double baseline = TimeHashLoop(1, &serial);
+
+		bool pass = true;
+		double best = 1.0;
+		for (unsigned workers = 2; workers <= std::max(2u, std::min(hardware, 16u)); workers *= 2)
+		{
+			std::fill(parallel.begin(), parallel.end(), 0);
+			double seconds = TimeHashLoop(workers, &parallel);
+			double speedup = baseline / seconds;
+
+			std::cout << "  " << workers << " workers: " << speedup << "x" << std::endl;
+			pass &= Check(parallel == serial, "parallel results match the serial run");
+
+			best = std::max(best, speedup);
+		}
+
+		if (hardware < 2)
+		{
+			std::cout << "  speedup not checked with " << hardware << " hardware thread(s)" << std::endl;
+			return pass;
+		}
+
+		// Expect at least 60% efficiency from up to four hardware threads
+		double expected = 0.6 * std::min(hardware, 4u);
+		pass &= Check(best >= expected, "loop runs faster with more workers");
+		return pass;
+	}
+
+
+	struct TestCase
+	{
+		const char* Name;
+		bool (*Run)();
+	};
+
+	const TestCase Tests[] =
+	{
+		{ "deque order", &TestDequeOrder },
+		{ "deque push/pop/steal race", &TestDequePushPopStealRace },
+		{ "deque last item race", &TestDequeLastItemRace },
+		{ "loop shapes", &TestLoopShapes },
+		{ "nested loops", &TestNestedLoops },
+		{ "concurrent callers", &TestConcurrentCallers },
+		{ "speedup", &TestSpeedup },
+	};
+
+}
+
+
+int main()
+{
+	int failures = 0;
+	for (const TestCase& test : Tests)
+	{
+		bool pass = test.Run();
+		std::cout << (pass ? "PASS " : "FAIL ") << test.Name << std::endl;
+
+		if (!pass)
+			++failures;
+	}
+
+	std::cout << failures << " of " << (sizeof(Tests) / sizeof(Tests[0])) << " tests failed" << std::endl;
+	return failures;
+}
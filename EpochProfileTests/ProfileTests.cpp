@@ -0,0 +1,213 @@
+//
+// EpochProfileTests
+// End-to-end test for /instrument builds
+//
+// Builds an Epoch program with the real compiler and the /instrument
+// switch, runs the resulting image, and reads back the profile that
+// @profile:flush leaves next to it. This is the only test that executes
+// generated code, so it needs a built EpochCompiler.exe and EpochLLVM.dll:
+//
+//     EpochProfileTests <EpochCompiler.exe> <program.epoch>
+//
+// The program should be Tests\Standalone\HelloWorld.epoch, or any other
+// whose entry point runs once and returns.
+//
+// Prints one line per test and exits with the number of failures.
+//
+
+#include "ProfileReader.h"
+
+#include <windows.h>
+
+#include <iostream>
+#include <string>
+
+
+namespace
+{
+
+	std::string CompilerPath;
+	std::string SourcePath;
+	std::string ImagePath;
+	std::string ProfilePath;
+
+
+	bool Check(bool condition, const char* what)
+	{
+		if (!condition)
+			std::cout << "  check failed: " << what << std::endl;
+
+		return condition;
+	}
+
+	//
+	// Run a command line to completion and return its exit code, or -1 if it could not start
+	//
+	int RunProcess(std::string commandline)
+	{
+		STARTUPINFOA startup;
+		ZeroMemory(&startup, sizeof(startup));
+		startup.cb = sizeof(startup);
+
+		PROCESS_INFORMATION process;
+		if (!CreateProcessA(nullptr, &commandline[0], nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &process))
+		{
+			std::cout << "  cannot start " << commandline << ": error " << GetLastError() << std::endl;
+			return -1;
+		}
+
+		WaitForSingleObject(process.hProcess, INFINITE);
+
+		DWORD exitcode = 0;
+		GetExitCodeProcess(process.hProcess, &exitcode);
+
+		CloseHandle(process.hThread);
+		CloseHandle(process.hProcess);
+		return static_cast<int>(exitcode);
+	}
+
+	//
+	// Run the instrumented image and load the profile it writes
+	//
+	bool RunAndLoadProfile(ProfileReader& reader)
+	{
+		DeleteFileA(ProfilePath.c_str());
+
+		if (!Check(RunProcess("\"" + ImagePath + "\"") == 0, "instrumented program exits with 0"))
+			return false;
+
+		if (!reader.Load(ProfilePath))
+		{
+			std::cout << "  " << reader.GetError() << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+
+	const ProfileFunction* FindFunction(const ProfileReader& reader, const std::string& name)
+	{
+		for (const auto& function : reader.GetFunctions())
+		{
+			if (function.Name == name)
+				return &function;
+		}
+
+		return nullptr;
+	}
+
+
+	//
+	// Tests
+	//
+
+	bool TestInstrumentedBuild()
+	{
+		DeleteFileA(ImagePath.c_str());
+
+		int result = RunProcess("\"" + CompilerPath + "\" /files \"" + SourcePath + "\" /output \"" + ImagePath + "\" /instrument");
+		bool pass = true;
+		pass &= Check(result == 0, "compiler exits with 0");
+		pass &= Check(GetFileAttributesA(ImagePath.c_str()) != INVALID_FILE_ATTRIBUTES, "compiler writes the image");
+		return pass;
+	}
+
+	bool TestProfileFlushedOnReturn()
+	{
+		ProfileReader reader;
+		if (!RunAndLoadProfile(reader))
+			return false;
+
+		// @init is the caller, not a profiled function, so the entry point is the only one called
+		const ProfileFunction* entrypoint = FindFunction(reader, "entrypoint");
+
+		bool pass = true;
+		pass &= Check(entrypoint != nullptr, "profile has a record for entrypoint");
+		pass &= Check(FindFunction(reader, "@init") == nullptr, "@init is not profiled");
+		pass &= Check(reader.GetHotFunctions().size() == 1, "only entrypoint was called");
+		if (entrypoint)
+		{
+			pass &= Check(entrypoint->CallCount == 1, "entrypoint was called once");
+			pass &= Check(entrypoint->InclusiveCycles > 0, "entrypoint took some cycles");
+		}
+
+		return pass;
+	}
+
+	bool TestProfileReplacedOnEachRun()
+	{
+		ProfileReader first;
+		ProfileReader second;
+		if (!RunAndLoadProfile(first) || !RunAndLoadProfile(second))
+			return false;
+
+		// Counters start from zero in every process, and the file is recreated rather than appended to
+		bool pass = true;
+		pass &= Check(first.GetFunctions().size() == second.GetFunctions().size(), "both runs profile the same functions");
+
+		const ProfileFunction* entrypoint = FindFunction(second, "entrypoint");
+		pass &= Check(entrypoint && entrypoint->CallCount == 1, "the second run counts its own call only");
+		return pass;
+	}
+
+
+	struct TestCase
+	{
+		const char* Name;
+		bool (*Run)();
+	};
+
+	const TestCase Tests[] =
+	{
+		{ "instrumented build", &TestInstrumentedBuild },
+		{ "profile flushed on return", &TestProfileFlushedOnReturn },
+		{ "profile replaced on each run", &TestProfileReplacedOnEachRun },
+	};
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		std::cout << "Usage: EpochProfileTests <EpochCompiler.exe> <program.epoch>" << std::endl;
+		return 1;
+	}
+
+	CompilerPath = argv[1];
+	SourcePath = argv[2];
+
+	char directory[MAX_PATH];
+	if (!GetTempPathA(MAX_PATH, directory))
+	{
+		std::cout << "Cannot find the temporary directory" << std::endl;
+		return 1;
+	}
+
+	// The profile path is the image path with its extension replaced, as the compiler derives it
+	ImagePath = std::string(directory) + "EpochProfileTest.exe";
+	ProfilePath = std::string(directory) + "EpochProfileTest.eprof";
+
+	int failures = 0;
+	for (const TestCase& test : Tests)
+	{
+		bool pass = test.Run();
+		std::cout << (pass ? "PASS " : "FAIL ") << test.Name << std::endl;
+
+		if (!pass)
+		{
+			++failures;
+
+			// Later tests run the image the first one builds
+			if (test.Run == &TestInstrumentedBuild)
+				break;
+		}
+	}
+
+	DeleteFileA(ImagePath.c_str());
+	DeleteFileA(ProfilePath.c_str());
+
+	std::cout << failures << " of " << (sizeof(Tests) / sizeof(Tests[0])) << " tests failed" << std::endl;
+	return failures;
+}
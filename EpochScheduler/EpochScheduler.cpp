@@ -0,0 +1,63 @@
+#include "Scheduler.h"
+
+
+//
+// C interface for compiled programs
+//
+// Programs bind these through ordinary thunk imports. There is a single
+// scheduler per process, created on first use; its Run must be called from
+// the thread that spawns and suspends tasks.
+//
+
+namespace
+{
+
+	Scheduler& GetProcessScheduler()
+	{
+		static Scheduler scheduler;
+		return scheduler;
+	}
+
+}
+
+
+extern "C"
+{
+
+	void EpochScheduler_Spawn(CoroutineHandle coroutine)
+	{
+		GetProcessScheduler().Spawn(coroutine);
+	}
+
+	void EpochScheduler_Yield(CoroutineHandle coroutine)
+	{
+		GetProcessScheduler().YieldTask(coroutine);
+	}
+
+	void EpochScheduler_Sleep(CoroutineHandle coroutine, uint32_t milliseconds)
+	{
+		GetProcessScheduler().SleepTask(coroutine, milliseconds);
+	}
+
+	unsigned EpochScheduler_AssociateHandle(HANDLE handle)
+	{
+		return GetProcessScheduler().AssociateHandle(handle) ? 1 : 0;
+	}
+
+	void EpochScheduler_WaitForIO(CoroutineHandle coroutine, OVERLAPPED* overlapped)
+	{
+		GetProcessScheduler().WaitForIO(coroutine, overlapped);
+	}
+
+	unsigned EpochScheduler_Wake(CoroutineHandle coroutine)
+	{
+		return GetProcessScheduler().Wake(coroutine) ? 1 : 0;
+	}
+
+	unsigned EpochScheduler_Run()
+	{
+		return GetProcessScheduler().Run();
+	}
+
+}
+
@@ -0,0 +1,199 @@
+#include "Scheduler.h"
+
+
+namespace SchedulerInternal
+{
+
+	//
+	// Completion key for packets posted by Wake, as opposed to finished I/O
+	//
+	// Handles given to AssociateHandle use key 0; a wake packet carries the
+	// coroutine handle in place of its OVERLAPPED pointer.
+	//
+	const ULONG_PTR WakeCompletionKey = 1;
+
+	const ULONG CompletionBatchSize = 64;
+
+}
+
+using namespace SchedulerInternal;
+
+
+Scheduler::Scheduler()
+{
+	CompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+}
+
+Scheduler::~Scheduler()
+{
+	// Tasks still owned by the scheduler never get to finish, but their frames are
+	// released. Frames of tasks waiting on I/O are leaked, since the kernel may
+	// still write to their OVERLAPPED structures.
+	for (CoroutineHandle coroutine : ReadyQueue)
+		Destroy(coroutine);
+
+	while (!Sleepers.empty())
+	{
+		Destroy(Sleepers.top().Coroutine);
+		Sleepers.pop();
+	}
+
+	if (CompletionPort)
+		CloseHandle(CompletionPort);
+}
+
+
+void Scheduler::Spawn(CoroutineHandle coroutine)
+{
+	// A task that finished without ever suspending is reaped by Run like any other
+	++LiveTasks;
+	ReadyQueue.push_back(coroutine);
+}
+
+void Scheduler::YieldTask(CoroutineHandle coroutine)
+{
+	ReadyQueue.push_back(coroutine);
+}
+
+void Scheduler::SleepTask(CoroutineHandle coroutine, uint32_t milliseconds)
+{
+	Sleepers.push({ GetTickCount64() + milliseconds, SleepSequence++, coroutine });
+}
+
+bool Scheduler::AssociateHandle(HANDLE handle)
+{
+	return CreateIoCompletionPort(handle, CompletionPort, 0, 0) == CompletionPort;
+}
+
+//
+// Resume the coroutine once the overlapped operation completes
+//
+// The handle the operation was started on must have been associated with
+// the scheduler first.
+//
+void Scheduler::WaitForIO(CoroutineHandle coroutine, OVERLAPPED* overlapped)
+{
+	IOWaits[overlapped] = coroutine;
+}
+
+//
+// Make a parked task ready again; safe to call from any thread
+//
+bool Scheduler::Wake(CoroutineHandle coroutine)
+{
+	return PostQueuedCompletionStatus(CompletionPort, 0, WakeCompletionKey, reinterpret_cast<OVERLAPPED*>(coroutine)) != FALSE;
+}
+
+
+//
+// Run tasks until every spawned task has finished
+//
+// Each pass resumes the tasks that were ready when it began, so a task that
+// keeps yielding cannot starve timers or I/O. Returns the number of tasks
+// that ran to completion.
+//
+unsigned Scheduler::Run()
+{
+	unsigned completed = 0;
+
+	while (LiveTasks > 0)
+	{
+		size_t ready = ReadyQueue.size();
+		while (ready-- > 0)
+		{
+			CoroutineHandle coroutine = ReadyQueue.front();
+			ReadyQueue.pop_front();
+
+			if (RunTask(coroutine))
+				++completed;
+		}
+
+		WakeSleepers();
+
+		if (LiveTasks == 0)
+			break;
+
+		DWORD timeout = INFINITE;
+		if (!ReadyQueue.empty())
+			timeout = 0;
+		else if (!Sleepers.empty())
+		{
+			ULONGLONG now = GetTickCount64();
+			ULONGLONG deadline = Sleepers.top().Deadline;
+			timeout = (deadline > now) ? static_cast<DWORD>(deadline - now) : 0;
+		}
+
+		WaitForCompletions(timeout);
+	}
+
+	return completed;
+}
+
+
+void Scheduler::Resume(CoroutineHandle coroutine)
+{
+	reinterpret_cast<CoroutineFrameHeader*>(coroutine)->ResumeFn(coroutine);
+}
+
+void Scheduler::Destroy(CoroutineHandle coroutine)
+{
+	reinterpret_cast<CoroutineFrameHeader*>(coroutine)->DestroyFn(coroutine);
+}
+
+bool Scheduler::IsDone(CoroutineHandle coroutine)
+{
+	return reinterpret_cast<CoroutineFrameHeader*>(coroutine)->ResumeFn == nullptr;
+}
+
+
+//
+// Resume a ready task, and reap it if that finished it
+//
+bool Scheduler::RunTask(CoroutineHandle coroutine)
+{
+	if (!IsDone(coroutine))
+		Resume(coroutine);
+
+	if (!IsDone(coroutine))
+		return false;
+
+	Destroy(coroutine);
+	--LiveTasks;
+	return true;
+}
+
+void Scheduler::WakeSleepers()
+{
+	ULONGLONG now = GetTickCount64();
+	while (!Sleepers.empty() && Sleepers.top().Deadline <= now)
+	{
+		ReadyQueue.push_back(Sleepers.top().Coroutine);
+		Sleepers.pop();
+	}
+}
+
+void Scheduler::WaitForCompletions(DWORD timeout)
+{
+	OVERLAPPED_ENTRY entries[CompletionBatchSize];
+	ULONG count = 0;
+	if (!GetQueuedCompletionStatusEx(CompletionPort, entries, CompletionBatchSize, &count, timeout, FALSE))
+		return;
+
+	for (ULONG i = 0; i < count; ++i)
+	{
+		if (entries[i].lpCompletionKey == WakeCompletionKey)
+		{
+			ReadyQueue.push_back(reinterpret_cast<CoroutineHandle>(entries[i].lpOverlapped));
+			continue;
+		}
+
+		// Completions for operations nobody is waiting on are dropped
+		auto iter = IOWaits.find(entries[i].lpOverlapped);
+		if (iter == IOWaits.end())
+			continue;
+
+		ReadyQueue.push_back(iter->second);
+		IOWaits.erase(iter);
+	}
+}
+
@@ -0,0 +1,106 @@
+#pragma once
+
+
+//
+// Scheduler for coroutines compiled by EpochLLVM
+//
+// A coroutine is started by calling it, which runs it to its first
+// suspension point and returns its handle. Handing the handle to Spawn
+// gives the scheduler ownership: from then on the task is resumed only by
+// Run, and destroyed by Run once it reaches its final suspension point.
+//
+// Before suspending, a task says how it wants to be resumed by calling
+// exactly one of YieldTask, SleepTask or WaitForIO with its own handle. A
+// task that suspends without doing so is parked until someone calls Wake.
+//
+// Everything runs on the thread that calls Run. Only Wake may be called
+// from other threads.
+//
+
+#include <windows.h>
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+
+
+typedef void* CoroutineHandle;
+
+
+//
+// Start of every coroutine frame
+//
+// This is the layout LLVM's switch lowering gives the frames it builds;
+// the resume pointer is cleared once the coroutine reaches its final
+// suspension point. EpochLLVM gives both functions the C convention after
+// splitting coroutines, so they can be called through these pointers.
+//
+struct CoroutineFrameHeader
+{
+	void (*ResumeFn)(CoroutineHandle);
+	void (*DestroyFn)(CoroutineHandle);
+};
+
+
+class Scheduler
+{
+public:
+	Scheduler();
+	~Scheduler();
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+public:
+	void Spawn(CoroutineHandle coroutine);
+
+	void YieldTask(CoroutineHandle coroutine);
+	void SleepTask(CoroutineHandle coroutine, uint32_t milliseconds);
+
+	bool AssociateHandle(HANDLE handle);
+	void WaitForIO(CoroutineHandle coroutine, OVERLAPPED* overlapped);
+
+	bool Wake(CoroutineHandle coroutine);
+
+	unsigned Run();
+
+public:
+	static void Resume(CoroutineHandle coroutine);
+	static void Destroy(CoroutineHandle coroutine);
+	static bool IsDone(CoroutineHandle coroutine);
+
+private:
+	struct SleepingTask
+	{
+		ULONGLONG Deadline;
+		uint64_t Sequence;
+		CoroutineHandle Coroutine;
+
+		bool operator>(const SleepingTask& other) const
+		{
+			if (Deadline != other.Deadline)
+				return Deadline > other.Deadline;
+
+			return Sequence > other.Sequence;
+		}
+	};
+
+private:
+	bool RunTask(CoroutineHandle coroutine);
+	void WakeSleepers();
+	void WaitForCompletions(DWORD timeout);
+
+private:
+	HANDLE CompletionPort = nullptr;
+
+	std::deque<CoroutineHandle> ReadyQueue;
+	std::priority_queue<SleepingTask, std::vector<SleepingTask>, std::greater<SleepingTask>> Sleepers;
+	std::map<OVERLAPPED*, CoroutineHandle> IOWaits;
+
+	unsigned LiveTasks = 0;
+	uint64_t SleepSequence = 0;
+};
+
@@ -0,0 +1,611 @@
+//
+// EpochSchedulerTests
+// In-process tests for the coroutine scheduler
+//
+// Most tests drive Scheduler directly with hand-built coroutine frames
+// instead of code compiled by EpochLLVM. Each frame has the header LLVM's
+// switch lowering produces, followed by a step function that plays the
+// part of the coroutine body between two suspension points. That keeps
+// them independent of the code generator, and lets them check exactly
+// which task the scheduler resumes when.
+//
+// The last test compiles a coroutine with EpochLLVM.dll and runs it under
+// the scheduler, so that the frame layout and the convention of the resume
+// and destroy functions are those the backend really produces.
+//
+// Prints one line per test and exits with the number of failures.
+//
+
+#include "Scheduler.h"
+#include "EpochLLVMApi.h"
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace
+{
+
+	struct TaskLog
+	{
+		std::vector<int> Resumed;
+		unsigned Destroyed = 0;
+	};
+
+
+	//
+	// Hand-built coroutine frame
+	//
+	// Step runs once per resumption and returns true when the body has
+	// reached its final suspension point. Before returning false it must
+	// tell the scheduler how to resume the task, just as compiled code does.
+	//
+	struct TestTask
+	{
+		CoroutineFrameHeader Header;
+
+		bool (*Step)(TestTask* self);
+		Scheduler* Owner;
+		TaskLog* Log;
+		int Id;
+
+		unsigned Steps = 0;
+		uint32_t Milliseconds = 0;
+		volatile bool* Flag = nullptr;
+
+		HANDLE File = INVALID_HANDLE_VALUE;
+		OVERLAPPED Overlapped;
+		DWORD* Written = nullptr;
+	};
+
+
+	void ResumeTestTask(CoroutineHandle coroutine)
+	{
+		TestTask* task = static_cast<TestTask*>(coroutine);
+		task->Log->Resumed.push_back(task->Id);
+
+		if (task->Step(task))
+			task->Header.ResumeFn = nullptr;
+	}
+
+	void DestroyTestTask(CoroutineHandle coroutine)
+	{
+		TestTask* task = static_cast<TestTask*>(coroutine);
+		++task->Log->Destroyed;
+		delete task;
+	}
+
+	TestTask* CreateTestTask(Scheduler* owner, TaskLog* log, int id, bool (*step)(TestTask*))
+	{
+		TestTask* task = new TestTask;
+		task->Header.ResumeFn = &ResumeTestTask;
+		task->Header.DestroyFn = &DestroyTestTask;
+		task->Step = step;
+		task->Owner = owner;
+		task->Log = log;
+		task->Id = id;
+		ZeroMemory(&task->Overlapped, sizeof(task->Overlapped));
+		return task;
+	}
+
+
+	//
+	// Step functions
+	//
+
+	bool StepYield(TestTask* self)
+	{
+		if (--self->Steps == 0)
+			return true;
+
+		self->Owner->YieldTask(self);
+		return false;
+	}
+
+	bool StepSleep(TestTask* self)
+	{
+		if (--self->Steps == 0)
+			return true;
+
+		self->Owner->SleepTask(self, self->Milliseconds);
+		return false;
+	}
+
+	bool StepYieldUntilFlag(TestTask* self)
+	{
+		if (*self->Flag)
+			return true;
+
+		++self->Steps;
+		self->Owner->YieldTask(self);
+		return false;
+	}
+
+	bool StepSleepThenSetFlag(TestTask* self)
+	{
+		if (self->Steps++ > 0)
+		{
+			*self->Flag = true;
+			return true;
+		}
+
+		self->Owner->SleepTask(self, self->Milliseconds);
+		return false;
+	}
+
+	bool StepPark(TestTask* self)
+	{
+		// Suspend without rescheduling; only Wake brings the task back
+		return self->Steps++ > 0;
+	}
+
+	const char IOPayload[] = "EpochScheduler overlapped write";
+
+	bool StepWriteFile(TestTask* self)
+	{
+		if (self->Steps++ == 0)
+		{
+			self->Owner->WaitForIO(self, &self->Overlapped);
+			if (!WriteFile(self->File, IOPayload, sizeof(IOPayload), nullptr, &self->Overlapped) && GetLastError() != ERROR_IO_PENDING)
+			{
+				std::cout << "WriteFile failed with error " << GetLastError() << std::endl;
+				return true;
+			}
+
+			return false;
+		}
+
+		if (!GetOverlappedResult(self->File, &self->Overlapped, self->Written, FALSE))
+			*self->Written = 0;
+
+		return true;
+	}
+
+
+	//
+	// Coroutines compiled by EpochLLVM
+	//
+	// The generated program's imports are bound to the functions below
+	// rather than to DLL exports, apart from the Kernel32 heap functions
+	// that coroutine frames are allocated with.
+	//
+
+	Scheduler* CompiledTaskOwner = nullptr;
+	unsigned CompiledTaskSteps = 0;
+
+	int SpawnCompiledTask(CoroutineHandle coroutine)
+	{
+		CompiledTaskOwner->Spawn(coroutine);
+		return 0;
+	}
+
+	int YieldCompiledTask(CoroutineHandle coroutine)
+	{
+		CompiledTaskOwner->YieldTask(coroutine);
+		return 0;
+	}
+
+	int CountCompiledTaskStep()
+	{
+		++CompiledTaskSteps;
+		return 0;
+	}
+
+
+	// The backend takes 32 bit addresses, so the image goes at a fixed low address
+	const uintptr_t CompiledImageBase = 0x20000000;
+	const unsigned CompiledThunkOffset = 0x1000;
+	const unsigned CompiledPageSize = 0x1000;
+
+	typedef int (*CompiledEntryPoint)();
+
+
+	//
+	// Build a task that counts a step and suspends, then counts a step,
+	// yields and suspends, then counts a last step and finishes. @init
+	// starts it and hands its handle to the scheduler.
+	//
+	bool SynthesizeCompiledTask(LLVMContextHandle context)
+	{
+		LLVMType handle = EpochLLVMTypeGetCoroutineHandle(context);
+
+		EpochLLVMTypeQueueFunctionParameter(context, handle);
+		LLVMFunctionThunk spawn = EpochLLVMFunctionCreateThunk(context, EpochLLVMTypeCreateFunction(context), L"spawn");
+		EpochLLVMFunctionBindThunkImport(context, spawn, L"EpochSchedulerTests.exe", L"SpawnCompiledTask");
+
+		EpochLLVMTypeQueueFunctionParameter(context, handle);
+		LLVMFunctionThunk yield = EpochLLVMFunctionCreateThunk(context, EpochLLVMTypeCreateFunction(context), L"yield");
+		EpochLLVMFunctionBindThunkImport(context, yield, L"EpochSchedulerTests.exe", L"YieldCompiledTask");
+
+		LLVMFunctionThunk step = EpochLLVMFunctionCreateThunk(context, EpochLLVMTypeCreateFunction(context), L"step");
+		EpochLLVMFunctionBindThunkImport(context, step, L"EpochSchedulerTests.exe", L"CountCompiledTaskStep");
+
+		LLVMFunction init = EpochLLVMFunctionCreate(context, EpochLLVMTypeCreateFunction(context), L"@init");
+		LLVMBasicBlock initblock = EpochLLVMBasicBlockCreate(context, init);
+
+		LLVMFunction task = EpochLLVMFunctionCreate(context, EpochLLVMTypeCreateCoroutineFunction(context), L"task");
+		EpochLLVMBasicBlockSetInsertPoint(context, EpochLLVMBasicBlockCreate(context, task));
+		if (!EpochLLVMFunctionMakeCoroutine(context, task))
+			return false;
+
+		EpochLLVMCodeCreateCallThunk(context, step);
+		EpochLLVMCodeCreateSuspend(context);
+
+		EpochLLVMCodeCreateCallThunk(context, step);
+		EpochLLVMCodePushValue(context, EpochLLVMCodeGetCoroutineHandle(context));
+		EpochLLVMCodeCreateCallThunk(context, yield);
+		EpochLLVMCodeCreateSuspend(context);
+
+		EpochLLVMCodeCreateCallThunk(context, step);
+		EpochLLVMCodeCreateCoroutineReturn(context);
+
+		EpochLLVMBasicBlockSetInsertPoint(context, initblock);
+		EpochLLVMCodePushValue(context, EpochLLVMCodeCreateCall(context, task));
+		EpochLLVMCodeCreateCallThunk(context, spawn);
+		EpochLLVMCodeCreateRetVoid(context);
+		return true;
+	}
+
+	unsigned AlignToPage(unsigned offset)
+	{
+		return (offset + CompiledPageSize - 1) & ~(CompiledPageSize - 1);
+	}
+
+	//
+	// Lay the generated sections out at CompiledImageBase, the way the PE
+	// writer lays out an image, and bind the imports
+	//
+	// Returns @init, which the backend keeps at the start of the code, or
+	// nullptr if the image cannot be loaded.
+	//
+	CompiledEntryPoint LoadCompiledImage(LLVMContextHandle context, std::vector<char>* debug)
+	{
+		unsigned sizes[OutputSectionCount] = {};
+		EpochLLVMModuleGetCodeBuffer(context, &sizes[OutputSectionCode]);
+		EpochLLVMModuleGetPDataBuffer(context, &sizes[OutputSectionPData]);
+		EpochLLVMModuleGetXDataBuffer(context, &sizes[OutputSectionXData]);
+		EpochLLVMModuleGetDebugBuffer(context, &sizes[OutputSectionDebug]);
+		EpochLLVMModuleGetGlobalDataBuffer(context, &sizes[OutputSectionGlobals]);
+		EpochLLVMModuleGetStringDataBuffer(context, &sizes[OutputSectionStrings]);
+
+		unsigned thunkcount = EpochLLVMModuleGetThunkImportCount(context);
+
+		// Debug records are never executed, so only they stay outside the image
+		unsigned offsets[OutputSectionCount] = {};
+		unsigned imagesize = AlignToPage(CompiledThunkOffset + thunkcount * 8);
+		for (unsigned section = 0; section < OutputSectionCount; ++section)
+		{
+			if (section == OutputSectionDebug)
+				continue;
+
+			offsets[section] = imagesize;
+			imagesize = AlignToPage(imagesize + sizes[section] + 8);
+		}
+
+		char* base = static_cast<char*>(VirtualAlloc(reinterpret_cast<void*>(CompiledImageBase), imagesize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE));
+		if (!base)
+		{
+			std::cout << "  cannot map the image at its base address: error " << GetLastError() << std::endl;
+			return nullptr;
+		}
+
+		debug->resize(sizes[OutputSectionDebug] + 8);
+		for (unsigned section = 0; section < OutputSectionCount; ++section)
+		{
+			if (section == OutputSectionDebug)
+				EpochLLVMModuleSetOutputRegion(context, section, debug->data(), static_cast<unsigned>(debug->size()));
+			else
+				EpochLLVMModuleSetOutputRegion(context, section, base + offsets[section], sizes[section] + 8);
+		}
+
+		HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+		void** slots = reinterpret_cast<void**>(base + CompiledThunkOffset);
+		for (unsigned i = 0; i < thunkcount; ++i)
+		{
+			unsigned length = 0;
+			const char* name = EpochLLVMModuleGetThunkImportFunction(context, i, &length);
+			std::string function(name, length);
+
+			if (function == "SpawnCompiledTask")
+				slots[i] = reinterpret_cast<void*>(&SpawnCompiledTask);
+			else if (function == "YieldCompiledTask")
+				slots[i] = reinterpret_cast<void*>(&YieldCompiledTask);
+			else if (function == "CountCompiledTaskStep")
+				slots[i] = reinterpret_cast<void*>(&CountCompiledTaskStep);
+			else
+				slots[i] = reinterpret_cast<void*>(GetProcAddress(kernel32, function.c_str()));
+
+			if (!slots[i])
+			{
+				std::cout << "  no address for import " << function << std::endl;
+				VirtualFree(base, 0, MEM_RELEASE);
+				return nullptr;
+			}
+
+			EpochLLVMModuleSetThunkImportAddress(context, i, static_cast<unsigned>(CompiledImageBase + CompiledThunkOffset + i * 8));
+		}
+
+		EpochLLVMModuleMapGlobalData(context, static_cast<unsigned>(CompiledImageBase), offsets[OutputSectionGlobals]);
+		EpochLLVMModuleMapStringData(context, static_cast<unsigned>(CompiledImageBase), offsets[OutputSectionStrings]);
+		EpochLLVMModuleFinalize(context, static_cast<unsigned>(CompiledImageBase), offsets[OutputSectionCode]);
+		EpochLLVMModuleRelocateBuffers(context, offsets[OutputSectionCode], offsets[OutputSectionXData]);
+
+		FlushInstructionCache(GetCurrentProcess(), base, imagesize);
+		return reinterpret_cast<CompiledEntryPoint>(base + offsets[OutputSectionCode]);
+	}
+
+
+	bool Check(bool condition, const char* what)
+	{
+		if (!condition)
+			std::cout << "  check failed: " << what << std::endl;
+
+		return condition;
+	}
+
+	bool CheckOrder(const std::vector<int>& actual, const std::vector<int>& expected)
+	{
+		if (actual == expected)
+			return true;
+
+		std::cout << "  resumed";
+		for (int id : actual)
+			std::cout << " " << id;
+
+		std::cout << ", expected";
+		for (int id : expected)
+			std::cout << " " << id;
+
+		std::cout << std::endl;
+		return false;
+	}
+
+
+	//
+	// Tests
+	//
+
+	bool TestFinishedTasksAreReaped()
+	{
+		TaskLog log;
+		Scheduler scheduler;
+
+		for (int i = 0; i < 3; ++i)
+		{
+			TestTask* task = CreateTestTask(&scheduler, &log, i, &StepYield);
+			task->Header.ResumeFn = nullptr;
+			scheduler.Spawn(task);
+		}
+
+		bool pass = true;
+		pass &= Check(scheduler.Run() == 3, "Run reports every task as completed");
+		pass &= Check(log.Resumed.empty(), "finished tasks are not resumed");
+		pass &= Check(log.Destroyed == 3, "finished tasks are destroyed");
+		return pass;
+	}
+
+	bool TestYieldIsRoundRobin()
+	{
+		TaskLog log;
+		Scheduler scheduler;
+
+		for (int i = 0; i < 3; ++i)
+		{
+			TestTask* task = CreateTestTask(&scheduler, &log, i, &StepYield);
+			task->Steps = 3;
+			scheduler.Spawn(task);
+		}
+
+		bool pass = true;
+		pass &= Check(scheduler.Run() == 3, "Run reports every task as completed");
+		pass &= CheckOrder(log.Resumed, { 0, 1, 2, 0, 1, 2, 0, 1, 2 });
+		pass &= Check(log.Destroyed == 3, "every task is destroyed");
+		return pass;
+	}
+
+	bool TestSleepersWakeByDeadline()
+	{
+		TaskLog log;
+		Scheduler scheduler;
+
+		const uint32_t sleeps[] = { 90, 30, 60, 30 };
+		for (int i = 0; i < 4; ++i)
+		{
+			TestTask* task = CreateTestTask(&scheduler, &log, i, &StepSleep);
+			task->Steps = 2;
+			task->Milliseconds = sleeps[i];
+			scheduler.Spawn(task);
+		}
+
+		ULONGLONG start = GetTickCount64();
+		unsigned completed = scheduler.Run();
+		ULONGLONG elapsed = GetTickCount64() - start;
+
+		// Equal deadlines keep the order the tasks went to sleep in
+		bool pass = true;
+		pass &= Check(completed == 4, "Run reports every task as completed");
+		pass &= CheckOrder(log.Resumed, { 0, 1, 2, 3, 1, 3, 2, 0 });
+		pass &= Check(elapsed >= 90 - 16, "Run waits for the longest sleep");
+		return pass;
+	}
+
+	bool TestYieldingDoesNotStarveSleepers()
+	{
+		TaskLog log;
+		Scheduler scheduler;
+		volatile bool flag = false;
+
+		TestTask* spinner = CreateTestTask(&scheduler, &log, 0, &StepYieldUntilFlag);
+		spinner->Flag = &flag;
+		scheduler.Spawn(spinner);
+
+		TestTask* sleeper = CreateTestTask(&scheduler, &log, 1, &StepSleepThenSetFlag);
+		sleeper->Flag = &flag;
+		sleeper->Milliseconds = 20;
+		scheduler.Spawn(sleeper);
+
+		bool pass = true;
+		pass &= Check(scheduler.Run() == 2, "Run reports both tasks as completed");
+		pass &= Check(flag, "the sleeper ran while the other task kept yielding");
+		pass &= Check(log.Destroyed == 2, "both tasks are destroyed");
+		return pass;
+	}
+
+	bool TestWakeFromAnotherThread()
+	{
+		TaskLog log;
+		Scheduler scheduler;
+
+		TestTask* task = CreateTestTask(&scheduler, &log, 0, &StepPark);
+		scheduler.Spawn(task);
+
+		std::thread waker([&scheduler, task]()
+		{
+			Sleep(20);
+			scheduler.Wake(task);
+		});
+
+		unsigned completed = scheduler.Run();
+		waker.join();
+
+		bool pass = true;
+		pass &= Check(completed == 1, "Run reports the parked task as completed");
+		pass &= CheckOrder(log.Resumed, { 0, 0 });
+		return pass;
+	}
+
+	bool TestOverlappedWriteResumesTask()
+	{
+		char directory[MAX_PATH];
+		char path[MAX_PATH];
+		if (!GetTempPathA(MAX_PATH, directory) || !GetTempFileNameA(directory, "eps", 0, path))
+			return Check(false, "temporary file name");
+
+		HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return Check(false, "temporary file opens for overlapped writes");
+
+		TaskLog log;
+		DWORD written = 0;
+		bool pass = true;
+		{
+			Scheduler scheduler;
+			pass &= Check(scheduler.AssociateHandle(file), "AssociateHandle succeeds");
+
+			TestTask* task = CreateTestTask(&scheduler, &log, 0, &StepWriteFile);
+			task->File = file;
+			task->Written = &written;
+			scheduler.Spawn(task);
+
+			pass &= Check(scheduler.Run() == 1, "Run reports the task as completed");
+		}
+
+		pass &= CheckOrder(log.Resumed, { 0, 0 });
+		pass &= Check(written == sizeof(IOPayload), "the whole payload was written");
+		CloseHandle(file);
+		return pass;
+	}
+
+	bool TestDestructorReleasesUnfinishedTasks()
+	{
+		TaskLog log;
+		{
+			Scheduler scheduler;
+			for (int i = 0; i < 2; ++i)
+			{
+				TestTask* task = CreateTestTask(&scheduler, &log, i, &StepYield);
+				task->Steps = 2;
+				scheduler.Spawn(task);
+			}
+		}
+
+		bool pass = true;
+		pass &= Check(log.Resumed.empty(), "tasks never run without Run");
+		pass &= Check(log.Destroyed == 2, "the destructor releases the frames");
+		return pass;
+	}
+
+	//
+	// The scheduler calls the resume and destroy functions in the frame as
+	// plain C function pointers. If the backend left them fastcc, each one
+	// would pop the caller's shadow area on return and this test would
+	// crash in Scheduler::Resume rather than fail a check.
+	//
+	bool TestCompiledCoroutineRuns()
+	{
+		LLVMContextHandle context = EpochLLVMContextCreate();
+		if (!SynthesizeCompiledTask(context))
+		{
+			EpochLLVMContextDestroy(context);
+			return Check(false, "the task is made a coroutine");
+		}
+
+		EpochLLVMModuleCreateBinary(context);
+
+		std::vector<char> debug;
+		CompiledEntryPoint init = LoadCompiledImage(context, &debug);
+		if (!init)
+		{
+			EpochLLVMContextDestroy(context);
+			return Check(false, "the generated image loads");
+		}
+
+		CompiledTaskSteps = 0;
+
+		bool pass = true;
+		{
+			Scheduler scheduler;
+			CompiledTaskOwner = &scheduler;
+
+			pass &= Check(init() == 0, "@init returns 0");
+			pass &= Check(CompiledTaskSteps == 1, "calling the task runs it to its first suspension point");
+			pass &= Check(scheduler.Run() == 1, "Run reports the task as completed");
+			pass &= Check(CompiledTaskSteps == 3, "the scheduler resumes the task until it finishes");
+
+			CompiledTaskOwner = nullptr;
+		}
+
+		EpochLLVMContextDestroy(context);
+		VirtualFree(reinterpret_cast<void*>(CompiledImageBase), 0, MEM_RELEASE);
+		return pass;
+	}
+
+
+	struct TestCase
+	{
+		const char* Name;
+		bool (*Run)();
+	};
+
+	const TestCase Tests[] =
+	{
+		{ "finished tasks are reaped", &TestFinishedTasksAreReaped },
+		{ "yield is round robin", &TestYieldIsRoundRobin },
+		{ "sleepers wake by deadline", &TestSleepersWakeByDeadline },
+		{ "yielding does not starve sleepers", &TestYieldingDoesNotStarveSleepers },
+		{ "wake from another thread", &TestWakeFromAnotherThread },
+		{ "overlapped write resumes task", &TestOverlappedWriteResumesTask },
+		{ "destructor releases unfinished tasks", &TestDestructorReleasesUnfinishedTasks },
+		{ "compiled coroutine runs", &TestCompiledCoroutineRuns },
+	};
+
+}
+
+
+int main()
+{
+	int failures = 0;
+	for (const TestCase& test : Tests)
+	{
+		bool pass = test.Run();
+		std::cout << (pass ? "PASS " : "FAIL ") << test.Name << std::endl;
+
+		if (!pass)
+			++failures;
+	}
+
+	std::cout << failures << " of " << (sizeof(Tests) / sizeof(Tests[0])) << " tests failed" << std::endl;
+	return failures;
+}
@@ -0,0 +1,59 @@
+//
+// EpochProfile - hot function report for /instrument profiles
+//
+// Usage: EpochProfile <profile.eprof> [count]
+//
+// Lists the functions that were called, hottest first, with their share of
+// the program's cycles. count limits the report to that many functions.
+//
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "ProfileReader.h"
+
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		std::cout << "Usage: EpochProfile <profile.eprof> [count]" << std::endl;
+		return 1;
+	}
+
+	size_t limit = 0;
+	if (argc > 2)
+		limit = std::stoul(argv[2]);
+
+	ProfileReader reader;
+	if (!reader.Load(argv[1]))
+	{
+		std::cout << "*** ERROR: " << reader.GetError() << std::endl;
+		return 2;
+	}
+
+	std::vector<ProfileFunction> hot = reader.GetHotFunctions();
+	if (limit && hot.size() > limit)
+		hot.resize(limit);
+
+	uint64_t total = std::max<uint64_t>(reader.GetTotalCycles(), 1);
+
+	std::cout << reader.GetFunctions().size() << " functions instrumented, " << reader.GetHotFunctions().size() << " called" << std::endl << std::endl;
+	std::cout << std::setw(8) << "% time" << std::setw(20) << "cycles" << std::setw(14) << "calls" << std::setw(16) << "cycles/call" << "  function" << std::endl;
+
+	for (const auto& function : hot)
+	{
+		double percent = 100.0 * function.InclusiveCycles / total;
+
+		std::cout << std::fixed << std::setprecision(2) << std::setw(8) << percent;
+		std::cout << std::setw(20) << function.InclusiveCycles;
+		std::cout << std::setw(14) << function.CallCount;
+		std::cout << std::setw(16) << (function.InclusiveCycles / function.CallCount);
+		std::cout << "  " << function.Name << std::endl;
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,104 @@
+#include "ProfileReader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+
+bool ProfileReader::Fail(const std::string& message)
+{
+	Functions.clear();
+	Error = message;
+	return false;
+}
+
+//
+// Read and validate a whole profile file
+//
+// On failure the reader is left empty and GetError describes the problem.
+//
+bool ProfileReader::Load(const std::string& filename)
+{
+	Functions.clear();
+	Error.clear();
+
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+		return Fail("Cannot open " + filename);
+
+	std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	ProfileFileHeader header;
+	if (data.size() < sizeof(header))
+		return Fail("File is too small to be a profile");
+
+	memcpy(&header, data.data(), sizeof(header));
+	if (header.Magic != ProfileFileMagic)
+		return Fail("File is not an Epoch profile");
+
+	if (header.Version != ProfileFileVersion)
+		return Fail("Unsupported profile version " + std::to_string(header.Version));
+
+	size_t recordsize = static_cast<size_t>(header.FunctionCount) * sizeof(ProfileFunctionRecord);
+	if (data.size() < sizeof(header) + recordsize + header.NameTableSize)
+		return Fail("Profile is truncated");
+
+	const char* records = data.data() + sizeof(header);
+	const char* names = records + recordsize;
+	const char* namesend = names + header.NameTableSize;
+
+	for (uint32_t i = 0; i < header.FunctionCount; ++i)
+	{
+		ProfileFunctionRecord record;
+		memcpy(&record, records + i * sizeof(record), sizeof(record));
+
+		const char* nameend = std::find(names, namesend, '\0');
+		if (nameend == namesend)
+			return Fail("Profile name table is truncated");
+
+		ProfileFunction function;
+		function.Name.assign(names, nameend);
+		function.CallCount = record.CallCount;
+		function.InclusiveCycles = record.InclusiveCycles;
+		Functions.push_back(function);
+
+		names = nameend + 1;
+	}
+
+	return true;
+}
+
+//
+// Functions that were called at least once, hottest (most inclusive cycles) first
+//
+std::vector<ProfileFunction> ProfileReader::GetHotFunctions() const
+{
+	std::vector<ProfileFunction> ret;
+	std::copy_if(Functions.begin(), Functions.end(), std::back_inserter(ret), [](const ProfileFunction& f) { return f.CallCount > 0; });
+
+	std::stable_sort(ret.begin(), ret.end(), [](const ProfileFunction& a, const ProfileFunction& b)
+	{
+		if (a.InclusiveCycles != b.InclusiveCycles)
+			return a.InclusiveCycles > b.InclusiveCycles;
+
+		return a.CallCount > b.CallCount;
+	});
+
+	return ret;
+}
+
+//
+// Cycles spent in the program, taken as the largest inclusive time of any function
+//
+// Inclusive times nest, so summing them would count callees more than once.
+//
+uint64_t ProfileReader::GetTotalCycles() const
+{
+	uint64_t total = 0;
+	for (const auto& function : Functions)
+		total = std::max(total, function.InclusiveCycles);
+
+	return total;
+}
+
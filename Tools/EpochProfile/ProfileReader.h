@@ -0,0 +1,49 @@
+#pragma once
+
+
+//
+// Reader for profiles written by /instrument builds
+//
+// See EpochLLVM/ProfileFormat.h for the file layout.
+//
+
+#include <string>
+#include <vector>
+
+#include "ProfileFormat.h"
+
+
+struct ProfileFunction
+{
+	std::string Name;
+	uint64_t CallCount;
+	uint64_t InclusiveCycles;
+};
+
+
+class ProfileReader
+{
+public:
+	bool Load(const std::string& filename);
+
+	const std::string& GetError() const
+	{
+		return Error;
+	}
+
+	const std::vector<ProfileFunction>& GetFunctions() const
+	{
+		return Functions;
+	}
+
+	std::vector<ProfileFunction> GetHotFunctions() const;
+	uint64_t GetTotalCycles() const;
+
+private:
+	bool Fail(const std::string& message);
+
+private:
+	std::vector<ProfileFunction> Functions;
+	std::string Error;
+};
+